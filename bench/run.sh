@@ -0,0 +1,155 @@
+#!/usr/bin/env bash
+# Runs the benchmarks in this directory and reports them as JSON:
+#
+#   bench/run.sh [-n runs] [-o output] [-b baseline] [-t percent] [-u] clox [name...]
+#
+# Each benchmark, or each one named, runs `runs` times (5 by default) with its
+# output thrown away. The report gives the median and 95th percentile wall
+# time in milliseconds, and the instructions executed, counted by a run with
+# --profile=ops, with how many of them run a second at the median. Besides
+# the .lox files, "compile" runs a large generated source, for the speed of
+# the front end.
+#
+# The report is compared against the baseline (bench/baseline.json by
+# default): a benchmark whose median is more than `percent` (10 by default)
+# slower is a regression, listed on stderr, and the script exits with 1.
+# With -u the report becomes the new baseline instead. Timings are only
+# comparable on the machine the baseline was recorded on, with the binary
+# built by `make release`.
+
+set -euo pipefail
+
+dir=$(cd "$(dirname "$0")" && pwd)
+runs=5
+output=
+baseline=$dir/baseline.json
+threshold=10
+update=0
+
+usage()
+{
+    echo "usage: $0 [-n runs] [-o output] [-b baseline] [-t percent] [-u] clox [name...]" >&2
+    exit 64
+}
+
+while getopts "n:o:b:t:u" option; do
+    case $option in
+    n) runs=$OPTARG ;;
+    o) output=$OPTARG ;;
+    b) baseline=$OPTARG ;;
+    t) threshold=$OPTARG ;;
+    u) update=1 ;;
+    *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -ge 1 ] || usage
+clox=$1
+shift
+[ -x "$clox" ] || { echo "$clox is not an executable" >&2; exit 66; }
+
+generated=$(mktemp --suffix=.lox)
+trap 'rm -f "$generated"' EXIT
+
+# a few thousand small functions and the calls to them, compiled once and run
+# quickly
+generateSource()
+{
+    local i
+    for ((i = 0; i < 4000; i++)); do
+        echo "fun f$i(a, b) { var c = a * $i + b; if (c > 100) { c = c - 100; } else { c = c + 1; } return c; }"
+        echo "var v$i = f$i($i, 2);"
+    done
+    echo "var sum = 0;"
+    for ((i = 0; i < 4000; i += 100)); do
+        echo "sum = sum + v$i;"
+    done
+    echo "print sum;"
+}
+generateSource > "$generated"
+
+sourceOf()
+{
+    if [ "$1" = compile ]; then
+        echo "$generated"
+    else
+        echo "$dir/$1.lox"
+    fi
+}
+
+if [ $# -gt 0 ]; then
+    names=("$@")
+else
+    names=()
+    for file in "$dir"/*.lox; do
+        names+=("$(basename "$file" .lox)")
+    done
+    names+=(compile)
+fi
+
+# the baseline's median for a benchmark, empty if it has none
+baselineOf()
+{
+    [ -f "$baseline" ] || return 0
+    sed -n "s/^ *\"$1\": {\"median_ms\": \([0-9.]*\),.*/\1/p" "$baseline"
+}
+
+report=$(mktemp)
+trap 'rm -f "$generated" "$report"' EXIT
+regressions=()
+
+echo "{" > "$report"
+count=0
+for name in "${names[@]}"; do
+    source=$(sourceOf "$name")
+    [ -f "$source" ] || { echo "no benchmark named $name" >&2; exit 66; }
+
+    times=()
+    for ((run = 0; run < runs; run++)); do
+        start=$(date +%s%N)
+        "$clox" "$source" > /dev/null
+        end=$(date +%s%N)
+        times+=($(((end - start) / 1000)))
+    done
+    # nearest rank, on the times in microseconds
+    sorted=$(printf "%s\n" "${times[@]}" | sort -n)
+    median=$(echo "$sorted" | awk -v n="$runs" 'NR == int((n + 1) / 2) { printf "%.1f", $1 / 1000 }')
+    p95=$(echo "$sorted" | awk -v n="$runs" 'NR == int((95 * n + 99) / 100) { printf "%.1f", $1 / 1000 }')
+
+    instructions=$("$clox" --profile=ops "$source" 2>&1 > /dev/null | awk '$1 == "total" { print $2 }')
+    instructions=${instructions:-0}
+    perSecond=$(awk -v i="$instructions" -v ms="$median" 'BEGIN { printf "%.0f", (ms > 0 ? i * 1000 / ms : 0) }')
+
+    line="\"$name\": {\"median_ms\": $median, \"p95_ms\": $p95, \"instructions\": $instructions, \"instructions_per_sec\": $perSecond"
+    old=$(baselineOf "$name")
+    if [ "$update" = 0 ] && [ -n "$old" ]; then
+        change=$(awk -v new="$median" -v old="$old" 'BEGIN { printf "%.1f", (old > 0 ? (new - old) * 100 / old : 0) }')
+        line+=", \"baseline_ms\": $old, \"change_percent\": $change"
+        if awk -v c="$change" -v t="$threshold" 'BEGIN { exit !(c > t) }'; then
+            line+=", \"regression\": true"
+            regressions+=("$name: ${median}ms, ${change}% slower than ${old}ms")
+        fi
+    fi
+    line+="}"
+
+    count=$((count + 1))
+    [ $count -lt ${#names[@]} ] && line+=","
+    echo "    $line" >> "$report"
+done
+echo "}" >> "$report"
+
+if [ "$update" = 1 ]; then
+    cp "$report" "$baseline"
+    echo "recorded $baseline" >&2
+fi
+if [ -n "$output" ]; then
+    cp "$report" "$output"
+else
+    cat "$report"
+fi
+
+if [ ${#regressions[@]} -gt 0 ]; then
+    echo "regressions over $threshold%:" >&2
+    printf "    %s\n" "${regressions[@]}" >&2
+    exit 1
+fi
@@ -0,0 +1,200 @@
+#ifndef _clox_ast_h
+#define _clox_ast_h
+
+#include "common.h"
+#include "scanner.h"
+#include "value.h"
+
+// What the compiler can prove about a value at compile time. The lattice is
+// flat: two different types join to TYPE_ANY.
+typedef enum
+{
+    TYPE_ANY,
+    TYPE_NIL,
+    TYPE_BOOL,
+    TYPE_NUMBER,
+    TYPE_STRING,
+} StaticType;
+
+typedef struct Node Node;
+
+// A local variable. Every reference to it points to the same Variable, so
+// the passes never have to resolve names again.
+typedef struct
+{
+    Token name;
+    int depth; // -1 while its initializer is parsed
+    int id;    // index of the variable in the program, 0 based
+    int reads;
+    int writes;       // assignments after the declaration
+    bool hidden;      // introduced by a pass, has no name in the source
+    bool eliminated;  // removed by dead store elimination
+    bool captured;    // used by a function declared inside its scope
+    Node *copyOf;     // expression every read can be replaced with
+    // set by the code generator: the function the variable is a local of,
+    // its stack slot or register there, and whether closures share it
+    // through an upvalue rather than holding a copy
+    int owner;
+    int slot;
+    bool boxed;
+} Variable;
+
+typedef enum
+{
+    // expressions
+    NODE_CONSTANT,
+    NODE_UNARY,
+    NODE_BINARY,
+    NODE_LOGICAL,
+    NODE_GET_GLOBAL,
+    NODE_SET_GLOBAL,
+    NODE_GET_LOCAL,
+    NODE_SET_LOCAL,
+    NODE_CALL,
+    NODE_RESUME,
+    NODE_GET_PROPERTY,
+    NODE_SET_PROPERTY,
+    NODE_LIST,
+    NODE_MAP,
+    NODE_GET_INDEX,
+    NODE_SET_INDEX,
+    NODE_FUNCTION,
+    NODE_CLASS,
+    // statements
+    NODE_PRINT,
+    NODE_EXPRESSION,
+    NODE_DEFINE_GLOBAL,
+    NODE_VAR,
+    NODE_BLOCK,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_RETURN,
+    NODE_YIELD,
+} NodeType;
+
+typedef struct
+{
+    Node **nodes;
+    int count;
+    int capacity;
+} NodeList;
+
+struct Node
+{
+    NodeType type;
+    int line;
+    // type of the value of an expression, set by inferTypes()
+    StaticType staticType;
+    union
+    {
+        Value constant;
+        struct
+        {
+            TokenType op;
+            Node *operand;
+        } unary;
+        // NODE_BINARY and NODE_LOGICAL, whose op is TOKEN_AND or TOKEN_OR
+        struct
+        {
+            TokenType op;
+            Node *left;
+            Node *right;
+        } binary;
+        // NODE_GET_GLOBAL, NODE_SET_GLOBAL and NODE_DEFINE_GLOBAL
+        struct
+        {
+            ObjString *name;
+            Node *value;
+        } global;
+        // NODE_GET_LOCAL, NODE_SET_LOCAL and NODE_VAR
+        struct
+        {
+            Variable *variable;
+            Node *value;
+        } local;
+        // a call whose callee is a NODE_GET_PROPERTY invokes a method, and
+        // one marked `coroutine` makes a suspended coroutine of the call
+        struct
+        {
+            Node *callee;
+            NodeList arguments;
+            bool coroutine;
+        } call;
+        // NODE_GET_PROPERTY and NODE_SET_PROPERTY
+        struct
+        {
+            Node *object;
+            ObjString *name;
+            Node *value;
+        } property;
+        // NODE_GET_INDEX and NODE_SET_INDEX
+        struct
+        {
+            Node *object;
+            Node *index;
+            Node *value;
+        } subscript;
+        // the elements of a NODE_LIST literal, or the keys and values of a
+        // NODE_MAP literal one after the other
+        NodeList elements;
+        // the value of a `fun` declaration, or a method, whose body is
+        // compiled into a function of its own
+        struct
+        {
+            ObjString *name;
+            Variable *receiver; // `this` of a method, NULL for a function
+            Variable **parameters;
+            int arity;
+            Node *body;
+        } function;
+        // the value of a `class` declaration, with its NODE_FUNCTION methods
+        struct
+        {
+            ObjString *name;
+            NodeList methods;
+        } klass;
+        // NODE_PRINT, NODE_EXPRESSION, NODE_RETURN and NODE_YIELD, where
+        // NULL returns or yields nil, and the coroutine of NODE_RESUME
+        Node *expression;
+        NodeList block;
+        struct
+        {
+            Node *condition;
+            Node *thenBranch;
+            Node *elseBranch;
+        } branch;
+        // a missing condition loops forever
+        struct
+        {
+            Node *condition;
+            Node *body;
+            // NODE_SET_GLOBAL of the globals the loop keeps in hidden locals
+            // and assigns, stored back once it exits
+            NodeList writeBack;
+        } loop;
+    } as;
+};
+
+typedef struct
+{
+    Node *root; // NODE_BLOCK of the top level statements
+    int variableCount;
+} Ast;
+
+// Nodes and variables live in an arena that is released as a whole once the
+// code generator is done with them.
+void *astAllocate(size_t size);
+void freeAst();
+
+Node *newNode(NodeType type, int line);
+Node *copyNode(Node *node);
+Variable *newVariable(Ast *ast, Token name);
+void appendNode(NodeList *list, Node *node);
+void insertNode(NodeList *list, int index, Node *node);
+void removeNode(NodeList *list, int index);
+
+bool isExpression(Node *node);
+// whether two expressions are the same tree
+bool sameExpression(Node *a, Node *b);
+
+#endif
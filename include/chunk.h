@@ -5,6 +5,15 @@
 #include "value.h"
 
 #define MAX_LONG_CONSTANT 0xffffff
+// shapes an inline cache remembers before it stops caching
+#define CACHE_ENTRIES 4
+
+// OP_CLOSURE is followed by a flags byte and a two-byte index for each
+// capture: a stack slot of the enclosing frame when CAPTURE_LOCAL is set,
+// otherwise a capture of the enclosing closure. A boxed capture is an
+// upvalue shared with the variable, the others are copies of its value.
+#define CAPTURE_LOCAL 0x1
+#define CAPTURE_BOXED 0x2
 
 typedef enum
 {
@@ -17,8 +26,16 @@ typedef enum
     OP_SUBSTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_MODULO,
     OP_NEGATE,
     OP_NOT,
+    // Bitwise operators take two ints; shifts take a count from 0 to 63.
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
+    OP_BIT_NOT,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -37,9 +54,106 @@ typedef enum
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_JUMP_BACK,
+    OP_CALL,
+    // a call whose result is returned right away, always followed by
+    // OP_RETURN for callees that don't reuse the frame
+    OP_TAIL_CALL,
+    // coroutines: make one of a call, and switch into and out of one
+    OP_COROUTINE,
+    OP_RESUME,
+    OP_YIELD,
+    OP_CLASS,
+    OP_CLASS_LONG,
+    OP_METHOD,
+    OP_METHOD_LONG,
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_INVOKE,
+    OP_TAIL_INVOKE,
+    OP_LIST,
+    OP_MAP,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    OP_CLOSURE,
+    OP_CLOSURE_LONG,
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    OP_GET_CAPTURED,
+    OP_CLOSE_UPVALUE,
     OP_RETURN,
+    // Unchecked forms emitted when the compiler proves both operands are
+    // numbers.
+    OP_ADD_NUM,
+    OP_SUBSTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_MODULO_NUM,
+    OP_NEGATE_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+    // Quickened forms the VM rewrites generic instructions into once it has
+    // seen their operand types. Each one guards its assumption and turns
+    // itself back into the generic instruction when it fails.
+    // The NUM forms expect two doubles and the INT forms two ints.
+    OP_ADD_NUM_QUICK,
+    OP_ADD_INT_QUICK,
+    OP_ADD_STRING_QUICK,
+    OP_SUBSTRACT_NUM_QUICK,
+    OP_SUBSTRACT_INT_QUICK,
+    OP_MULTIPLY_NUM_QUICK,
+    OP_MULTIPLY_INT_QUICK,
+    OP_DIVIDE_NUM_QUICK,
+    OP_DIVIDE_INT_QUICK,
+    OP_MODULO_NUM_QUICK,
+    OP_MODULO_INT_QUICK,
+    OP_LESS_NUM_QUICK,
+    OP_LESS_INT_QUICK,
+    OP_GREATER_NUM_QUICK,
+    OP_GREATER_INT_QUICK,
+    OP_GET_GLOBAL_QUICK,
+    OP_SET_GLOBAL_QUICK,
 } OpCode;
 
+// Instructions of the register machine. Each one is four bytes: the opcode
+// and operands A, B and C. Bx is the 16-bit operand made of B and C. RK(x)
+// is a register, or the constant x & ~RK_CONSTANT when RK_CONSTANT is set.
+typedef enum
+{
+    OP_R_LOADK,         // R(A) = K(Bx)
+    OP_R_MOVE,          // R(A) = R(B)
+    OP_R_DEFINE_GLOBAL, // define global K(Bx) as R(A)
+    OP_R_GET_GLOBAL,    // R(A) = global K(Bx)
+    OP_R_SET_GLOBAL,    // global K(Bx) = R(A)
+    OP_R_ADD,           // R(A) = RK(B) + RK(C)
+    OP_R_SUBSTRACT,     // R(A) = RK(B) - RK(C)
+    OP_R_MULTIPLY,      // R(A) = RK(B) * RK(C)
+    OP_R_DIVIDE,        // R(A) = RK(B) / RK(C)
+    OP_R_MODULO,        // R(A) = RK(B) % RK(C)
+    OP_R_EQUAL,         // R(A) = RK(B) == RK(C)
+    OP_R_LESS,          // R(A) = RK(B) < RK(C)
+    OP_R_GREATER,       // R(A) = RK(B) > RK(C)
+    OP_R_BIT_AND,       // R(A) = RK(B) & RK(C)
+    OP_R_BIT_OR,        // R(A) = RK(B) | RK(C)
+    OP_R_BIT_XOR,       // R(A) = RK(B) ^ RK(C)
+    OP_R_SHIFT_LEFT,    // R(A) = RK(B) << RK(C)
+    OP_R_SHIFT_RIGHT,   // R(A) = RK(B) >> RK(C)
+    OP_R_NEGATE,        // R(A) = -RK(B)
+    OP_R_NOT,           // R(A) = !RK(B)
+    OP_R_BIT_NOT,       // R(A) = ~RK(B)
+    OP_R_PRINT,         // print R(A)
+    OP_R_JUMP,          // ip += Bx
+    OP_R_JUMP_BACK,     // ip -= Bx
+    OP_R_JUMP_IF_FALSE, // if R(A) is false: ip += Bx
+    OP_R_RETURN,
+} RegisterOpCode;
+
+#define REGISTER_MAX 128
+#define RK_CONSTANT 0x80
+
+// how many times an instruction may fall back to its generic form before the
+// VM stops quickening it
+#define MAX_DEOPTS 4
+
 typedef struct
 {
     int count;
@@ -48,6 +162,37 @@ typedef struct
     int *line;
 } Line;
 
+// A global kept in a stack slot, or register, by the code in [start, end).
+// The VM stores it back when that code fails with a runtime error.
+typedef struct
+{
+    int start;
+    int end;
+    int slot;
+    int name; // constant index of the global's name
+} PromotedGlobal;
+
+// Where a property instruction found its property on instances of one
+// shape: a field at `index`, or a method of the class when `index` is -1.
+// A store that adds the field moves the instance to the shape `next`.
+typedef struct
+{
+    ObjShape *shape;
+    ObjShape *next;
+    int index;
+    Value method;
+} CacheEntry;
+
+// The inline cache of one property instruction, which carries its index.
+// It is monomorphic with one entry and polymorphic up to CACHE_ENTRIES;
+// shapes seen after that are looked up every time.
+typedef struct
+{
+    int name; // constant index of the property name
+    int count;
+    CacheEntry entries[CACHE_ENTRIES];
+} PropertyCache;
+
 typedef struct
 {
     int count;
@@ -55,6 +200,17 @@ typedef struct
     uint8_t *code;
     Line lines;
     ValueArray constants;
+    // quickening state, allocated the first time the VM needs it:
+    // the globals table slot cached for each global name constant
+    int *globalSlots;
+    // how many times the instruction at each offset has been deoptimized
+    uint8_t *deopts;
+    PromotedGlobal *promoted;
+    int promotedCount;
+    int promotedCapacity;
+    PropertyCache *caches;
+    int cacheCount;
+    int cacheCapacity;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -62,6 +218,8 @@ void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
 int getLine(Chunk *chunk, int offset);
+void addPromotedGlobal(Chunk *chunk, int start, int end, int slot, int name);
+int addPropertyCache(Chunk *chunk, int name);
 void writeConstant(Chunk *chunk, Value value, int line);
 void writeConst(Chunk *chunk, int index, int line, uint8_t shortInstruction,
                 uint8_t longInstruction, unsigned int longRange, int longLengths,
@@ -7,11 +7,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// `make release` leaves out the debugging output and checks
+#ifndef RELEASE
 #define DEBUG_PRINT_CODE
 #define DEBUG_MODE
 #define DEBUG_TRACE_EXCUTION
-#define UINT8_COUNT UINT8_MAX + 1
-#define MAX_LOCAL 1U << 15
+#define DEBUG_PRINT_QUICKEN
+#endif
+#define VM_STACK_CACHING
+#define UINT8_COUNT (UINT8_MAX + 1)
+#define MAX_LOCAL (1U << 15)
 
 #define PANIC(message)                                                                                     \
     do                                                                                                     \
@@ -30,7 +35,8 @@
         }                          \
     } while (0)
 #else
-#define ASSERT(condition, message)
+// not evaluated, but what it reads still counts as used
+#define ASSERT(condition, message) ((void)sizeof(condition))
 #endif
 
 #endif
\ No newline at end of file
@@ -1,8 +1,20 @@
 #ifndef _clox_compiler_h
 #define _clox_compiler_h
 
-#include "chunk.h"
+#include "object.h"
 
-bool compile(const char *source, Chunk *chunk);
+// seconds spent in each phase of the last compilation
+typedef struct
+{
+    double parse;
+    double optimize;
+    double generate;
+} CompileTimes;
 
-#endif
\ No newline at end of file
+extern _Thread_local CompileTimes compileTimes;
+
+// compile a script into the function the VM calls to run it, NULL on error
+ObjFunction *compile(const char *source);
+ObjFunction *compileRegisters(const char *source);
+
+#endif
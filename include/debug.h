@@ -5,5 +5,9 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+void disassembleRegisterChunk(Chunk *chunk, const char *name);
+int disassembleRegisterInstruction(Chunk *chunk, int offset);
+// the name of a stack machine instruction, as the disassembler shows it
+const char *opcodeName(uint8_t instruction);
 
 #endif
\ No newline at end of file
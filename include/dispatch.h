@@ -0,0 +1,895 @@
+// The dispatch loop of the stack machine. vm.c includes this file three
+// times, defining RUN_FUNCTION as the name of the function it becomes: once
+// as is, once with PROFILE_OPS defined, which counts every instruction run
+// and the cycles until the next one starts, and once with SAMPLE_LINES
+// defined, which takes the samples the sampling profiler asks for. The loop
+// scripts normally run on has no trace of either profiler. There is no
+// include guard on purpose.
+
+static InterpretResult RUN_FUNCTION()
+{
+    // the running frame, with its locals and constants at hand
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    Value *slots = frame->slots;
+    Value *constants = frame->function->chunk.constants.value;
+#define CHUNK (&frame->function->chunk)
+
+#ifdef VM_STACK_CACHING
+    // ip, the stack pointer and the value on top of the stack live in locals
+    // so the compiler can keep them in registers. `sp` points at the slot of
+    // the top value, whose copy in memory is stale until SPILL() writes it
+    // back. The stack is never empty while running: slot 0 belongs to the
+    // script.
+    uint8_t *ip = frame->ip;
+    Value *sp = vm.stackTop - 1;
+    Value tos = *sp;
+#define IP ip
+#define PUSH(value)      \
+    do                   \
+    {                    \
+        *sp++ = tos;     \
+        tos = (value);   \
+    } while (0)
+#define DROP() (tos = *--sp)
+#define TOP tos
+#define PEEK(distance) ((distance) == 0 ? tos : sp[-(distance)])
+#define GET_SLOT(slot) ((slot) == sp ? tos : *(slot))
+#define SET_SLOT(slot, value)  \
+    do                         \
+    {                          \
+        if ((slot) == sp)      \
+            tos = (value);     \
+        else                   \
+            *(slot) = (value); \
+    } while (0)
+#define SPILL()                  \
+    do                           \
+    {                            \
+        *sp = tos;               \
+        vm.stackTop = sp + 1;    \
+        frame->ip = ip;          \
+    } while (0)
+#define LOAD_FRAME()                                        \
+    do                                                      \
+    {                                                       \
+        frame = &vm.frames[vm.frameCount - 1];              \
+        ip = frame->ip;                                     \
+        slots = frame->slots;                               \
+        constants = frame->function->chunk.constants.value; \
+    } while (0)
+// the value returned by a call takes the place of the callee
+#define RETURN_TO_CALLER(result) \
+    do                           \
+    {                            \
+        sp = frame->slots;       \
+        tos = (result);          \
+    } while (0)
+// pick the stack up again after a native function changed it in memory
+#define LOAD_STACK()              \
+    do                            \
+    {                             \
+        sp = vm.stackTop - 1;     \
+        tos = *sp;                \
+    } while (0)
+#else
+#define IP frame->ip
+#define PUSH(value) push(value)
+#define DROP() pop()
+#define TOP (*top())
+#define PEEK(distance) peek(distance)
+#define GET_SLOT(slot) (*(slot))
+#define SET_SLOT(slot, value) (*(slot) = (value))
+#define SPILL()
+#define LOAD_FRAME()                                        \
+    do                                                      \
+    {                                                       \
+        frame = &vm.frames[vm.frameCount - 1];              \
+        slots = frame->slots;                               \
+        constants = frame->function->chunk.constants.value; \
+    } while (0)
+#define RETURN_TO_CALLER(result)          \
+    do                                    \
+    {                                     \
+        vm.stackTop = frame->slots;       \
+        push(result);                     \
+    } while (0)
+#define LOAD_STACK()
+#endif
+
+#define READ_BYTE() (*IP++)
+#define READ_SHORT() (IP += 2, (uint16_t)((IP[-2] << 8) | IP[-1]))
+#define READ_LONG() (IP += 3, (int)(IP[-3] | (IP[-2] << 8) | (IP[-1] << 16)))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+#define RUNTIME_ERROR(...)                  \
+    do                                      \
+    {                                       \
+        SPILL();                            \
+        runtimeError(__VA_ARGS__);          \
+        return INTERPRET_RUNTIME_ERROR;     \
+    } while (0)
+#define DEOPTIMIZE(instruction, length)     \
+    do                                      \
+    {                                       \
+        IP -= (length);                     \
+        deoptimize(CHUNK, IP, instruction); \
+    } while (0)
+// The arithmetic macros evaluate `result` with the left operand in `a` and
+// the right one in `b`, and replace both operands with it.
+#define BINARY_OP(result, intInstruction, doubleInstruction) \
+    do                                                       \
+    {                                                        \
+        Value a = PEEK(1);                                   \
+        Value b = TOP;                                       \
+        if (IS_INT(a) && IS_INT(b))                          \
+            quicken(CHUNK, IP - 1, intInstruction);          \
+        else if (IS_DOUBLE(a) && IS_DOUBLE(b))               \
+            quicken(CHUNK, IP - 1, doubleInstruction);       \
+        else if (!IS_NUMBER(a) || !IS_NUMBER(b))             \
+            RUNTIME_ERROR("Operants must be number");        \
+        DROP();                                              \
+        TOP = (result);                                      \
+    } while (0)
+#define NUMBER_OP(result)  \
+    do                     \
+    {                      \
+        Value a = PEEK(1); \
+        Value b = TOP;     \
+        DROP();            \
+        TOP = (result);    \
+    } while (0)
+#define QUICK_OP(is, result, genericInstruction)  \
+    do                                            \
+    {                                             \
+        Value a = PEEK(1);                        \
+        Value b = TOP;                            \
+        if (!is(a) || !is(b))                     \
+        {                                         \
+            DEOPTIMIZE(genericInstruction, 1);    \
+            break;                                \
+        }                                         \
+        DROP();                                   \
+        TOP = (result);                           \
+    } while (0)
+#define BITWISE_OP(op)                                                       \
+    do                                                                       \
+    {                                                                        \
+        if (!IS_INT(PEEK(0)) || !IS_INT(PEEK(1)))                            \
+            RUNTIME_ERROR("Operands of bitwise operators must be integers."); \
+        int64_t b = AS_INT(TOP);                                             \
+        DROP();                                                              \
+        TOP = INT_VAL(AS_INT(TOP) op b);                                     \
+    } while (0)
+#define SHIFT_OP(left)                                                       \
+    do                                                                       \
+    {                                                                        \
+        if (!IS_INT(PEEK(0)) || !IS_INT(PEEK(1)))                            \
+            RUNTIME_ERROR("Operands of bitwise operators must be integers."); \
+        int64_t result;                                                      \
+        if (!shiftInt(AS_INT(PEEK(1)), AS_INT(TOP), left, &result))          \
+            RUNTIME_ERROR("Shift count must be between 0 and 63.");          \
+        DROP();                                                              \
+        TOP = INT_VAL(result);                                               \
+    } while (0)
+#define CONCATENATE()                                      \
+    do                                                     \
+    {                                                      \
+        ObjString *b = AS_STRING(TOP);                     \
+        DROP();                                            \
+        TOP = OBJ_VAL(concatenate(AS_STRING(TOP), b));     \
+    } while (0)
+
+#ifdef PROFILE_OPS
+    // the instruction running since `started`; the extra slot takes the
+    // time before the first one
+    int profiled = UINT8_COUNT;
+    uint64_t started = readCycles();
+#endif
+    for (;;)
+    {
+#ifdef PROFILE_OPS
+        uint64_t now = readCycles();
+        vm.opProfile.cycles[profiled] += now - started;
+        started = now;
+        profiled = *IP;
+        vm.opProfile.counts[profiled]++;
+#endif
+#ifdef SAMPLE_LINES
+        if (vm.samplesDue)
+        {
+            SPILL();
+            takeSample();
+        }
+#endif
+#ifdef DEBUG_TRACE_EXCUTION
+        SPILL();
+        writeOutput("          ", 10);
+        for (Value *i = vm.stack; i < vm.stackTop; i++)
+        {
+            writeOutput("[", 1);
+            printValue(*i);
+            writeOutput("]", 1);
+        }
+        endLine();
+        // before the disassembler prints through stdio
+        flushOutput();
+        disassembleInstruction(CHUNK, (int)(IP - CHUNK->code));
+#endif
+        uint8_t instruction;
+        switch (instruction = READ_BYTE())
+        {
+        case OP_CONSTANT:
+        {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            break;
+        }
+        case OP_CONSTANT_LONG:
+        {
+            Value constant = READ_CONSTANT_LONG();
+            PUSH(constant);
+            break;
+        }
+        case OP_ADD:
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
+            {
+                quicken(CHUNK, IP - 1, OP_ADD_STRING_QUICK);
+                CONCATENATE();
+            }
+            else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+            {
+                BINARY_OP(addNumbers(a, b), OP_ADD_INT_QUICK, OP_ADD_NUM_QUICK);
+            }
+            else
+            {
+                RUNTIME_ERROR("Operands of '+' must be two numbers or two strings");
+            }
+            break;
+        case OP_SUBSTRACT:
+            BINARY_OP(subtractNumbers(a, b), OP_SUBSTRACT_INT_QUICK, OP_SUBSTRACT_NUM_QUICK);
+            break;
+        case OP_MULTIPLY:
+            BINARY_OP(multiplyNumbers(a, b), OP_MULTIPLY_INT_QUICK, OP_MULTIPLY_NUM_QUICK);
+            break;
+        case OP_DIVIDE:
+            BINARY_OP(divideNumbers(a, b), OP_DIVIDE_INT_QUICK, OP_DIVIDE_NUM_QUICK);
+            break;
+        case OP_MODULO:
+            BINARY_OP(moduloNumbers(a, b), OP_MODULO_INT_QUICK, OP_MODULO_NUM_QUICK);
+            break;
+        case OP_NEGATE:
+        {
+            if (!IS_NUMBER(TOP))
+            {
+                RUNTIME_ERROR("Operant of '-' must be a number");
+            }
+            TOP = negateNumber(TOP);
+            break;
+        }
+        case OP_BIT_AND:
+            BITWISE_OP(&);
+            break;
+        case OP_BIT_OR:
+            BITWISE_OP(|);
+            break;
+        case OP_BIT_XOR:
+            BITWISE_OP(^);
+            break;
+        case OP_SHIFT_LEFT:
+            SHIFT_OP(true);
+            break;
+        case OP_SHIFT_RIGHT:
+            SHIFT_OP(false);
+            break;
+        case OP_BIT_NOT:
+            if (!IS_INT(TOP))
+                RUNTIME_ERROR("Operand of '~' must be an integer.");
+            TOP = INT_VAL(~AS_INT(TOP));
+            break;
+        case OP_CALL:
+        {
+            int argCount = READ_BYTE();
+            SPILL();
+            if (!callValue(PEEK(argCount), argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            LOAD_STACK();
+            break;
+        }
+        case OP_TAIL_CALL:
+        {
+            int argCount = READ_BYTE();
+            SPILL();
+            int frameCount = vm.frameCount;
+            ObjCoroutine *coroutine = vm.coroutine;
+            if (!callValue(PEEK(argCount), argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            // natives and classes without init push no frame, and the
+            // OP_RETURN after this returns what they left on the stack; a
+            // native that waits for I/O has left the coroutine
+            if (vm.frameCount > frameCount && vm.coroutine == coroutine)
+                reuseFrame();
+            LOAD_FRAME();
+            LOAD_STACK();
+            break;
+        }
+        case OP_COROUTINE:
+        {
+            int argCount = READ_BYTE();
+            SPILL();
+            if (!startCoroutine(argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            LOAD_STACK();
+            break;
+        }
+        case OP_RESUME:
+        {
+            if (!IS_COROUTINE(TOP))
+                RUNTIME_ERROR("Can only resume coroutines.");
+            ObjCoroutine *coroutine = AS_COROUTINE(TOP);
+            if (coroutine->state == COROUTINE_DONE)
+                RUNTIME_ERROR("Can't resume a finished coroutine.");
+            if (coroutine->state == COROUTINE_RUNNING)
+                RUNTIME_ERROR("Can't resume a running coroutine.");
+            if (coroutine->state == COROUTINE_WAITING)
+                RUNTIME_ERROR("Can't resume a coroutine waiting for I/O.");
+            // what it yields or returns takes the coroutine's place
+            DROP();
+            SPILL();
+            enterCoroutine(coroutine);
+            LOAD_FRAME();
+            LOAD_STACK();
+            break;
+        }
+        case OP_YIELD:
+        {
+            if (vm.coroutine == NULL)
+                RUNTIME_ERROR("Can only yield inside a coroutine.");
+            Value value = TOP;
+            DROP();
+            SPILL();
+            leaveCoroutine(COROUTINE_SUSPENDED);
+            push(value);
+            LOAD_FRAME();
+            LOAD_STACK();
+            break;
+        }
+        case OP_CLASS:
+            PUSH(OBJ_VAL(newClass(READ_STRING())));
+            break;
+        case OP_CLASS_LONG:
+            PUSH(OBJ_VAL(newClass(READ_STRING_LONG())));
+            break;
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        {
+            ObjString *name = instruction == OP_METHOD ? READ_STRING() : READ_STRING_LONG();
+            ObjClass *klass = AS_CLASS(PEEK(1));
+            tableSet(name, TOP, &klass->methods);
+            if (name == vm.initString)
+                klass->initializer = TOP;
+            DROP();
+            break;
+        }
+        case OP_GET_PROPERTY:
+        {
+            PropertyCache *cache = &CHUNK->caches[READ_SHORT()];
+            if (!IS_INSTANCE(TOP))
+                RUNTIME_ERROR("Only instances have properties.");
+
+            ObjInstance *instance = AS_INSTANCE(TOP);
+            CacheEntry *entry = cachedEntry(cache, instance->shape);
+            CacheEntry missed;
+            if (entry == NULL)
+            {
+                entry = &missed;
+                if (!lookupProperty(CHUNK, cache, instance->shape, entry))
+                    RUNTIME_ERROR("Undefined property '%s'.", propertyName(CHUNK, cache)->chars);
+            }
+            if (entry->index != -1)
+                TOP = instance->fields[entry->index];
+            else
+                TOP = OBJ_VAL(newBoundMethod(TOP, entry->method));
+            break;
+        }
+        case OP_SET_PROPERTY:
+        {
+            PropertyCache *cache = &CHUNK->caches[READ_SHORT()];
+            if (!IS_INSTANCE(PEEK(1)))
+                RUNTIME_ERROR("Only instances have fields.");
+
+            ObjInstance *instance = AS_INSTANCE(PEEK(1));
+            CacheEntry *entry = cachedEntry(cache, instance->shape);
+            CacheEntry missed;
+            if (entry == NULL)
+            {
+                entry = &missed;
+                lookupStore(CHUNK, cache, instance->shape, entry);
+            }
+            if (entry->next != instance->shape)
+                setShape(instance, entry->next);
+            Value value = TOP;
+            instance->fields[entry->index] = value;
+            DROP();
+            TOP = value;
+            break;
+        }
+        case OP_INVOKE:
+        {
+            PropertyCache *cache = &CHUNK->caches[READ_SHORT()];
+            int argCount = READ_BYTE();
+            SPILL();
+            if (!invoke(CHUNK, cache, argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            LOAD_STACK();
+            break;
+        }
+        case OP_TAIL_INVOKE:
+        {
+            PropertyCache *cache = &CHUNK->caches[READ_SHORT()];
+            int argCount = READ_BYTE();
+            SPILL();
+            int frameCount = vm.frameCount;
+            ObjCoroutine *coroutine = vm.coroutine;
+            if (!invoke(CHUNK, cache, argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            if (vm.frameCount > frameCount && vm.coroutine == coroutine)
+                reuseFrame();
+            LOAD_FRAME();
+            LOAD_STACK();
+            break;
+        }
+        case OP_LIST:
+        {
+            int count = READ_SHORT();
+            SPILL();
+            ObjList *list = newList(vm.stackTop - count, count);
+            vm.stackTop -= count;
+            push(OBJ_VAL(list));
+            LOAD_STACK();
+            break;
+        }
+        case OP_MAP:
+        {
+            int count = READ_SHORT();
+            SPILL();
+            ObjMap *map = newMap(count);
+            Value *entries = vm.stackTop - 2 * count;
+            for (int i = 0; i < count; i++)
+            {
+                if (tableSetValue(entries[2 * i], entries[2 * i + 1], &map->table))
+                    map->count++;
+            }
+            vm.stackTop = entries;
+            push(OBJ_VAL(map));
+            LOAD_STACK();
+            break;
+        }
+        case OP_INDEX_GET:
+        {
+            Value object = PEEK(1);
+            Value value;
+            if (IS_MAP(object))
+            {
+                if (!tableGetValue(&AS_MAP(object)->table, TOP, &value))
+                    RUNTIME_ERROR("Undefined key.");
+            }
+            else if (IS_LIST(object))
+            {
+                ObjList *list = AS_LIST(object);
+                int element;
+                const char *error = elementIndex(list->items.count, TOP, &element);
+                if (error != NULL)
+                    RUNTIME_ERROR("%s", error);
+                value = list->items.value[element];
+            }
+            else if (IS_FLOAT64_ARRAY(object))
+            {
+                ObjFloat64Array *array = AS_FLOAT64_ARRAY(object);
+                int element;
+                const char *error = elementIndex(array->count, TOP, &element);
+                if (error != NULL)
+                    RUNTIME_ERROR("%s", error);
+                value = NUMBER_VAL(array->values[element]);
+            }
+            else
+            {
+                RUNTIME_ERROR("Only lists, arrays and maps can be indexed.");
+            }
+            DROP();
+            TOP = value;
+            break;
+        }
+        case OP_INDEX_SET:
+        {
+            Value object = PEEK(2);
+            Value value = TOP;
+            if (IS_MAP(object))
+            {
+                ObjMap *map = AS_MAP(object);
+                if (tableSetValue(PEEK(1), value, &map->table))
+                    map->count++;
+            }
+            else if (IS_LIST(object))
+            {
+                ObjList *list = AS_LIST(object);
+                int element;
+                const char *error = elementIndex(list->items.count, PEEK(1), &element);
+                if (error != NULL)
+                    RUNTIME_ERROR("%s", error);
+                list->items.value[element] = value;
+            }
+            else if (IS_FLOAT64_ARRAY(object))
+            {
+                ObjFloat64Array *array = AS_FLOAT64_ARRAY(object);
+                int element;
+                const char *error = elementIndex(array->count, PEEK(1), &element);
+                if (error != NULL)
+                    RUNTIME_ERROR("%s", error);
+                if (!IS_NUMBER(value))
+                    RUNTIME_ERROR("Float64Array elements must be numbers.");
+                array->values[element] = AS_NUMBER(value);
+            }
+            else
+            {
+                RUNTIME_ERROR("Only lists, arrays and maps can be indexed.");
+            }
+            DROP();
+            DROP();
+            TOP = value;
+            break;
+        }
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        {
+            ObjFunction *function = AS_FUNCTION(
+                instruction == OP_CLOSURE ? READ_CONSTANT() : READ_CONSTANT_LONG());
+            ObjClosure *closure = newClosure(function);
+            for (int i = 0; i < function->captureCount; i++)
+            {
+                uint8_t flags = READ_BYTE();
+                uint16_t index = READ_SHORT();
+                if (!(flags & CAPTURE_LOCAL))
+                    closure->captures[i] = frame->closure->captures[index];
+                else if (flags & CAPTURE_BOXED)
+                    closure->captures[i] = OBJ_VAL(captureUpvalue(slots + index));
+                else
+                    closure->captures[i] = GET_SLOT(slots + index);
+            }
+            PUSH(OBJ_VAL(closure));
+            break;
+        }
+        case OP_GET_UPVALUE:
+        {
+            Value *location = AS_UPVALUE(frame->closure->captures[READ_BYTE()])->location;
+            PUSH(GET_SLOT(location));
+            break;
+        }
+        case OP_SET_UPVALUE:
+        {
+            Value *location = AS_UPVALUE(frame->closure->captures[READ_BYTE()])->location;
+            SET_SLOT(location, TOP);
+            break;
+        }
+        case OP_GET_CAPTURED:
+            PUSH(frame->closure->captures[READ_BYTE()]);
+            break;
+        case OP_CLOSE_UPVALUE:
+            SPILL();
+            closeUpvalues(vm.stackTop - 1);
+            DROP();
+            break;
+        case OP_RETURN:
+        {
+            Value result = TOP;
+            // only the result can be stale in memory, the locals are not
+            if (vm.openUpvalues != NULL)
+                closeUpvalues(slots);
+            if (--vm.frameCount == 0)
+            {
+                // the result stays for callFunction()
+                if (vm.coroutine == NULL)
+                {
+                    resetStack();
+                    push(result);
+                    return INTERPRET_OK;
+                }
+                // a finished coroutine hands its result to its resumer, and
+                // nothing points into its stacks anymore
+                ObjCoroutine *coroutine = vm.coroutine;
+                leaveCoroutine(COROUTINE_DONE);
+                freeFiber(&coroutine->fiber);
+                push(result);
+                LOAD_FRAME();
+                LOAD_STACK();
+                break;
+            }
+            RETURN_TO_CALLER(result);
+            LOAD_FRAME();
+            break;
+        }
+        case OP_TRUE:
+            PUSH(BOOL_VAL(true));
+            break;
+        case OP_FALSE:
+            PUSH(BOOL_VAL(false));
+            break;
+        case OP_NIL:
+            PUSH(NIL_VAL);
+            break;
+        case OP_NOT:
+        {
+            if (IS_BOOL(TOP))
+            {
+                TOP = BOOL_VAL(!(AS_BOOL(TOP)));
+            }
+            else if (IS_NIL(TOP))
+            {
+                TOP = BOOL_VAL(true);
+            }
+            else
+            {
+                RUNTIME_ERROR("Operant of '!' must be a bool or nil");
+            }
+            break;
+        }
+        case OP_EQUAL:
+        {
+            Value b = TOP;
+            DROP();
+            TOP = BOOL_VAL(valuesEqual(TOP, b));
+            break;
+        }
+        case OP_LESS:
+            BINARY_OP(BOOL_VAL(lessNumbers(a, b)), OP_LESS_INT_QUICK, OP_LESS_NUM_QUICK);
+            break;
+        case OP_GREATER:
+            BINARY_OP(BOOL_VAL(greaterNumbers(a, b)), OP_GREATER_INT_QUICK, OP_GREATER_NUM_QUICK);
+            break;
+        case OP_PRINT:
+        {
+            printValue(TOP);
+            endLine();
+            DROP();
+            break;
+        }
+        case OP_POP:
+            DROP();
+            break;
+        case OP_DEFINE_GLOBAL:
+        {
+            ObjString *name = READ_STRING();
+            tableSet(name, TOP, &vm.globals);
+            DROP();
+            break;
+        }
+        case OP_DEFINE_GLOBAL_LONG:
+        {
+            ObjString *name = READ_STRING_LONG();
+            tableSet(name, TOP, &vm.globals);
+            DROP();
+            break;
+        }
+        case OP_GET_GLOBAL:
+        {
+            int constant = READ_BYTE();
+            ObjString *name = AS_STRING(constants[constant]);
+            Entry *entry = tableGetEntry(&vm.globals, name);
+            if (entry == NULL)
+            {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            PUSH(entry->value);
+            cacheGlobal(CHUNK, IP - 2, constant, entry, OP_GET_GLOBAL_QUICK);
+            break;
+        }
+        case OP_GET_GLOBAL_LONG:
+        {
+            ObjString *name = READ_STRING_LONG();
+            Value value;
+            if (!tableGet(&vm.globals, name, &value))
+            {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            PUSH(value);
+            break;
+        }
+        case OP_SET_GLOBAL:
+        {
+            int constant = READ_BYTE();
+            ObjString *name = AS_STRING(constants[constant]);
+            Entry *entry = tableGetEntry(&vm.globals, name);
+            if (entry == NULL)
+            {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            entry->value = TOP;
+            cacheGlobal(CHUNK, IP - 2, constant, entry, OP_SET_GLOBAL_QUICK);
+            break;
+        }
+        case OP_SET_GLOBAL_LONG:
+        {
+            ObjString *name = READ_STRING_LONG();
+            if (tableSet(name, TOP, &vm.globals))
+            {
+                tableDelete(&vm.globals, name);
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            break;
+        }
+        case OP_GET_LOCAL:
+        {
+            Value *slot = slots + READ_BYTE();
+            PUSH(GET_SLOT(slot));
+            break;
+        }
+        case OP_GET_LOCAL_LONG:
+        {
+            Value *slot = slots + READ_LONG();
+            PUSH(GET_SLOT(slot));
+            break;
+        }
+        case OP_SET_LOCAL:
+        {
+            Value *slot = slots + READ_BYTE();
+            SET_SLOT(slot, TOP);
+            break;
+        }
+        case OP_SET_LOCAL_LONG:
+        {
+            Value *slot = slots + READ_LONG();
+            SET_SLOT(slot, TOP);
+            break;
+        }
+        case OP_JUMP:
+        {
+            uint16_t offset = READ_SHORT();
+            IP += offset;
+            break;
+        }
+        case OP_JUMP_BACK:
+        {
+            uint16_t offset = READ_SHORT();
+            IP -= offset;
+            break;
+        }
+        case OP_JUMP_IF_FALSE:
+        {
+            uint16_t offset = READ_SHORT();
+            if (!IS_BOOL(TOP) && !IS_NIL(TOP))
+            {
+                RUNTIME_ERROR("Condition can only be bool or nil.");
+            }
+            if (isFalsey(TOP))
+                IP += offset;
+            break;
+        }
+        case OP_ADD_NUM:
+            NUMBER_OP(addNumbers(a, b));
+            break;
+        case OP_SUBSTRACT_NUM:
+            NUMBER_OP(subtractNumbers(a, b));
+            break;
+        case OP_MULTIPLY_NUM:
+            NUMBER_OP(multiplyNumbers(a, b));
+            break;
+        case OP_DIVIDE_NUM:
+            NUMBER_OP(divideNumbers(a, b));
+            break;
+        case OP_MODULO_NUM:
+            NUMBER_OP(moduloNumbers(a, b));
+            break;
+        case OP_NEGATE_NUM:
+            TOP = negateNumber(TOP);
+            break;
+        case OP_LESS_NUM:
+            NUMBER_OP(BOOL_VAL(lessNumbers(a, b)));
+            break;
+        case OP_GREATER_NUM:
+            NUMBER_OP(BOOL_VAL(greaterNumbers(a, b)));
+            break;
+        case OP_ADD_NUM_QUICK:
+            QUICK_OP(IS_DOUBLE, NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b)), OP_ADD);
+            break;
+        case OP_ADD_INT_QUICK:
+            QUICK_OP(IS_INT, addNumbers(a, b), OP_ADD);
+            break;
+        case OP_ADD_STRING_QUICK:
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1)))
+            {
+                DEOPTIMIZE(OP_ADD, 1);
+                break;
+            }
+            CONCATENATE();
+            break;
+        case OP_SUBSTRACT_NUM_QUICK:
+            QUICK_OP(IS_DOUBLE, NUMBER_VAL(AS_DOUBLE(a) - AS_DOUBLE(b)), OP_SUBSTRACT);
+            break;
+        case OP_SUBSTRACT_INT_QUICK:
+            QUICK_OP(IS_INT, subtractNumbers(a, b), OP_SUBSTRACT);
+            break;
+        case OP_MULTIPLY_NUM_QUICK:
+            QUICK_OP(IS_DOUBLE, NUMBER_VAL(AS_DOUBLE(a) * AS_DOUBLE(b)), OP_MULTIPLY);
+            break;
+        case OP_MULTIPLY_INT_QUICK:
+            QUICK_OP(IS_INT, multiplyNumbers(a, b), OP_MULTIPLY);
+            break;
+        case OP_DIVIDE_NUM_QUICK:
+            QUICK_OP(IS_DOUBLE, NUMBER_VAL(AS_DOUBLE(a) / AS_DOUBLE(b)), OP_DIVIDE);
+            break;
+        case OP_DIVIDE_INT_QUICK:
+            QUICK_OP(IS_INT, divideNumbers(a, b), OP_DIVIDE);
+            break;
+        case OP_MODULO_NUM_QUICK:
+            QUICK_OP(IS_DOUBLE, NUMBER_VAL(fmod(AS_DOUBLE(a), AS_DOUBLE(b))), OP_MODULO);
+            break;
+        case OP_MODULO_INT_QUICK:
+            QUICK_OP(IS_INT, moduloNumbers(a, b), OP_MODULO);
+            break;
+        case OP_LESS_NUM_QUICK:
+            QUICK_OP(IS_DOUBLE, BOOL_VAL(AS_DOUBLE(a) < AS_DOUBLE(b)), OP_LESS);
+            break;
+        case OP_LESS_INT_QUICK:
+            QUICK_OP(IS_INT, BOOL_VAL(AS_INT(a) < AS_INT(b)), OP_LESS);
+            break;
+        case OP_GREATER_NUM_QUICK:
+            QUICK_OP(IS_DOUBLE, BOOL_VAL(AS_DOUBLE(a) > AS_DOUBLE(b)), OP_GREATER);
+            break;
+        case OP_GREATER_INT_QUICK:
+            QUICK_OP(IS_INT, BOOL_VAL(AS_INT(a) > AS_INT(b)), OP_GREATER);
+            break;
+        case OP_GET_GLOBAL_QUICK:
+        {
+            Entry *entry = cachedGlobal(CHUNK, READ_BYTE());
+            if (entry == NULL)
+            {
+                DEOPTIMIZE(OP_GET_GLOBAL, 2);
+                break;
+            }
+            PUSH(entry->value);
+            break;
+        }
+        case OP_SET_GLOBAL_QUICK:
+        {
+            Entry *entry = cachedGlobal(CHUNK, READ_BYTE());
+            if (entry == NULL)
+            {
+                DEOPTIMIZE(OP_SET_GLOBAL, 2);
+                break;
+            }
+            entry->value = TOP;
+            break;
+        }
+        }
+    }
+#undef IP
+#undef PUSH
+#undef DROP
+#undef TOP
+#undef PEEK
+#undef GET_SLOT
+#undef SET_SLOT
+#undef SPILL
+#undef LOAD_FRAME
+#undef RETURN_TO_CALLER
+#undef LOAD_STACK
+#undef CHUNK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_STRING
+#undef READ_STRING_LONG
+#undef RUNTIME_ERROR
+#undef DEOPTIMIZE
+#undef BINARY_OP
+#undef NUMBER_OP
+#undef QUICK_OP
+#undef BITWISE_OP
+#undef SHIFT_OP
+#undef CONCATENATE
+}
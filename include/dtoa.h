@@ -0,0 +1,15 @@
+#ifndef _clox_dtoa_h
+#define _clox_dtoa_h
+
+#include "common.h"
+
+// Numbers to text. A double is written with as few digits as read back as
+// the same double, found by Grisu2, in plain notation from 1e-7 up to 1e21
+// and with an exponent outside that range, the way JavaScript shows
+// numbers. Both write the characters without a terminating null and return
+// how many there are; 32 characters is always room enough.
+
+int formatInt(int64_t value, char *buffer);
+int formatDouble(double value, char *buffer);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef _clox_io_h
+#define _clox_io_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Each VM has an event loop: an epoll instance for its sockets, a heap of
+// timers and a thread doing its file operations, since epoll can't wait for
+// regular files. The operations that may wait take `result`, the stack slot
+// their native's result goes in. Outside a coroutine they block the VM until
+// they finish. Inside one, when they would wait, they leave the coroutine
+// waiting and return nil; the result is stored in its slot once it is done,
+// and ioWait() hands the coroutine back to be resumed.
+
+// a socket listening on a localhost TCP port, or a Unix socket path;
+// NULL if it can't
+ObjSocket *ioListen(Value address);
+// a connected socket, nil if the connection fails
+Value ioConnect(Value address, Value *result);
+// a connected socket, once a connection comes in
+Value ioAccept(ObjSocket *server, Value *result);
+// a string of what the socket has received, nil at its end
+Value ioRead(ObjSocket *socket, Value *result);
+// whether all of `text` was sent
+Value ioWrite(ObjSocket *socket, ObjString *text, Value *result);
+// the operations waiting on the socket finish as if it had ended
+void ioClose(ObjSocket *socket);
+// the contents of a file, nil if it can't be read
+Value ioReadFile(ObjString *path, Value *result);
+// whether the file could be written
+Value ioWriteFile(ObjString *path, ObjString *text, Value *result);
+Value ioSleep(int64_t nanoseconds, Value *result);
+// the operations started and not finished, and those finished whose
+// coroutines ioWait() hasn't handed back yet, as when closing a socket
+// finishes its reader at once
+int ioPending();
+// wait until some coroutines can be resumed, and take them; empty if no
+// operation is pending
+ObjList *ioWait();
+// free the socket's operations and close it, for when the VM is freed
+void freeSocket(ObjSocket *socket);
+void freeIo();
+
+#endif
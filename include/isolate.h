@@ -0,0 +1,37 @@
+#ifndef _clox_isolate_h
+#define _clox_isolate_h
+
+#include "common.h"
+#include "value.h"
+
+// Isolates are VMs that run scripts on threads of their own. Every VM and
+// compiler global is thread local, so an isolate has its own heap, globals
+// and interned strings, and isolates never share an object. Values pass
+// between them through channels: numbers, booleans and nil as they are,
+// strings as a copy of their characters, channels by reference.
+
+// A bounded queue of values that any number of isolates send into and
+// receive from without locks.
+typedef struct Channel Channel;
+typedef struct Isolate Isolate;
+
+// a channel with room for at least `capacity` values, holding one reference
+Channel *createChannel(int capacity);
+void releaseChannel(Channel *channel);
+// whether a value can be sent to another isolate
+bool isSendable(Value value);
+// wait until there is room in the channel, then send a copy of the value,
+// which must be sendable
+void sendValue(Channel *channel, Value value);
+// wait until the channel holds a value, then take it into this isolate
+Value receiveValue(Channel *channel);
+
+// start running `source` in a new isolate, whose global `argument` holds a
+// copy of the sendable `argument`; NULL if no thread could be started
+Isolate *spawnIsolate(const char *source, int length, Value argument);
+// wait for the isolate to finish; whether its script ran without errors
+bool waitIsolate(Isolate *isolate);
+// wait for the isolate to finish, then free it
+void freeIsolate(Isolate *isolate);
+
+#endif
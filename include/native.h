@@ -0,0 +1,7 @@
+#ifndef _clox_native_h
+#define _clox_native_h
+
+// register the native functions every script can call
+void defineNatives();
+
+#endif
@@ -2,19 +2,67 @@
 #define _clox_object_h
 
 #include "common.h"
+#include "chunk.h"
+#include "isolate.h"
 #include "value.h"
 #include "memory.h"
+#include "table.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_COROUTINE(value) isObjType(value, OBJ_COROUTINE)
+#define IS_FLOAT64_ARRAY(value) isObjType(value, OBJ_FLOAT64_ARRAY)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_ISOLATE(value) isObjType(value, OBJ_ISOLATE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_SOCKET(value) isObjType(value, OBJ_SOCKET)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
 
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_CHANNEL(value) ((ObjChannel *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_COROUTINE(value) ((ObjCoroutine *)AS_OBJ(value))
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array *)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_ISOLATE(value) ((ObjIsolate *)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_SOCKET(value) ((ObjSocket *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder *)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
 
 typedef enum
 {
+    OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
+    OBJ_CLASS,
+    OBJ_CLOSURE,
+    OBJ_COROUTINE,
+    OBJ_FLOAT64_ARRAY,
+    OBJ_FUNCTION,
+    OBJ_INSTANCE,
+    OBJ_ISOLATE,
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_NATIVE,
+    OBJ_SHAPE,
+    OBJ_SOCKET,
     OBJ_STRING,
+    OBJ_STRING_BUILDER,
+    OBJ_UPVALUE,
 } ObjType;
 
 struct Obj
@@ -31,14 +79,236 @@ struct ObjString
     uint32_t hash;
 };
 
+typedef struct
+{
+    Obj obj;
+    int arity;
+    int captureCount; // of the closures made from it
+    int maxSlots;     // stack slots a call uses at most, locals included
+    Chunk chunk;
+    ObjString *name; // NULL for the top level script
+} ObjFunction;
+
+// A variable shared by a closure and the function declaring it. It points
+// at the stack slot of the variable until its scope ends, then at closed.
+typedef struct ObjUpvalue
+{
+    Obj obj;
+    Value *location;
+    Value closed;
+    struct ObjUpvalue *next; // open upvalues, from the top of the stack down
+} ObjUpvalue;
+
+// A function with the variables it captured, stored flat in the closure:
+// copies of the variables nothing assigns, upvalues for the others.
+typedef struct
+{
+    Obj obj;
+    ObjFunction *function;
+    Value captures[];
+} ObjClosure;
+
+// A running function. Its locals are the window of the VM stack starting at
+// `slots`, whose slot 0 holds the function itself and the following ones its
+// arguments.
+typedef struct
+{
+    ObjFunction *function;
+    ObjClosure *closure; // NULL if the function captures nothing
+    uint8_t *ip;
+    Value *slots;
+} CallFrame;
+
+// The call frames and the value stack some code runs on. The script runs on
+// arrays in the VM and each coroutine on arrays of its own that grow as its
+// calls nest, up to FIBER_FRAMES_MAX frames; switching to a coroutine and
+// back swaps these fields in and out of the VM without copying either stack.
+typedef struct
+{
+    CallFrame *frames;
+    int frameCount;
+    int frameCapacity;
+    Value *stack;
+    Value *stackTop;
+    int stackCapacity;
+    ObjUpvalue *openUpvalues; // into this stack
+} Fiber;
+
+typedef enum
+{
+    COROUTINE_SUSPENDED,
+    COROUTINE_RUNNING,
+    COROUTINE_WAITING, // suspended until its I/O is done
+    COROUTINE_DONE,
+} CoroutineState;
+
+// A call that runs on its own stacks, suspending itself at each yield until
+// it is resumed again.
+typedef struct ObjCoroutine
+{
+    Obj obj;
+    CoroutineState state;
+    Fiber fiber;   // its stacks while it is suspended
+    Fiber resumer; // the stacks of the code that resumed it, while it runs
+    struct ObjCoroutine *previous; // that code's coroutine, NULL for the script
+} ObjCoroutine;
+
+// A function written in C. It reads its arguments in place on the VM stack
+// and is only called with as many as its arity, which the VM checks.
+typedef Value (*NativeFn)(int argCount, Value *args);
+
+typedef struct
+{
+    Obj obj;
+    NativeFn function;
+    int arity;
+    ObjString *name;
+} ObjNative;
+
+typedef struct ObjClass ObjClass;
+
+// A hidden class: the fields of an instance, in the order they were added.
+// Instances that got the same fields in the same order share a shape, so a
+// field is found at the same index in all of them. Shapes form a tree per
+// class whose root has no fields.
+struct ObjShape
+{
+    Obj obj;
+    ObjClass *klass;
+    ObjShape *parent;
+    ObjString *name; // of the field added to the parent, at fieldCount - 1
+    int fieldCount;
+    // shapes made by adding one more field to this one
+    ObjShape **transitions;
+    int transitionCount;
+    int transitionCapacity;
+};
+
+struct ObjClass
+{
+    Obj obj;
+    ObjString *name;
+    Table methods;
+    ObjShape *shape; // of new instances
+    Value initializer; // the init method, nil if there is none
+};
+
+typedef struct
+{
+    Obj obj;
+    ObjShape *shape;
+    Value *fields;
+    int capacity;
+} ObjInstance;
+
+// A list keeps its elements contiguous, growing like a ValueArray.
+typedef struct
+{
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+// A fixed length array of unboxed doubles, for the bulk numeric natives.
+typedef struct
+{
+    Obj obj;
+    int count;
+    double *values;
+} ObjFloat64Array;
+
+// A map is a hash table keyed by any value, strings by their contents and
+// other objects by identity.
+typedef struct
+{
+    Obj obj;
+    Table table;
+    int count; // the table's count includes tombstones
+} ObjMap;
+
+// A growable buffer of characters. Nothing in it is interned until it is
+// turned into a string.
+typedef struct
+{
+    Obj obj;
+    char *chars;
+    int length;
+    int capacity;
+} ObjStringBuilder;
+
+// This isolate's handle on a channel. The channel lives as long as any
+// isolate holds a handle on it or a message carries it.
+typedef struct
+{
+    Obj obj;
+    Channel *channel;
+} ObjChannel;
+
+// A script running in another isolate. Freeing it waits for the script to
+// finish.
+typedef struct
+{
+    Obj obj;
+    Isolate *isolate;
+} ObjIsolate;
+
+// An operation of the event loop in io.c
+typedef struct IoOperation IoOperation;
+
+// A non-blocking socket. At most one operation reads from it, or accepts
+// connections, and one writes to it, or connects it, at a time.
+typedef struct
+{
+    Obj obj;
+    int fd; // -1 once closed
+    IoOperation *reader;
+    IoOperation *writer;
+} ObjSocket;
+
+typedef struct
+{
+    Obj obj;
+    Value receiver;
+    Value method; // a function or a closure
+} ObjBoundMethod;
+
 static inline bool isObjType(Value value, ObjType type)
 {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+ObjBoundMethod *newBoundMethod(Value receiver, Value method);
+// a handle taking over a reference to the channel
+ObjChannel *newChannel(Channel *channel);
+ObjClass *newClass(ObjString *name);
+ObjClosure *newClosure(ObjFunction *function);
+// a suspended coroutine with room for one frame of `slotCount` values
+ObjCoroutine *newCoroutine(int slotCount);
+void freeFiber(Fiber *fiber);
+// an array of `count` zeros
+ObjFloat64Array *newFloat64Array(int count);
+ObjFunction *newFunction();
+ObjInstance *newInstance(ObjClass *klass);
+ObjIsolate *newIsolate(Isolate *isolate);
+// a list holding a copy of `count` values
+ObjList *newList(Value *items, int count);
+// an empty map with room for `count` entries
+ObjMap *newMap(int count);
+// the index of a field in the instances of a shape, -1 if they don't have it
+int shapeField(ObjShape *shape, ObjString *name);
+// the shape of an instance of `shape` after `name` is added to it
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+ObjNative *newNative(NativeFn function, int arity, ObjString *name);
+ObjSocket *newSocket(int fd);
+ObjStringBuilder *newStringBuilder();
+// reserve room for `length` more characters in the builder
+void reserveBuilder(ObjStringBuilder *builder, int length);
+void appendToBuilder(ObjStringBuilder *builder, const char *chars, int length);
+// an interned copy of what the builder holds so far
+ObjString *builderToString(ObjStringBuilder *builder);
 ObjString *copyString(const char *chars, int length);
 void printObject(Value value);
 ObjString *takeString(const char *chars, int length);
+ObjUpvalue *newUpvalue(Value *slot);
 void freeObjects();
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
@@ -0,0 +1,12 @@
+#ifndef _clox_optimizer_h
+#define _clox_optimizer_h
+
+#include "ast.h"
+
+// constant folding, copy propagation, dead store elimination, promotion of
+// globals used in loops and common subexpression elimination, in that order
+void optimize(Ast *ast);
+// annotate every expression with the type it is proven to have
+void inferTypes(Ast *ast);
+
+#endif
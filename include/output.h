@@ -0,0 +1,60 @@
+#ifndef _clox_output_h
+#define _clox_output_h
+
+#include <stddef.h>
+
+#include "common.h"
+
+// What print writes collects in a buffer owned by the VM and goes to its sink
+// in large pieces: when the buffer fills up, when the script finishes or
+// waits for I/O, and when flush() is called. The sink is a file descriptor,
+// standard output unless told otherwise, a block of memory for a program
+// embedding the VM, or a callback.
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+typedef enum
+{
+    SINK_FD,
+    SINK_MEMORY,
+    SINK_CALLBACK,
+} SinkType;
+
+// given each piece of output as it is flushed
+typedef void (*OutputFn)(const char *chars, size_t length, void *context);
+
+typedef struct
+{
+    SinkType sink;
+    int fd;
+    // everything flushed to the memory sink so far
+    char *memory;
+    size_t memoryLength;
+    size_t memoryCapacity;
+    OutputFn callback;
+    void *context;
+    // flush at the end of every print, as for a terminal
+    bool unbuffered;
+    size_t length;
+    char chars[OUTPUT_BUFFER_SIZE];
+} Output;
+
+// the VM's output starts out going to standard output, unbuffered if that
+// is a terminal
+void initOutput();
+// flush the output and free the memory sink's contents
+void freeOutput();
+void writeOutput(const char *chars, size_t length);
+// end what print wrote with a newline
+void endLine();
+void flushOutput();
+
+// Each of these flushes what was written to the previous sink first.
+void outputToFd(int fd);
+void outputToMemory();
+void outputToCallback(OutputFn callback, void *context);
+// what the memory sink holds, after flushing into it; `length` is set to
+// its length
+const char *outputMemory(size_t *length);
+
+#endif
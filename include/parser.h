@@ -0,0 +1,9 @@
+#ifndef _clox_parser_h
+#define _clox_parser_h
+
+#include "ast.h"
+
+// parse a whole script into a tree, resolving every local variable
+bool parse(const char *source, Ast *ast);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _clox_pool_h
+#define _clox_pool_h
+
+#include "common.h"
+#include "value.h"
+
+// A work-stealing pool of threads for the parallel natives. Each worker has
+// a VM of its own, in which it compiles the callback source it is given, and
+// a deque of tasks: a task covering many chunks of the input splits itself,
+// pushing one half for other workers to steal. The chunks are a fixed size,
+// so how the work is split, and how a reduction is grouped, is the same
+// however many workers there are.
+
+// the number of processors online
+int cpuCount();
+// the number of workers parallel operations run on from now on, 0 for one
+// per processor
+void setWorkerCount(int count);
+// stop the workers, waiting for what they are running to finish
+void stopPool();
+
+// The input of a parallel operation: `count` doubles, or the ints 0 to
+// count - 1 if `values` is NULL. `source` must define the callback
+// function; each operation returns NULL or why it failed.
+
+// out[i] = map(input[i])
+const char *parallelMap(const char *source, int length, const double *values, int64_t count,
+                        double *out);
+// reduce(reduce(input[0], input[1]), input[2])..., grouped by chunk; the
+// callback should be associative, and the input must not be empty
+const char *parallelReduce(const char *source, int length, const double *values,
+                           int64_t count, Value *result);
+
+#endif
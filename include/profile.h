@@ -0,0 +1,60 @@
+#ifndef _clox_profile_h
+#define _clox_profile_h
+
+#include <signal.h>
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// What `--profile=ops` collects: how many times each instruction of the
+// stack machine ran, and the cycles from its start to the start of the next
+// one. Slot UINT8_COUNT holds the time before the first instruction.
+typedef struct
+{
+    uint64_t counts[UINT8_COUNT + 1];
+    uint64_t cycles[UINT8_COUNT + 1];
+} OpProfile;
+
+// the time stamp counter where there is one, nanoseconds elsewhere
+static inline uint64_t readCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+#endif
+}
+
+// print the instructions that ran to stderr, those that took the most
+// cycles first, with the cost of reading the counter taken off
+void printOpProfile(OpProfile *profile);
+
+// The sampling profiler of `--profile=samples`. A timer on the CPU time of
+// the VM's thread sends it SIGPROF every millisecond, whose handler only
+// marks a sample due: the frames can be halfway through a call or a
+// coroutine switch when the signal comes. The dispatch loop built with
+// SAMPLE_LINES takes the sample before its next instruction, copying the
+// frames of the running code, and of the code that resumed each coroutine,
+// into a lock-free ring that a collector thread empties. Once sampling
+// stops the offsets are mapped to lines.
+
+// where the sampled stacks are written, one line per stack in the collapsed
+// format flame graph tools read
+#define SAMPLE_STACKS_PATH "clox.folded"
+
+// start sampling the thread of the running VM; false if it can't
+bool startSampling();
+// called by the dispatch loop when samples are due
+void takeSample();
+// stop sampling, print how often each line was running to stderr and write
+// the stacks to SAMPLE_STACKS_PATH
+void stopSampling();
+
+#endif
@@ -11,12 +11,18 @@ typedef enum
     TOKEN_LEFT_BRACKET,
     TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA,
+    TOKEN_COLON,
     TOKEN_DOT,
     TOKEN_MINUS,
     TOKEN_PLUS,
     TOKEN_SEMICOLON,
     TOKEN_SLASH,
     TOKEN_STAR,
+    TOKEN_PERCENT,
+    TOKEN_AMPERSAND,
+    TOKEN_PIPE,
+    TOKEN_CARET,
+    TOKEN_TILDE,
     // One or two character tokens.
     TOKEN_BANG,
     TOKEN_BANG_EQUAL,
@@ -24,8 +30,10 @@ typedef enum
     TOKEN_EQUAL_EQUAL,
     TOKEN_GREATER,
     TOKEN_GREATER_EQUAL,
+    TOKEN_GREATER_GREATER,
     TOKEN_LESS,
     TOKEN_LESS_EQUAL,
+    TOKEN_LESS_LESS,
     // Literals.
     TOKEN_IDENTIFIER,
     TOKEN_STRING,
@@ -33,6 +41,7 @@ typedef enum
     // Keywords.
     TOKEN_AND,
     TOKEN_CLASS,
+    TOKEN_COROUTINE,
     TOKEN_ELSE,
     TOKEN_FALSE,
     TOKEN_FOR,
@@ -41,12 +50,14 @@ typedef enum
     TOKEN_NIL,
     TOKEN_OR,
     TOKEN_PRINT,
+    TOKEN_RESUME,
     TOKEN_RETURN,
     TOKEN_SUPER,
     TOKEN_THIS,
     TOKEN_TRUE,
     TOKEN_VAR,
     TOKEN_WHILE,
+    TOKEN_YIELD,
 
     TOKEN_ERROR,
     TOKEN_EOF
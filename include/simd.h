@@ -0,0 +1,19 @@
+#ifndef _clox_simd_h
+#define _clox_simd_h
+
+// Bulk kernels over raw doubles. Each one runs an AVX2 or SSE2 loop when the
+// CPU has it and a scalar loop otherwise; sums may round differently from a
+// left to right loop because the vector lanes add in a different order.
+
+// pick the kernels for this CPU, before any of the others is called
+void initKernels();
+void addDoubles(double *out, const double *a, const double *b, int count);
+void mulDoubles(double *out, const double *a, const double *b, int count);
+double sumDoubles(const double *values, int count);
+double dotDoubles(const double *a, const double *b, int count);
+// `count` must be at least 1
+double minDoubles(const double *values, int count);
+double maxDoubles(const double *values, int count);
+void fillDoubles(double *out, double value, int count);
+
+#endif
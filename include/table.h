@@ -1,13 +1,18 @@
 #ifndef _clox_table_h
 #define _clox_table_h
 
-#include "object.h"
+#include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
 
+// any value can be a key; a slot without a key holds a null object, with
+// a nil value when it is empty and a true value when it is a tombstone
+#define EMPTY_KEY OBJ_VAL(NULL)
+#define IS_EMPTY_KEY(key) (IS_OBJ(key) && AS_OBJ(key) == NULL)
+
 typedef struct
 {
-    ObjString *key;
+    Value key;
     Value value;
 } Entry;
 
@@ -23,7 +28,13 @@ void freeTable(Table *table);
 bool tableSet(ObjString *key, Value value, Table *table);
 void tableAddAll(Table *from, Table *to);
 bool tableGet(Table *table, ObjString *key, Value *value);
+Entry *tableGetEntry(Table *table, ObjString *key);
 bool tableDelete(Table *table, ObjString *key);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
+// grow the table once so `count` entries fit without rehashing
+void tableReserve(Table *table, int count);
+bool tableSetValue(Value key, Value value, Table *table);
+bool tableGetValue(Table *table, Value key, Value *value);
+bool tableDeleteValue(Table *table, Value key);
 
 #endif
\ No newline at end of file
@@ -1,16 +1,20 @@
 #ifndef _clox_value_h
 #define _clox_value_h
 
+#include <math.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjShape ObjShape;
 
 typedef enum
 {
     VAL_BOOL,
     VAL_NIL,
-    VAL_NUMBER,
+    VAL_INT,
+    VAL_DOUBLE,
     VAL_OBJ,
 } ValueType;
 
@@ -20,6 +24,7 @@ typedef struct
     union
     {
         bool boolean;
+        int64_t integer;
         double number;
         Obj *obj;
     } as;
@@ -27,16 +32,23 @@ typedef struct
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_DOUBLE(value) ((value).type == VAL_DOUBLE)
+// ints and doubles are both numbers
+#define IS_NUMBER(value) (IS_INT(value) || IS_DOUBLE(value))
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_DOUBLE(value) ((value).as.number)
+// the value of either kind of number as a double
+#define AS_NUMBER(value) (IS_INT(value) ? (double)AS_INT(value) : AS_DOUBLE(value))
 #define AS_OBJ(value) ((value).as.obj)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
-#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
+#define NUMBER_VAL(value) ((Value){VAL_DOUBLE, {.number = value}})
 #define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = (Obj *)value}})
 
 typedef struct
@@ -49,7 +61,91 @@ typedef struct
 void initValueArray(ValueArray *array);
 void freeValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
+// grow the array the way writeValueArray() does until `capacity` values fit
+void reserveValueArray(ValueArray *array, int capacity);
+// write the value into the VM's output, the way print shows it
 void printValue(Value value);
+// write a number the way print shows it, without the terminating null, and
+// return its length; `buffer` needs room for NUMBER_BUFFER_SIZE characters
+#define NUMBER_BUFFER_SIZE 32
+int formatNumber(Value value, char *buffer);
 bool valuesEqual(Value a, Value b);
 
+// Arithmetic on two numbers, shared by both VMs and the constant folder.
+// Ints stay ints unless the result overflows, which gives the double result
+// instead, and anything involving a double is done in doubles.
+
+static inline Value addNumbers(Value a, Value b)
+{
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b)
+{
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b)
+{
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+// an int only when the division is exact
+static inline Value divideNumbers(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0 &&
+        !(AS_INT(a) == INT64_MIN && AS_INT(b) == -1) && AS_INT(a) % AS_INT(b) == 0)
+        return INT_VAL(AS_INT(a) / AS_INT(b));
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+// the remainder has the sign of the dividend, like fmod()
+static inline Value moduloNumbers(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0)
+        return INT_VAL(AS_INT(b) == -1 ? 0 : AS_INT(a) % AS_INT(b));
+    return NUMBER_VAL(fmod(AS_NUMBER(a), AS_NUMBER(b)));
+}
+
+static inline Value negateNumber(Value a)
+{
+    if (IS_INT(a) && AS_INT(a) != INT64_MIN)
+        return INT_VAL(-AS_INT(a));
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static inline bool lessNumbers(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) < AS_INT(b);
+    return AS_NUMBER(a) < AS_NUMBER(b);
+}
+
+static inline bool greaterNumbers(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) > AS_INT(b);
+    return AS_NUMBER(a) > AS_NUMBER(b);
+}
+
+// an int shifted by a count from 0 to 63, false for any other count. Right
+// shifts keep the sign.
+static inline bool shiftInt(int64_t a, int64_t count, bool left, int64_t *result)
+{
+    if (count < 0 || count > 63)
+        return false;
+    // shifting the bits unsigned keeps a left shift of a negative int defined
+    *result = left ? (int64_t)((uint64_t)a << count) : a >> count;
+    return true;
+}
+
 #endif
\ No newline at end of file
@@ -2,23 +2,61 @@
 #define _clox_vm_h
 
 #include "chunk.h"
+#include "object.h"
+#include "output.h"
+#include "profile.h"
 #include "value.h"
 #include "table.h"
 
-#define STACK_MAX (1 << 16)
+#define FRAMES_MAX 256
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// how deep calls nest in a coroutine, whose stacks grow
+#define FIBER_FRAMES_MAX (FRAMES_MAX * 64)
 
 typedef struct
 {
-    Chunk *chunk;
-    uint8_t *ip;
-    Value stack[STACK_MAX];
+    // the stacks of the running code, the same fields as a Fiber: the script's
+    // arrays below, or those of the running coroutine
+    CallFrame *frames;
+    int frameCount;
+    int frameCapacity;
+    Value *stack;
     Value *stackTop;
+    int stackCapacity;
+    ObjUpvalue *openUpvalues;
+    ObjCoroutine *coroutine; // NULL while the script itself runs
+    CallFrame scriptFrames[FRAMES_MAX];
+    Value scriptStack[STACK_MAX];
     Table globals;
     Table strings;
+    ObjString *initString;
     Obj *objects;
+    // instructions rewritten into quickened forms, and quickened
+    // instructions whose guard failed
+    uint64_t quickened;
+    uint64_t deoptimized;
+    // compile to and run the register machine instead of the stack machine
+    bool registerMachine;
+    // report how long each compilation took
+    bool printCompileTime;
+    // run on the dispatch loop that profiles each instruction, and report
+    // the profile when the VM is freed
+    bool profileOps;
+    OpProfile opProfile;
+    // run on the dispatch loop that takes samples, and report them when the
+    // VM is freed; the signal handler counts how many are due
+    bool profileSamples;
+    volatile sig_atomic_t samplesDue;
+    // set by a native function that failed, reported once it returns
+    const char *nativeError;
+    // set by a native function that left the running coroutine waiting for
+    // I/O, which is suspended once it returns
+    bool suspending;
+    // what print writes, on its way to the output
+    Output output;
 } VM;
 
-extern VM vm;
+extern _Thread_local VM vm;
 
 typedef enum
 {
@@ -29,7 +67,13 @@ typedef enum
 
 void initVM();
 void freeVM();
+// make a C function callable from Lox as a global
+void defineNative(const char *name, NativeFn function, int arity);
+// make the running native function fail with a runtime error
+Value nativeError(const char *message);
 InterpretResult interpret(const char *source);
+// call a value with `argCount` arguments while no code runs on the VM
+InterpretResult callFunction(Value callee, Value *args, int argCount, Value *result);
 void push(Value value);
 Value pop();
 Value *top();
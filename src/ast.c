@@ -0,0 +1,150 @@
+#include <string.h>
+
+#include "ast.h"
+#include "memory.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+// nothing in the tree needs more than the alignment of a double or a pointer
+#define ARENA_ALIGNMENT 8
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+_Thread_local ArenaBlock *arena = NULL;
+
+void *astAllocate(size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (arena == NULL || arena->used + size > arena->capacity)
+    {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *block = reallocate(NULL, 0, sizeof(ArenaBlock) + capacity);
+        block->next = arena;
+        block->used = 0;
+        block->capacity = capacity;
+        arena = block;
+    }
+
+    void *pointer = arena->data + arena->used;
+    arena->used += size;
+    return pointer;
+}
+
+void freeAst()
+{
+    while (arena != NULL)
+    {
+        ArenaBlock *next = arena->next;
+        reallocate(arena, sizeof(ArenaBlock) + arena->capacity, 0);
+        arena = next;
+    }
+}
+
+Node *newNode(NodeType type, int line)
+{
+    Node *node = astAllocate(sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    node->line = line;
+    node->staticType = TYPE_ANY;
+    return node;
+}
+
+// a shallow copy, only used for leaves and for nodes whose children are
+// shared on purpose
+Node *copyNode(Node *node)
+{
+    Node *copy = astAllocate(sizeof(Node));
+    *copy = *node;
+    return copy;
+}
+
+Variable *newVariable(Ast *ast, Token name)
+{
+    Variable *variable = astAllocate(sizeof(Variable));
+    memset(variable, 0, sizeof(Variable));
+    variable->name = name;
+    variable->depth = -1;
+    variable->id = ast->variableCount++;
+    variable->owner = -1;
+    variable->slot = -1;
+    return variable;
+}
+
+static void growList(NodeList *list)
+{
+    if (list->count + 1 <= list->capacity)
+        return;
+
+    // the old array stays in the arena until the whole tree is freed
+    int capacity = GROW_CAPACITY(list->capacity);
+    Node **nodes = astAllocate(sizeof(Node *) * capacity);
+    if (list->count > 0)
+        memcpy(nodes, list->nodes, sizeof(Node *) * list->count);
+    list->nodes = nodes;
+    list->capacity = capacity;
+}
+
+void appendNode(NodeList *list, Node *node)
+{
+    growList(list);
+    list->nodes[list->count++] = node;
+}
+
+void insertNode(NodeList *list, int index, Node *node)
+{
+    growList(list);
+    memmove(&list->nodes[index + 1], &list->nodes[index],
+            sizeof(Node *) * (list->count - index));
+    list->nodes[index] = node;
+    list->count++;
+}
+
+void removeNode(NodeList *list, int index)
+{
+    memmove(&list->nodes[index], &list->nodes[index + 1],
+            sizeof(Node *) * (list->count - index - 1));
+    list->count--;
+}
+
+bool isExpression(Node *node)
+{
+    return node->type <= NODE_CLASS;
+}
+
+bool sameExpression(Node *a, Node *b)
+{
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type)
+    {
+    case NODE_CONSTANT:
+        if (a->as.constant.type != b->as.constant.type)
+            return false;
+        if (IS_DOUBLE(a->as.constant))
+            return memcmp(&a->as.constant.as.number, &b->as.constant.as.number,
+                          sizeof(double)) == 0;
+        return IS_NIL(a->as.constant) || valuesEqual(a->as.constant, b->as.constant);
+    case NODE_UNARY:
+        return a->as.unary.op == b->as.unary.op &&
+               sameExpression(a->as.unary.operand, b->as.unary.operand);
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        return a->as.binary.op == b->as.binary.op &&
+               sameExpression(a->as.binary.left, b->as.binary.left) &&
+               sameExpression(a->as.binary.right, b->as.binary.right);
+    case NODE_GET_GLOBAL:
+        return a->as.global.name == b->as.global.name;
+    case NODE_GET_LOCAL:
+        return a->as.local.variable == b->as.local.variable;
+    default:
+        // assignments are never the same computation twice
+        return false;
+    }
+}
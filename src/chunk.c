@@ -67,11 +67,23 @@ void initChunk(Chunk *chunk)
     chunk->code = NULL;
     initLine(&chunk->lines);
     initValueArray(&chunk->constants);
+    chunk->globalSlots = NULL;
+    chunk->deopts = NULL;
+    chunk->promoted = NULL;
+    chunk->promotedCount = 0;
+    chunk->promotedCapacity = 0;
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
 }
 
 void freeChunk(Chunk *chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->globalSlots, chunk->constants.count);
+    FREE_ARRAY(uint8_t, chunk->deopts, chunk->count);
+    FREE_ARRAY(PromotedGlobal, chunk->promoted, chunk->promotedCapacity);
+    FREE_ARRAY(PropertyCache, chunk->caches, chunk->cacheCapacity);
     freeLine(&chunk->lines);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
@@ -91,6 +103,39 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
     chunk->count++;
 }
 
+void addPromotedGlobal(Chunk *chunk, int start, int end, int slot, int name)
+{
+    if (chunk->promotedCapacity < chunk->promotedCount + 1)
+    {
+        int oldCapacity = chunk->promotedCapacity;
+        chunk->promotedCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->promoted = GROW_ARRAY(PromotedGlobal, chunk->promoted, oldCapacity,
+                                     chunk->promotedCapacity);
+    }
+
+    PromotedGlobal *promoted = &chunk->promoted[chunk->promotedCount++];
+    promoted->start = start;
+    promoted->end = end;
+    promoted->slot = slot;
+    promoted->name = name;
+}
+
+int addPropertyCache(Chunk *chunk, int name)
+{
+    if (chunk->cacheCapacity < chunk->cacheCount + 1)
+    {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(PropertyCache, chunk->caches, oldCapacity,
+                                   chunk->cacheCapacity);
+    }
+
+    PropertyCache *cache = &chunk->caches[chunk->cacheCount];
+    cache->name = name;
+    cache->count = 0;
+    return chunk->cacheCount++;
+}
+
 int addConstant(Chunk *chunk, Value value)
 {
     writeValueArray(&chunk->constants, value);
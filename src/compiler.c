@@ -1,207 +1,76 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "common.h"
-#include "scanner.h"
 #include "compiler.h"
+#include "parser.h"
+#include "optimizer.h"
 #include "object.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+// The code generators walk the tree built by the parser once the passes are
+// done with it. Locals get their stack slot, or register, as their
+// declaration is reached. Every function is generated into a chunk of its
+// own, whose slots are counted from the start of its call frame.
+// A captured variable that is never assigned after its declaration is
+// copied into the closure. The others are boxed: the closure and the
+// function declaring the variable share an upvalue, which points at the
+// stack slot until the scope of the variable ends.
 typedef struct
 {
-    Token previous;
-    Token current;
-    bool hadError;
-    bool panicMode;
-} Parser;
-
-typedef enum
-{
-    PREC_NONE,
-    PREC_ASSIGNMENT, // =
-    PREC_OR,         // or
-    PREC_AND,        // and
-    PREC_EQUALITY,   // == !=
-    PREC_COMPARISON, // < > <= >=
-    PREC_TERM,       // + -
-    PREC_FACTOR,     // * /
-    PREC_UNARY,      // ! -
-    PREC_CALL,       // . ()
-    PREC_PRIMARY
-} Precedence;
-
-typedef void (*ParseFn)(bool canAssign);
-
-typedef struct
-{
-    ParseFn prefix;
-    ParseFn infix;
-    Precedence precedence;
-} ParseRule;
+    Variable *variable;
+    uint8_t flags;
+    uint16_t index;
+} Capture;
 
-typedef struct
+// the variables a function reads from the functions it is declared in
+typedef struct CaptureList
 {
-    Token name;
-    int depth;
-} Local;
+    struct CaptureList *enclosing;
+    int function;   // owner of the locals of the function
+    Variable *self; // variable the function is stored in, if it is local
+    Capture captures[UINT8_COUNT];
+    int count;
+} CaptureList;
 
 typedef struct
 {
-    Local *locals;
     int localCount;
-    int capacity;
-    int scopeDepth;
-} Compiler;
-
-static void grouping(bool canAssign);
-static void unary(bool canAssign);
-static void binary(bool canAssign);
-static void number(bool canAssign);
-static void literal(bool canAssign);
-static void string(bool canAssign);
-static void statement();
-static void declaration();
-static void variable(bool canAssign);
-static void and_(bool canAssign);
-static void or_(bool canAssign);
-
-ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
-    [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
-    [TOKEN_MINUS] = {unary, binary, PREC_TERM},
-    [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
-    [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
-    [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
-    [TOKEN_BANG] = {unary, NULL, PREC_NONE},
-    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
-    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
-    [TOKEN_STRING] = {string, NULL, PREC_NONE},
-    [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, and_, PREC_AND},
-    [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
-    [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
-    [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
-    [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_IF] = {NULL, NULL, PREC_NONE},
-    [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, or_, PREC_OR},
-    [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
-    [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
-    [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
-    [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
-    [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
-    [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
-    [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
-};
-
-Parser parser;
-Compiler *current = NULL;
-Chunk *compilingChunk;
+    int depth;    // values left on the stack by the expressions being compiled
+    int maxSlots; // the most stack slots the function uses, locals included
+    int functionCount;
+    CaptureList *captures; // of the function being generated
+    int line;              // of the node being compiled
+    bool hadError;
+} Generator;
+
+_Thread_local Generator generator;
+_Thread_local Chunk *compilingChunk;
+_Thread_local CompileTimes compileTimes;
 
 static Chunk *currentChunk()
 {
     return compilingChunk;
 }
 
-void errorAt(Token *token, const char *message)
-{
-    if (parser.panicMode)
-        return;
-    parser.panicMode = true;
-    fprintf(stderr, "[\x1b[32mLine %d\x1b[0m] \x1b[31mError\x1b[0m: ", token->line);
-
-    if (token->type == TOKEN_EOF)
-    {
-        fprintf(stderr, "at end");
-    }
-    else if (token->type == TOKEN_ERROR)
-    {
-        // nothing
-    }
-    else
-    {
-        fprintf(stderr, "at '%.*s'", (int)token->length, token->start);
-    }
-
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
-}
-
-void errorAtCurrent(const char *message)
-{
-    errorAt(&parser.current, message);
-}
-
-void error(const char *message)
-{
-    errorAt(&parser.previous, message);
-}
-
-static void advance()
-{
-    parser.previous = parser.current;
-    for (;;)
-    {
-        parser.current = scanToken();
-
-        if (parser.current.type != TOKEN_ERROR)
-            break;
-
-        errorAtCurrent(parser.current.start);
-    }
-}
-
-void consume(TokenType type, const char *message)
-{
-    if (parser.current.type == type)
-    {
-        advance();
-        return;
-    }
-
-    errorAtCurrent(message);
-}
-
-#define CHECK(type_) (parser.current.type == type_)
-
-static bool match(TokenType type)
+static void generatorError(const char *message)
 {
-    if (!CHECK(type))
-        return false;
-
-    advance();
-    return true;
+    fprintf(stderr, "[\x1b[32mLine %d\x1b[0m] \x1b[31mError\x1b[0m: %s\n", generator.line, message);
+    generator.hadError = true;
 }
 
-#define emitByte(byte) writeChunk(currentChunk(), byte, parser.previous.line)
-#define emitReturn() emitByte(OP_RETURN)
+#define emitByte(byte) writeChunk(currentChunk(), byte, generator.line)
 #define emitBytes(byte1, byte2) \
     do                          \
     {                           \
         emitByte(byte1);        \
         emitByte(byte2);        \
     } while (0)
-#define emitConstant(value) writeConstant(currentChunk(), (Value)value, parser.previous.line)
-#define getRule(type) (&rules[type])
-#define beginScope() current->scopeDepth++
 
 static int emitJump(uint8_t instruction)
 {
@@ -217,7 +86,7 @@ static void patchJump(int offset)
 
     if (jump > UINT16_MAX)
     {
-        error("Too much code to jump");
+        generatorError("Too much code to jump");
     }
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
@@ -230,427 +99,944 @@ static void emitLoop(int loopStart)
 
     int offset = currentChunk()->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large.");
+        generatorError("Loop body too large.");
 
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
 }
 
-static void endScope()
+static void initGenerator(ObjFunction *function, CaptureList *script)
 {
-    current->scopeDepth--;
+    compilingChunk = &function->chunk;
+    script->enclosing = NULL;
+    script->function = 0;
+    script->self = NULL;
+    script->count = 0;
+    generator.captures = script;
+    generator.functionCount = 1;
+    // stack slot 0 belongs to the script itself
+    generator.localCount = 1;
+    generator.depth = 0;
+    generator.maxSlots = 1;
+    generator.line = 0;
+    generator.hadError = false;
+}
 
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth > current->scopeDepth)
-    {
-        emitByte(OP_POP);
-        current->localCount--;
-    }
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
 }
 
-static void initCompiler(Compiler *compiler)
+// parse and optimize a script, timing both
+static bool buildAst(const char *source, Ast *ast)
 {
-    compiler->scopeDepth = 0;
-    compiler->capacity = 256;
-    compiler->localCount = 0;
-    compiler->locals = GROW_ARRAY(Local, NULL, 0, 256);
-    current = compiler;
+    double start = now();
+    bool parsed = parse(source, ast);
+    double parsedAt = now();
+    compileTimes.parse = parsedAt - start;
+    compileTimes.optimize = 0;
+    compileTimes.generate = 0;
+    if (!parsed)
+        return false;
+
+    optimize(ast);
+    inferTypes(ast);
+    compileTimes.optimize = now() - parsedAt;
+    return true;
 }
 
-static void endCompiler()
+static int identifierConstant(ObjString *name)
 {
-    emitByte(OP_RETURN);
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
-    {
-        disassembleChunk(currentChunk(), "code");
-    }
-#endif
+    return addConstant(currentChunk(), OBJ_VAL(name));
 }
 
-static void parsePrecedence(Precedence precedence)
+static void expression(Node *node);
+static void statement(Node *node);
+static void function(Node *node, Variable *self);
+
+static void constant(Value value)
 {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    if (IS_NIL(value))
+        emitByte(OP_NIL);
+    else if (IS_BOOL(value))
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        writeConstant(currentChunk(), value, generator.line);
+}
 
-    if (prefixRule == NULL)
-    {
-        error("Expect expression.");
-        return;
-    }
+// emit the unchecked form of an instruction if both operands are known numbers
+static void emitArithmetic(bool numbers, uint8_t checked, uint8_t unchecked)
+{
+    emitByte(numbers ? unchecked : checked);
+}
 
-    bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+static void unary(Node *node)
+{
+    Node *operand = node->as.unary.operand;
+    expression(operand);
+    generator.line = node->line;
 
-    while (precedence <= getRule(parser.current.type)->precedence)
+    switch (node->as.unary.op)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-
-        infixRule(canAssign);
+    case TOKEN_MINUS:
+        emitArithmetic(operand->staticType == TYPE_NUMBER, OP_NEGATE, OP_NEGATE_NUM);
+        return;
+    case TOKEN_BANG:
+        emitByte(OP_NOT);
+        return;
+    case TOKEN_TILDE:
+        emitByte(OP_BIT_NOT);
+        return;
+    default:
+        PANIC("Unreachable code");
+        return;
     }
+}
 
-    if (canAssign && match(TOKEN_EQUAL))
+static void binary(Node *node)
+{
+    Node *left = node->as.binary.left;
+    Node *right = node->as.binary.right;
+    expression(left);
+    expression(right);
+    generator.line = node->line;
+    bool numbers = left->staticType == TYPE_NUMBER && right->staticType == TYPE_NUMBER;
+
+    switch (node->as.binary.op)
     {
-        error("Invalid assignment target.");
+    case TOKEN_PLUS:
+        emitArithmetic(numbers, OP_ADD, OP_ADD_NUM);
+        break;
+    case TOKEN_MINUS:
+        emitArithmetic(numbers, OP_SUBSTRACT, OP_SUBSTRACT_NUM);
+        break;
+    case TOKEN_STAR:
+        emitArithmetic(numbers, OP_MULTIPLY, OP_MULTIPLY_NUM);
+        break;
+    case TOKEN_SLASH:
+        emitArithmetic(numbers, OP_DIVIDE, OP_DIVIDE_NUM);
+        break;
+    case TOKEN_PERCENT:
+        emitArithmetic(numbers, OP_MODULO, OP_MODULO_NUM);
+        break;
+    case TOKEN_AMPERSAND:
+        emitByte(OP_BIT_AND);
+        break;
+    case TOKEN_PIPE:
+        emitByte(OP_BIT_OR);
+        break;
+    case TOKEN_CARET:
+        emitByte(OP_BIT_XOR);
+        break;
+    case TOKEN_LESS_LESS:
+        emitByte(OP_SHIFT_LEFT);
+        break;
+    case TOKEN_GREATER_GREATER:
+        emitByte(OP_SHIFT_RIGHT);
+        break;
+    case TOKEN_EQUAL_EQUAL:
+        emitByte(OP_EQUAL);
+        break;
+    case TOKEN_GREATER:
+        emitArithmetic(numbers, OP_GREATER, OP_GREATER_NUM);
+        break;
+    case TOKEN_LESS:
+        emitArithmetic(numbers, OP_LESS, OP_LESS_NUM);
+        break;
+    case TOKEN_BANG_EQUAL:
+        emitBytes(OP_EQUAL, OP_NOT);
+        break;
+    case TOKEN_GREATER_EQUAL:
+        emitArithmetic(numbers, OP_LESS, OP_LESS_NUM);
+        emitByte(OP_NOT);
+        break;
+    case TOKEN_LESS_EQUAL:
+        emitArithmetic(numbers, OP_GREATER, OP_GREATER_NUM);
+        emitByte(OP_NOT);
+        break;
+    default:
+        PANIC("Unreachable code");
+        return;
     }
 }
 
-#define expression() parsePrecedence(PREC_ASSIGNMENT)
-
-static void block()
+static void logical(Node *node)
 {
-    while (!CHECK(TOKEN_RIGHT_BRACE) && !CHECK(TOKEN_EOF))
+    expression(node->as.binary.left);
+    generator.line = node->line;
+
+    if (node->as.binary.op == TOKEN_AND)
     {
-        declaration();
+        int endJump = emitJump(OP_JUMP_IF_FALSE);
+
+        emitByte(OP_POP);
+        expression(node->as.binary.right);
+
+        patchJump(endJump);
     }
+    else
+    {
+        int elseJump = emitJump(OP_JUMP_IF_FALSE);
+        int endJump = emitJump(OP_JUMP);
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+        patchJump(elseJump);
+        emitByte(OP_POP);
+
+        expression(node->as.binary.right);
+        patchJump(endJump);
+    }
 }
 
-static int identifierConstant(Token *name)
+static void declareLocal(Variable *variable)
 {
-    return addConstant(currentChunk(), OBJ_VAL(copyString(name->start, name->length)));
+    variable->owner = generator.captures->function;
+    variable->slot = generator.localCount++;
+    if (generator.localCount > generator.maxSlots)
+        generator.maxSlots = generator.localCount;
 }
 
-static bool identifiersEqual(Token *a, Token *b)
+// the slot of a variable in the frame of the function, or -1 if it belongs
+// to an enclosing one
+static int localSlot(CaptureList *list, Variable *variable)
 {
-    if (a->length != b->length)
-        return false;
-    return memcmp(a->start, b->start, a->length) == 0;
+    if (variable->owner == list->function)
+        return variable->slot;
+    // a function that is never reassigned reads itself from the callee slot
+    if (variable == list->self && variable->writes == 0)
+        return 0;
+    return -1;
 }
 
-static int resolveLocal(Compiler *compiler, Token *name)
+static int resolveCapture(CaptureList *list, Variable *variable)
 {
-    for (int i = compiler->localCount - 1; i >= 0; i--)
+    for (int i = 0; i < list->count; i++)
     {
-        Local *local = &current->locals[i];
-        if (identifiersEqual(name, &local->name))
-        {
-            if (local->depth == -1)
-            {
-                error("Can't read local variable in its own initializer.");
-            }
+        if (list->captures[i].variable == variable)
             return i;
-        }
     }
-    return -1;
-}
 
-static void addLocal(Token name)
-{
-    if (current->localCount > MAX_LOCAL)
+    Capture capture;
+    capture.variable = variable;
+    capture.flags = 0;
+    if (variable->writes > 0)
+    {
+        capture.flags |= CAPTURE_BOXED;
+        variable->boxed = true;
+    }
+    int slot = localSlot(list->enclosing, variable);
+    if (slot != -1)
     {
-        error("Too many local variables in function.");
+        capture.flags |= CAPTURE_LOCAL;
+        capture.index = slot;
     }
-    if (current->localCount + 1 > current->capacity)
+    else
     {
-        int oldCapacity = current->capacity;
-        current->capacity = GROW_CAPACITY(oldCapacity);
-        current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->capacity);
+        capture.index = resolveCapture(list->enclosing, variable);
     }
 
-    Local *local = &current->locals[current->localCount];
-    local->name = name;
-    local->depth = -1;
-    current->localCount++;
+    if (list->count == UINT8_COUNT)
+    {
+        generatorError("Too many closure variables in function.");
+        return 0;
+    }
+    list->captures[list->count] = capture;
+    return list->count++;
 }
 
-static void declareVariable()
+static void localAccess(Node *node, bool set)
 {
-    if (current->scopeDepth == 0)
-        return;
-
-    Token *name = &parser.previous;
-    for (int i = current->localCount - 1; i >= 0; i--)
+    Variable *variable = node->as.local.variable;
+    int slot = localSlot(generator.captures, variable);
+    if (slot != -1)
     {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
-            break;
-
-        if (identifiersEqual(name, &local->name))
-            error("Already have a variable with this name in this scope.");
+        writeConst(currentChunk(), slot, node->line, set ? OP_SET_LOCAL : OP_GET_LOCAL,
+                   set ? OP_SET_LOCAL_LONG : OP_GET_LOCAL_LONG, MAX_LOCAL, 3,
+                   "Unreachable code.");
+        return;
     }
 
-    addLocal(*name);
+    int capture = resolveCapture(generator.captures, variable);
+    if (generator.captures->captures[capture].flags & CAPTURE_BOXED)
+        emitBytes(set ? OP_SET_UPVALUE : OP_GET_UPVALUE, capture);
+    else if (!set)
+        emitBytes(OP_GET_CAPTURED, capture);
+    else
+        PANIC("Assignment to a variable captured by value.");
 }
 
-static int parseVariable(const char *errorMessage)
+static void globalAccess(Node *node, uint8_t shortInstruction, uint8_t longInstruction)
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
-
-    declareVariable();
-    if (current->scopeDepth > 0)
-        return 0;
+    writeConst(currentChunk(), identifierConstant(node->as.global.name), node->line,
+               shortInstruction, longInstruction, MAX_LONG_CONSTANT, 3,
+               "The max number of globals should not over 16777215.");
+}
 
-    return identifierConstant(&parser.previous);
+// emit the index of a new inline cache for a property instruction
+static void propertyCache(ObjString *name)
+{
+    int cache = addPropertyCache(currentChunk(), identifierConstant(name));
+    if (cache > UINT16_MAX)
+        generatorError("Too many property accesses in one function.");
+    emitBytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
-static void markInitialized()
+static void property(Node *node)
 {
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    expression(node->as.property.object);
+    if (node->type == NODE_SET_PROPERTY)
+        expression(node->as.property.value);
+    generator.line = node->line;
+    emitByte(node->type == NODE_SET_PROPERTY ? OP_SET_PROPERTY : OP_GET_PROPERTY);
+    propertyCache(node->as.property.name);
 }
 
-static void defineVariable(int global)
+// a list literal, or a map literal whose keys and values are interleaved
+static void collection(Node *node)
 {
-    if (current->scopeDepth > 0)
+    NodeList *elements = &node->as.elements;
+    for (int i = 0; i < elements->count; i++)
     {
-        markInitialized();
-        return;
+        expression(elements->nodes[i]);
     }
-    writeGlobal(currentChunk(), global, parser.previous.line);
+    int count = node->type == NODE_MAP ? elements->count / 2 : elements->count;
+    generator.line = node->line;
+    emitByte(node->type == NODE_MAP ? OP_MAP : OP_LIST);
+    emitBytes((count >> 8) & 0xff, count & 0xff);
 }
 
-static void and_(bool canAssign)
+static void subscript(Node *node)
 {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
-
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
-
-    patchJump(endJump);
+    expression(node->as.subscript.object);
+    expression(node->as.subscript.index);
+    if (node->type == NODE_SET_INDEX)
+        expression(node->as.subscript.value);
+    generator.line = node->line;
+    emitByte(node->type == NODE_SET_INDEX ? OP_INDEX_SET : OP_INDEX_GET);
 }
 
-static void or_(bool canAssign)
+// A call in tail position reuses the frame of the function making it, so it
+// returns straight to that function's caller.
+static void call(Node *node, bool tail)
 {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
-
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    // a method called right away is invoked without binding it
+    Node *callee = node->as.call.callee;
+    bool invoke = callee->type == NODE_GET_PROPERTY && !node->as.call.coroutine;
+    expression(invoke ? callee->as.property.object : callee);
+    NodeList *arguments = &node->as.call.arguments;
+    for (int i = 0; i < arguments->count; i++)
+    {
+        expression(arguments->nodes[i]);
+    }
+    generator.line = node->line;
+    if (invoke)
+    {
+        emitByte(tail ? OP_TAIL_INVOKE : OP_INVOKE);
+        propertyCache(callee->as.property.name);
+        emitByte(arguments->count);
+    }
+    else if (node->as.call.coroutine)
+    {
+        emitBytes(OP_COROUTINE, arguments->count);
+    }
+    else
+    {
+        emitBytes(tail ? OP_TAIL_CALL : OP_CALL, arguments->count);
+    }
+}
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+static void klass(Node *node)
+{
+    int name = identifierConstant(node->as.klass.name);
+    writeConst(currentChunk(), name, node->line, OP_CLASS, OP_CLASS_LONG, MAX_LONG_CONSTANT, 3,
+               "The max number of constants should not over 16777215.");
+    NodeList *methods = &node->as.klass.methods;
+    for (int i = 0; i < methods->count; i++)
+    {
+        function(methods->nodes[i], NULL);
+        name = identifierConstant(methods->nodes[i]->as.function.name);
+        writeConst(currentChunk(), name, methods->nodes[i]->line, OP_METHOD, OP_METHOD_LONG,
+                   MAX_LONG_CONSTANT, 3, "The max number of constants should not over 16777215.");
+    }
 }
 
-static void synchronize()
+// compile the body of a function into a function object of its own, and
+// the instruction that creates it where it is declared
+static void function(Node *node, Variable *self)
 {
-    parser.panicMode = false;
+    Chunk *enclosingChunk = compilingChunk;
+    int enclosingLocalCount = generator.localCount;
+    int enclosingDepth = generator.depth;
+    int enclosingMaxSlots = generator.maxSlots;
+    CaptureList captures;
+    captures.enclosing = generator.captures;
+    captures.function = generator.functionCount++;
+    captures.self = self;
+    captures.count = 0;
+    generator.captures = &captures;
+
+    ObjFunction *function = newFunction();
+    function->name = node->as.function.name;
+    function->arity = node->as.function.arity;
+    compilingChunk = &function->chunk;
+    // slot 0 holds the function being called, or the receiver of a method,
+    // then come the arguments
+    generator.localCount = 0;
+    if (node->as.function.receiver != NULL)
+        declareLocal(node->as.function.receiver);
+    else
+        generator.localCount = 1;
+    for (int i = 0; i < function->arity; i++)
+    {
+        declareLocal(node->as.function.parameters[i]);
+    }
+    generator.depth = 0;
+    generator.maxSlots = generator.localCount;
 
-    while (parser.current.type != TOKEN_EOF)
+    // the frame is discarded on return, so the locals are never popped
+    NodeList *statements = &node->as.function.body->as.block;
+    for (int i = 0; i < statements->count; i++)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
-            return;
-        switch (parser.current.type)
-        {
-        case TOKEN_CLASS:
-        case TOKEN_FUN:
-        case TOKEN_VAR:
-        case TOKEN_FOR:
-        case TOKEN_IF:
-        case TOKEN_WHILE:
-        case TOKEN_PRINT:
-        case TOKEN_RETURN:
-            return;
-        default:;
-        }
+        statement(statements->nodes[i]);
+    }
+    emitBytes(OP_NIL, OP_RETURN);
+    // a class and the method closure being added to it are pushed outside
+    // of any expression
+    function->maxSlots = generator.maxSlots + 2;
+
+#ifdef DEBUG_PRINT_CODE
+    if (!generator.hadError)
+    {
+        disassembleChunk(currentChunk(), function->name->chars);
+    }
+#endif
+
+    compilingChunk = enclosingChunk;
+    generator.localCount = enclosingLocalCount;
+    generator.depth = enclosingDepth;
+    generator.maxSlots = enclosingMaxSlots;
+    generator.captures = captures.enclosing;
+    generator.line = node->line;
 
-        advance();
+    // a function that captures nothing needs no closure
+    function->captureCount = captures.count;
+    if (captures.count == 0)
+    {
+        constant(OBJ_VAL(function));
+        return;
+    }
+    writeConst(currentChunk(), addConstant(currentChunk(), OBJ_VAL(function)), node->line,
+               OP_CLOSURE, OP_CLOSURE_LONG, MAX_LONG_CONSTANT, 3,
+               "The max number of constants should not over 16777215.");
+    for (int i = 0; i < captures.count; i++)
+    {
+        emitByte(captures.captures[i].flags);
+        emitBytes(captures.captures[i].index >> 8, captures.captures[i].index & 0xff);
     }
 }
 
-static void printStatement()
+static void emitExpression(Node *node)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value in print statement.");
-    emitByte(OP_PRINT);
+    generator.line = node->line;
+    switch (node->type)
+    {
+    case NODE_CONSTANT:
+        constant(node->as.constant);
+        return;
+    case NODE_UNARY:
+        unary(node);
+        return;
+    case NODE_BINARY:
+        binary(node);
+        return;
+    case NODE_LOGICAL:
+        logical(node);
+        return;
+    case NODE_GET_GLOBAL:
+        globalAccess(node, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG);
+        return;
+    case NODE_SET_GLOBAL:
+        expression(node->as.global.value);
+        globalAccess(node, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG);
+        return;
+    case NODE_GET_LOCAL:
+        localAccess(node, false);
+        return;
+    case NODE_SET_LOCAL:
+        expression(node->as.local.value);
+        localAccess(node, true);
+        return;
+    case NODE_CALL:
+        call(node, false);
+        return;
+    case NODE_RESUME:
+        expression(node->as.expression);
+        generator.line = node->line;
+        emitByte(OP_RESUME);
+        return;
+    case NODE_GET_PROPERTY:
+    case NODE_SET_PROPERTY:
+        property(node);
+        return;
+    case NODE_LIST:
+    case NODE_MAP:
+        collection(node);
+        return;
+    case NODE_GET_INDEX:
+    case NODE_SET_INDEX:
+        subscript(node);
+        return;
+    case NODE_FUNCTION:
+        function(node, NULL);
+        return;
+    case NODE_CLASS:
+        klass(node);
+        return;
+    default:
+        PANIC("Unreachable code");
+    }
 }
 
-static void expressionStatement()
+static void block(Node *node)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value in expression statement.");
-    emitByte(OP_POP);
+    int localCount = generator.localCount;
+    for (int i = 0; i < node->as.block.count; i++)
+    {
+        statement(node->as.block.nodes[i]);
+    }
+
+    // every declaration in the block took one slot, a boxed one is moved
+    // into its upvalue as it goes out of scope
+    for (int i = node->as.block.count - 1; i >= 0; i--)
+    {
+        Node *statement = node->as.block.nodes[i];
+        if (statement->type != NODE_VAR)
+            continue;
+        emitByte(statement->as.local.variable->boxed ? OP_CLOSE_UPVALUE : OP_POP);
+        generator.localCount--;
+    }
+    ASSERT(generator.localCount == localCount, "Block left locals on the stack.");
 }
 
-static void ifStatement()
+static void ifStatement(Node *node)
 {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+    expression(node->as.branch.condition);
 
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
-    statement();
+    statement(node->as.branch.thenBranch);
 
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
     emitByte(OP_POP);
 
-    if (match(TOKEN_ELSE))
-        statement();
+    if (node->as.branch.elseBranch != NULL)
+        statement(node->as.branch.elseBranch);
     patchJump(elseJump);
 }
 
-static void whileStatement()
+static void whileStatement(Node *node)
 {
     int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int exitJump = -1;
+    if (node->as.loop.condition != NULL)
+    {
+        expression(node->as.loop.condition);
+        exitJump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+    }
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    statement(node->as.loop.body);
     emitLoop(loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
-}
-
-static void varDeclaration()
-{
-    int global = parseVariable("Expect variable name.");
-
-    if (match(TOKEN_EQUAL))
+    if (exitJump != -1)
     {
-        expression();
+        patchJump(exitJump);
+        emitByte(OP_POP);
     }
-    else
+
+    int loopEnd = currentChunk()->count;
+    NodeList *writeBack = &node->as.loop.writeBack;
+    for (int i = 0; i < writeBack->count; i++)
     {
-        emitByte(OP_NIL);
+        Node *store = writeBack->nodes[i];
+        int global = identifierConstant(store->as.global.name);
+        int slot = store->as.global.value->as.local.variable->slot;
+        addPromotedGlobal(currentChunk(), loopStart, loopEnd, slot, global);
+
+        expression(store->as.global.value);
+        writeSetGlobal(currentChunk(), global, store->line);
+        emitByte(OP_POP);
     }
+}
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after var declaration.");
-    defineVariable(global);
+// An expression leaves one value on the stack, on top of those its parent's
+// earlier operands left; counting them gives the stack a call needs.
+static void expression(Node *node)
+{
+    int depth = generator.depth;
+    emitExpression(node);
+    generator.depth = depth + 1;
+    if (generator.localCount + generator.depth > generator.maxSlots)
+        generator.maxSlots = generator.localCount + generator.depth;
 }
 
-static void forStatement()
+static void statement(Node *node)
 {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON))
+    generator.line = node->line;
+    generator.depth = 0;
+    switch (node->type)
     {
-        // No initializer
-    }
-    else if (match(TOKEN_VAR))
+    case NODE_PRINT:
+        expression(node->as.expression);
+        generator.line = node->line;
+        emitByte(OP_PRINT);
+        return;
+    case NODE_EXPRESSION:
+        expression(node->as.expression);
+        emitByte(OP_POP);
+        return;
+    case NODE_DEFINE_GLOBAL:
+        expression(node->as.global.value);
+        writeGlobal(currentChunk(), identifierConstant(node->as.global.name), node->line);
+        return;
+    case NODE_VAR:
     {
-        varDeclaration();
+        Variable *variable = node->as.local.variable;
+        Node *value = node->as.local.value;
+        if (value->type == NODE_FUNCTION || value->type == NODE_CLASS)
+        {
+            // the slot is known before the closure is, so a function can
+            // capture itself, and methods the class they belong to
+            int slot = generator.localCount;
+            declareLocal(variable);
+            generator.localCount = slot;
+            if (value->type == NODE_FUNCTION)
+                function(value, variable);
+            else
+                klass(value);
+            generator.localCount++;
+            return;
+        }
+        expression(node->as.local.value);
+        declareLocal(variable);
+        return;
     }
-    else
-    {
-        expressionStatement();
+    case NODE_BLOCK:
+        block(node);
+        return;
+    case NODE_IF:
+        ifStatement(node);
+        return;
+    case NODE_WHILE:
+        whileStatement(node);
+        return;
+    case NODE_RETURN:
+        if (node->as.expression != NULL && node->as.expression->type == NODE_CALL &&
+            !node->as.expression->as.call.coroutine)
+            call(node->as.expression, true);
+        else if (node->as.expression != NULL)
+            expression(node->as.expression);
+        else
+            emitByte(OP_NIL);
+        generator.line = node->line;
+        emitByte(OP_RETURN);
+        return;
+    case NODE_YIELD:
+        if (node->as.expression != NULL)
+            expression(node->as.expression);
+        else
+            emitByte(OP_NIL);
+        generator.line = node->line;
+        emitByte(OP_YIELD);
+        return;
+    default:
+        PANIC("Unreachable code");
     }
+}
 
-    int loopStart = currentChunk()->count;
-    int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON))
-    {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+// Register backend. It compiles the same tree for the register machine:
+// locals live in fixed registers and temporaries are allocated above them
+// like a stack. An expression is compiled into an ExprDesc that says where
+// its value is, so operands that already sit in a register or in the
+// constant table are used in place.
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
-    }
+typedef enum
+{
+    EXPR_CONSTANT, // index into the constant table
+    EXPR_LOCAL,    // register of a local variable
+    EXPR_TEMP,     // temporary register on top of the register stack
+    EXPR_RELOC,    // offset of an instruction whose destination is not set yet
+} ExprKind;
 
-    if (!match(TOKEN_RIGHT_PAREN))
-    {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after clauses.");
+typedef struct
+{
+    ExprKind kind;
+    int index;
+} ExprDesc;
 
-        emitLoop(loopStart);
-        loopStart = incrementStart;
-        patchJump(bodyJump);
-    }
+typedef struct
+{
+    int freeRegister;
+} RegisterState;
 
-    statement();
-    emitLoop(loopStart);
+_Thread_local RegisterState registers;
 
-    if (exitJump != -1)
-    {
-        patchJump(exitJump);
-        emitByte(OP_POP);
-    }
+static void rExpression(Node *node, ExprDesc *e);
+static void rStatement(Node *node);
 
-    endScope();
+static int emitInstruction(uint8_t instruction, int a, int b, int c)
+{
+    emitByte(instruction);
+    emitByte(a);
+    emitByte(b);
+    emitByte(c);
+    return currentChunk()->count - 4;
 }
 
-static void declaration()
+static bool sameConstant(Value a, Value b)
 {
-    if (match(TOKEN_VAR))
-    {
-        varDeclaration();
-    }
-    else
+    if (a.type != b.type)
+        return false;
+    // 0 and -0 compare equal but print differently
+    if (IS_DOUBLE(a))
+        return memcmp(&AS_DOUBLE(a), &AS_DOUBLE(b), sizeof(double)) == 0;
+    return IS_NIL(a) || valuesEqual(a, b);
+}
+
+// constants are shared so that more of them fit in an RK operand
+static int registerConstant(Value value)
+{
+    ValueArray *constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count; i++)
     {
-        statement();
+        if (sameConstant(constants->value[i], value))
+            return i;
     }
+    int constant = addConstant(currentChunk(), value);
+    if (constant > UINT16_MAX)
+        generatorError("Too many constants for the register backend.");
+    return constant;
+}
 
-    if (parser.panicMode)
-        synchronize();
+static int allocRegister()
+{
+    if (registers.freeRegister >= REGISTER_MAX)
+        generatorError("Expression needs too many registers.");
+    return registers.freeRegister++;
 }
 
-static void statement()
+static void freeExpr(ExprDesc *e)
 {
-    if (match(TOKEN_PRINT))
-    {
-        printStatement();
-    }
-    else if (match(TOKEN_LEFT_BRACE))
-    {
-        beginScope();
-        block();
-        endScope();
-    }
-    else if (match(TOKEN_IF))
-    {
-        ifStatement();
-    }
-    else if (match(TOKEN_WHILE))
+    if (e->kind != EXPR_TEMP)
+        return;
+    ASSERT(e->index == registers.freeRegister - 1, "temporary registers must be freed in order");
+    registers.freeRegister--;
+}
+
+static void dischargeTo(ExprDesc *e, int reg)
+{
+    switch (e->kind)
     {
-        whileStatement();
+    case EXPR_CONSTANT:
+        emitInstruction(OP_R_LOADK, reg, e->index >> 8, e->index & 0xff);
+        break;
+    case EXPR_RELOC:
+        currentChunk()->code[e->index + 1] = reg;
+        break;
+    case EXPR_LOCAL:
+    case EXPR_TEMP:
+        if (e->index != reg)
+            emitInstruction(OP_R_MOVE, reg, e->index, 0);
+        break;
     }
-    else if (match(TOKEN_FOR))
+}
+
+static void exprToRegister(ExprDesc *e, int reg)
+{
+    dischargeTo(e, reg);
+    if (e->index != reg)
+        freeExpr(e);
+}
+
+static void exprToNextRegister(ExprDesc *e)
+{
+    freeExpr(e);
+    int reg = allocRegister();
+    dischargeTo(e, reg);
+    e->kind = EXPR_TEMP;
+    e->index = reg;
+}
+
+static void exprToAnyRegister(ExprDesc *e)
+{
+    if (e->kind == EXPR_LOCAL || e->kind == EXPR_TEMP)
+        return;
+    exprToNextRegister(e);
+}
+
+// the RK operand encoding an expression
+static int exprToOperand(ExprDesc *e)
+{
+    if (e->kind == EXPR_CONSTANT && e->index < RK_CONSTANT)
+        return RK_CONSTANT | e->index;
+    exprToAnyRegister(e);
+    return e->index;
+}
+
+static void relocatable(ExprDesc *e, int instruction)
+{
+    e->kind = EXPR_RELOC;
+    e->index = instruction;
+}
+
+static bool assignsRegister(Node *node, int reg)
+{
+    switch (node->type)
     {
-        forStatement();
+    case NODE_SET_LOCAL:
+        return node->as.local.variable->slot == reg || assignsRegister(node->as.local.value, reg);
+    case NODE_SET_GLOBAL:
+        return assignsRegister(node->as.global.value, reg);
+    case NODE_UNARY:
+        return assignsRegister(node->as.unary.operand, reg);
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        return assignsRegister(node->as.binary.left, reg) ||
+               assignsRegister(node->as.binary.right, reg);
+    default:
+        return false;
     }
-    else
+}
+
+static int emitRegisterJump(uint8_t instruction, int reg)
+{
+    return emitInstruction(instruction, reg, 0xff, 0xff);
+}
+
+static void patchRegisterJump(int instruction)
+{
+    int jump = currentChunk()->count - instruction - 4;
+    if (jump > UINT16_MAX)
+        generatorError("Too much code to jump");
+
+    currentChunk()->code[instruction + 2] = (jump >> 8) & 0xff;
+    currentChunk()->code[instruction + 3] = jump & 0xff;
+}
+
+static void emitRegisterLoop(int loopStart)
+{
+    int offset = currentChunk()->count + 4 - loopStart;
+    if (offset > UINT16_MAX)
+        generatorError("Loop body too large.");
+
+    emitInstruction(OP_R_JUMP_BACK, 0, (offset >> 8) & 0xff, offset & 0xff);
+}
+
+static void rUnary(Node *node, ExprDesc *e)
+{
+    rExpression(node->as.unary.operand, e);
+    int operand = exprToOperand(e);
+    freeExpr(e);
+    generator.line = node->line;
+
+    switch (node->as.unary.op)
     {
-        expressionStatement();
+    case TOKEN_MINUS:
+        relocatable(e, emitInstruction(OP_R_NEGATE, 0, operand, 0));
+        return;
+    case TOKEN_BANG:
+        relocatable(e, emitInstruction(OP_R_NOT, 0, operand, 0));
+        return;
+    case TOKEN_TILDE:
+        relocatable(e, emitInstruction(OP_R_BIT_NOT, 0, operand, 0));
+        return;
+    default:
+        PANIC("Unreachable code");
+        return;
     }
 }
 
-static void binary(bool canAssign)
+// instructions like `>=` that are a comparison followed by OP_R_NOT
+static void emitNegatedComparison(ExprDesc *e, uint8_t instruction, int b, int c)
 {
-    TokenType type = parser.previous.type;
-    ParseRule *rule = getRule(type);
-    parsePrecedence((Precedence)((int)rule->precedence + 1));
+    int reg = allocRegister();
+    emitInstruction(instruction, reg, b, c);
+    registers.freeRegister--;
+    relocatable(e, emitInstruction(OP_R_NOT, 0, reg, 0));
+}
 
-    switch (type)
+static void rBinary(Node *node, ExprDesc *e)
+{
+    rExpression(node->as.binary.left, e);
+
+    // the left operand has to stay where it is while the right one is
+    // compiled. A local is only read when the operator runs, so if the right
+    // operand assigns it, its old value is copied first.
+    if (e->kind == EXPR_RELOC || (e->kind == EXPR_CONSTANT && e->index >= RK_CONSTANT))
+        exprToAnyRegister(e);
+    else if (e->kind == EXPR_LOCAL && assignsRegister(node->as.binary.right, e->index))
+        exprToNextRegister(e);
+
+    ExprDesc right;
+    rExpression(node->as.binary.right, &right);
+    int c = exprToOperand(&right);
+    int b = exprToOperand(e);
+    freeExpr(&right);
+    freeExpr(e);
+    generator.line = node->line;
+
+    switch (node->as.binary.op)
     {
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        relocatable(e, emitInstruction(OP_R_ADD, 0, b, c));
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBSTRACT);
+        relocatable(e, emitInstruction(OP_R_SUBSTRACT, 0, b, c));
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        relocatable(e, emitInstruction(OP_R_MULTIPLY, 0, b, c));
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        relocatable(e, emitInstruction(OP_R_DIVIDE, 0, b, c));
+        break;
+    case TOKEN_PERCENT:
+        relocatable(e, emitInstruction(OP_R_MODULO, 0, b, c));
+        break;
+    case TOKEN_AMPERSAND:
+        relocatable(e, emitInstruction(OP_R_BIT_AND, 0, b, c));
+        break;
+    case TOKEN_PIPE:
+        relocatable(e, emitInstruction(OP_R_BIT_OR, 0, b, c));
+        break;
+    case TOKEN_CARET:
+        relocatable(e, emitInstruction(OP_R_BIT_XOR, 0, b, c));
+        break;
+    case TOKEN_LESS_LESS:
+        relocatable(e, emitInstruction(OP_R_SHIFT_LEFT, 0, b, c));
+        break;
+    case TOKEN_GREATER_GREATER:
+        relocatable(e, emitInstruction(OP_R_SHIFT_RIGHT, 0, b, c));
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        relocatable(e, emitInstruction(OP_R_EQUAL, 0, b, c));
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        relocatable(e, emitInstruction(OP_R_GREATER, 0, b, c));
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        relocatable(e, emitInstruction(OP_R_LESS, 0, b, c));
         break;
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitNegatedComparison(e, OP_R_EQUAL, b, c);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitNegatedComparison(e, OP_R_LESS, b, c);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitNegatedComparison(e, OP_R_GREATER, b, c);
         break;
     default:
         PANIC("Unreachable code");
@@ -658,129 +1044,303 @@ static void binary(bool canAssign)
     }
 }
 
-static void grouping(bool canAssign)
+static void rLogical(Node *node, ExprDesc *e)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
-}
+    rExpression(node->as.binary.left, e);
+    exprToNextRegister(e);
+    generator.line = node->line;
 
-static void unary(bool canAssign)
-{
-    TokenType operatorType = parser.previous.type;
+    ExprDesc right;
+    if (node->as.binary.op == TOKEN_AND)
+    {
+        int endJump = emitRegisterJump(OP_R_JUMP_IF_FALSE, e->index);
 
-    parsePrecedence(PREC_UNARY);
+        rExpression(node->as.binary.right, &right);
+        exprToRegister(&right, e->index);
 
-    switch (operatorType)
+        patchRegisterJump(endJump);
+    }
+    else
     {
-    case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
-        return;
-    case TOKEN_BANG:
-        emitByte(OP_NOT);
-        return;
-    default:
-        PANIC("Unreachable code");
-        return;
+        int elseJump = emitRegisterJump(OP_R_JUMP_IF_FALSE, e->index);
+        int endJump = emitRegisterJump(OP_R_JUMP, 0);
+
+        patchRegisterJump(elseJump);
+        rExpression(node->as.binary.right, &right);
+        exprToRegister(&right, e->index);
+
+        patchRegisterJump(endJump);
     }
 }
 
-static void number(bool canAssign)
+static int registerIdentifier(ObjString *name)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    return registerConstant(OBJ_VAL(name));
 }
 
-static void literal(bool canAssign)
+static void rExpression(Node *node, ExprDesc *e)
 {
-    switch (parser.previous.type)
+    generator.line = node->line;
+    switch (node->type)
     {
-    case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+    case NODE_CONSTANT:
+        e->kind = EXPR_CONSTANT;
+        e->index = registerConstant(node->as.constant);
         return;
-    case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+    case NODE_UNARY:
+        rUnary(node, e);
         return;
-    case TOKEN_NIL:
-        emitByte(OP_NIL);
+    case NODE_BINARY:
+        rBinary(node, e);
+        return;
+    case NODE_LOGICAL:
+        rLogical(node, e);
+        return;
+    case NODE_GET_GLOBAL:
+    {
+        int global = registerIdentifier(node->as.global.name);
+        relocatable(e, emitInstruction(OP_R_GET_GLOBAL, 0, global >> 8, global & 0xff));
+        return;
+    }
+    case NODE_SET_GLOBAL:
+    {
+        rExpression(node->as.global.value, e);
+        int global = registerIdentifier(node->as.global.name);
+        exprToAnyRegister(e);
+        generator.line = node->line;
+        emitInstruction(OP_R_SET_GLOBAL, e->index, global >> 8, global & 0xff);
+        return;
+    }
+    case NODE_GET_LOCAL:
+        e->kind = EXPR_LOCAL;
+        e->index = node->as.local.variable->slot;
+        return;
+    case NODE_SET_LOCAL:
+    {
+        ExprDesc value;
+        rExpression(node->as.local.value, &value);
+        generator.line = node->line;
+        exprToRegister(&value, node->as.local.variable->slot);
+        e->kind = EXPR_LOCAL;
+        e->index = node->as.local.variable->slot;
+        return;
+    }
+    case NODE_CALL:
+    case NODE_RESUME:
+    case NODE_FUNCTION:
+        generatorError("Functions are not supported by the register backend.");
+        e->kind = EXPR_CONSTANT;
+        e->index = registerConstant(NIL_VAL);
+        return;
+    case NODE_GET_PROPERTY:
+    case NODE_SET_PROPERTY:
+    case NODE_CLASS:
+        generatorError("Classes are not supported by the register backend.");
+        e->kind = EXPR_CONSTANT;
+        e->index = registerConstant(NIL_VAL);
+        return;
+    case NODE_LIST:
+    case NODE_MAP:
+    case NODE_GET_INDEX:
+    case NODE_SET_INDEX:
+        generatorError("Lists and maps are not supported by the register backend.");
+        e->kind = EXPR_CONSTANT;
+        e->index = registerConstant(NIL_VAL);
         return;
     default:
         PANIC("Unreachable code");
-        return;
     }
 }
 
-static void string(bool canAssign)
+static void rBlock(Node *node)
+{
+    int localCount = generator.localCount;
+    for (int i = 0; i < node->as.block.count; i++)
+    {
+        rStatement(node->as.block.nodes[i]);
+    }
+
+    generator.localCount = localCount;
+    registers.freeRegister = localCount;
+}
+
+// compile a condition and jump over what follows when it is false
+static int rCondition(Node *node)
 {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    ExprDesc e;
+    rExpression(node, &e);
+    exprToAnyRegister(&e);
+    int jump = emitRegisterJump(OP_R_JUMP_IF_FALSE, e.index);
+    freeExpr(&e);
+    return jump;
 }
 
-static void namedVariable(Token name, bool canAssign)
+static void rIfStatement(Node *node)
 {
-    uint8_t setOp, getOp, setOp_long, getOp_long;
-    int long_range;
-    char *overflowMessage;
-    int arg = resolveLocal(current, &name);
-    if (arg == -1)
+    int thenJump = rCondition(node->as.branch.condition);
+
+    rStatement(node->as.branch.thenBranch);
+
+    if (node->as.branch.elseBranch != NULL)
     {
-        arg = identifierConstant(&name);
-        setOp = OP_SET_GLOBAL;
-        setOp_long = OP_SET_GLOBAL_LONG;
-        getOp = OP_GET_GLOBAL;
-        getOp_long = OP_GET_GLOBAL_LONG;
-        long_range = MAX_LONG_CONSTANT;
-        overflowMessage = "The max number of globals should not over 16777215.";
+        int elseJump = emitRegisterJump(OP_R_JUMP, 0);
+        patchRegisterJump(thenJump);
+        rStatement(node->as.branch.elseBranch);
+        patchRegisterJump(elseJump);
     }
     else
     {
-        setOp = OP_SET_LOCAL;
-        setOp_long = OP_SET_LOCAL_LONG;
-        getOp = OP_GET_LOCAL;
-        getOp_long = OP_GET_LOCAL_LONG;
-        long_range = MAX_LOCAL;
-        overflowMessage = "Unreachable code.";
+        patchRegisterJump(thenJump);
     }
-    if (canAssign && match(TOKEN_EQUAL))
-    {
-        expression();
-        writeConst(currentChunk(), arg, name.line, setOp, setOp_long, long_range, 3,
-                   overflowMessage);
-    }
-    else
+}
+
+static void rWhileStatement(Node *node)
+{
+    int loopStart = currentChunk()->count;
+    int exitJump = -1;
+    if (node->as.loop.condition != NULL)
+        exitJump = rCondition(node->as.loop.condition);
+
+    rStatement(node->as.loop.body);
+    emitRegisterLoop(loopStart);
+
+    if (exitJump != -1)
+        patchRegisterJump(exitJump);
+
+    int loopEnd = currentChunk()->count;
+    NodeList *writeBack = &node->as.loop.writeBack;
+    for (int i = 0; i < writeBack->count; i++)
     {
-        writeConst(currentChunk(), arg, name.line, getOp, getOp_long, long_range, 3,
-                   overflowMessage);
+        Node *store = writeBack->nodes[i];
+        int global = registerIdentifier(store->as.global.name);
+        int slot = store->as.global.value->as.local.variable->slot;
+        addPromotedGlobal(currentChunk(), loopStart, loopEnd, slot, global);
+
+        generator.line = store->line;
+        emitInstruction(OP_R_SET_GLOBAL, slot, global >> 8, global & 0xff);
     }
 }
 
-static void variable(bool canAssign)
+static void rVarDeclaration(Node *node)
 {
-    namedVariable(parser.previous, canAssign);
+    Variable *variable = node->as.local.variable;
+    variable->slot = generator.localCount++;
+    if (generator.localCount > REGISTER_MAX)
+        generatorError("Too many local variables for the register backend.");
+    registers.freeRegister = generator.localCount;
+
+    ExprDesc value;
+    rExpression(node->as.local.value, &value);
+    exprToRegister(&value, variable->slot);
 }
 
-bool compile(const char *source, Chunk *chunk)
+static void rStatement(Node *node)
 {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler);
+    generator.line = node->line;
+    ExprDesc e;
+    switch (node->type)
+    {
+    case NODE_PRINT:
+        rExpression(node->as.expression, &e);
+        exprToAnyRegister(&e);
+        emitInstruction(OP_R_PRINT, e.index, 0, 0);
+        freeExpr(&e);
+        return;
+    case NODE_EXPRESSION:
+        rExpression(node->as.expression, &e);
+        if (e.kind == EXPR_RELOC)
+            exprToAnyRegister(&e);
+        freeExpr(&e);
+        return;
+    case NODE_DEFINE_GLOBAL:
+    {
+        rExpression(node->as.global.value, &e);
+        int global = registerIdentifier(node->as.global.name);
+        exprToAnyRegister(&e);
+        emitInstruction(OP_R_DEFINE_GLOBAL, e.index, global >> 8, global & 0xff);
+        freeExpr(&e);
+        return;
+    }
+    case NODE_VAR:
+        rVarDeclaration(node);
+        return;
+    case NODE_BLOCK:
+        rBlock(node);
+        return;
+    case NODE_IF:
+        rIfStatement(node);
+        return;
+    case NODE_WHILE:
+        rWhileStatement(node);
+        return;
+    default:
+        PANIC("Unreachable code");
+    }
+}
 
-    compilingChunk = chunk;
-    parser.hadError = false;
-    parser.panicMode = false;
+ObjFunction *compile(const char *source)
+{
+    Ast ast;
+    if (!buildAst(source, &ast))
+    {
+        freeAst();
+        return NULL;
+    }
 
-    advance();
+    double start = now();
+    ObjFunction *script = newFunction();
+    CaptureList captures;
+    initGenerator(script, &captures);
+    NodeList *statements = &ast.root->as.block;
+    for (int i = 0; i < statements->count; i++)
+    {
+        statement(statements->nodes[i]);
+    }
+    emitBytes(OP_NIL, OP_RETURN);
+    freeAst();
+    compileTimes.generate = now() - start;
 
-    while (!match(TOKEN_EOF))
+#ifdef DEBUG_PRINT_CODE
+    if (!generator.hadError)
     {
-        declaration();
+        disassembleChunk(currentChunk(), "code");
     }
+#endif
 
-    endCompiler();
+    return generator.hadError ? NULL : script;
+}
+
+ObjFunction *compileRegisters(const char *source)
+{
+    Ast ast;
+    if (!buildAst(source, &ast))
+    {
+        freeAst();
+        return NULL;
+    }
+
+    double start = now();
+    ObjFunction *script = newFunction();
+    CaptureList captures;
+    initGenerator(script, &captures);
+    registers.freeRegister = generator.localCount;
+    NodeList *statements = &ast.root->as.block;
+    for (int i = 0; i < statements->count; i++)
+    {
+        rStatement(statements->nodes[i]);
+    }
+    emitInstruction(OP_R_RETURN, 0, 0, 0);
+    freeAst();
+    compileTimes.generate = now() - start;
+
+#ifdef DEBUG_PRINT_CODE
+    if (!generator.hadError)
+    {
+        disassembleRegisterChunk(currentChunk(), "code");
+    }
+#endif
 
-    return !parser.hadError;
+    return generator.hadError ? NULL : script;
 }
 #undef emitByte
-#undef emitReturn
 #undef emitBytes
-#undef emitConstant
-#undef expression
-#undef getRule
\ No newline at end of file
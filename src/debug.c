@@ -1,6 +1,111 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "object.h"
+#include "output.h"
+
+// printValue() writes into the VM's output, which has to go out before the
+// rest of the line is printed through stdio
+static void printConstant(Value value)
+{
+    printValue(value);
+    flushOutput();
+}
+
+static const char *opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NIL] = "OP_NIL",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBSTRACT] = "OP_SUBSTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_MODULO] = "OP_MODULO",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_NOT] = "OP_NOT",
+    [OP_BIT_AND] = "OP_BIT_AND",
+    [OP_BIT_OR] = "OP_BIT_OR",
+    [OP_BIT_XOR] = "OP_BIT_XOR",
+    [OP_SHIFT_LEFT] = "OP_SHIFT_LEFT",
+    [OP_SHIFT_RIGHT] = "OP_SHIFT_RIGHT",
+    [OP_BIT_NOT] = "OP_BIT_NOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_BACK] = "OP_JUMP_BACK",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_COROUTINE] = "OP_COROUTINE",
+    [OP_RESUME] = "OP_RESUME",
+    [OP_YIELD] = "OP_YIELD",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_CLASS_LONG] = "OP_CLASS_LONG",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_METHOD_LONG] = "OP_METHOD_LONG",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_TAIL_INVOKE] = "OP_TAIL_INVOKE",
+    [OP_LIST] = "OP_LIST",
+    [OP_MAP] = "OP_MAP",
+    [OP_INDEX_GET] = "OP_INDEX_GET",
+    [OP_INDEX_SET] = "OP_INDEX_SET",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_CAPTURED] = "OP_GET_CAPTURED",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_SUBSTRACT_NUM] = "OP_SUBSTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_MODULO_NUM] = "OP_MODULO_NUM",
+    [OP_NEGATE_NUM] = "OP_NEGATE_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_ADD_NUM_QUICK] = "OP_ADD_NUM_QUICK",
+    [OP_ADD_INT_QUICK] = "OP_ADD_INT_QUICK",
+    [OP_ADD_STRING_QUICK] = "OP_ADD_STRING_QUICK",
+    [OP_SUBSTRACT_NUM_QUICK] = "OP_SUBSTRACT_NUM_QUICK",
+    [OP_SUBSTRACT_INT_QUICK] = "OP_SUBSTRACT_INT_QUICK",
+    [OP_MULTIPLY_NUM_QUICK] = "OP_MULTIPLY_NUM_QUICK",
+    [OP_MULTIPLY_INT_QUICK] = "OP_MULTIPLY_INT_QUICK",
+    [OP_DIVIDE_NUM_QUICK] = "OP_DIVIDE_NUM_QUICK",
+    [OP_DIVIDE_INT_QUICK] = "OP_DIVIDE_INT_QUICK",
+    [OP_MODULO_NUM_QUICK] = "OP_MODULO_NUM_QUICK",
+    [OP_MODULO_INT_QUICK] = "OP_MODULO_INT_QUICK",
+    [OP_LESS_NUM_QUICK] = "OP_LESS_NUM_QUICK",
+    [OP_LESS_INT_QUICK] = "OP_LESS_INT_QUICK",
+    [OP_GREATER_NUM_QUICK] = "OP_GREATER_NUM_QUICK",
+    [OP_GREATER_INT_QUICK] = "OP_GREATER_INT_QUICK",
+    [OP_GET_GLOBAL_QUICK] = "OP_GET_GLOBAL_QUICK",
+    [OP_SET_GLOBAL_QUICK] = "OP_SET_GLOBAL_QUICK",
+};
+
+const char *opcodeName(uint8_t instruction)
+{
+    if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[instruction] == NULL)
+        return "unknown";
+    return opcodeNames[instruction];
+}
 
 void disassembleChunk(Chunk *chunk, const char *name)
 {
@@ -34,11 +139,64 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset, const
         PANIC("wrong constant instruction length");
     }
     printf("%-21s %d '", name, constant);
-    printValue(chunk->constants.value[constant]);
+    printConstant(chunk->constants.value[constant]);
     printf("'\n");
     return offset + (int)len;
 }
 
+static int byteInstruction(const char *name, Chunk *chunk, int offset)
+{
+    printf("%-21s %d\n", name, chunk->code[offset + 1]);
+    return offset + 2;
+}
+
+static int shortInstruction(const char *name, Chunk *chunk, int offset)
+{
+    printf("%-21s %d\n", name, (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static int longInstruction(const char *name, Chunk *chunk, int offset)
+{
+    int operand = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) |
+                  (chunk->code[offset + 3] << 16);
+    printf("%-21s %d\n", name, operand);
+    return offset + 4;
+}
+
+static int closureInstruction(const char *name, Chunk *chunk, int offset, const uint8_t len)
+{
+    int constant = len == 2 ? chunk->code[offset + 1]
+                            : *((uint32_t *)&chunk->code[offset]) >> 8;
+    offset = constantInstruction(name, chunk, offset, len);
+
+    ObjFunction *function = AS_FUNCTION(chunk->constants.value[constant]);
+    for (int i = 0; i < function->captureCount; i++)
+    {
+        uint8_t flags = chunk->code[offset];
+        int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        printf("%04d      |                     %s %s %d\n", offset,
+               flags & CAPTURE_BOXED ? "boxed" : "value",
+               flags & CAPTURE_LOCAL ? "local" : "capture", index);
+        offset += 3;
+    }
+    return offset;
+}
+
+static int propertyInstruction(const char *name, Chunk *chunk, int offset, bool invoke)
+{
+    int cache = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-21s %d '", name, cache);
+    printConstant(chunk->constants.value[chunk->caches[cache].name]);
+    if (invoke)
+    {
+        printf("' (%d args)\n", chunk->code[offset + 3]);
+        return offset + 4;
+    }
+    printf("'\n");
+    return offset + 3;
+}
+
 static int jumpInstruction(const char *name, Chunk *chunk, int offset, int sign)
 {
     int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
@@ -79,9 +237,59 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_DIVIDE:
         return simpleInstruction("OP_DIVIDE", offset);
 
+    case OP_MODULO:
+        return simpleInstruction("OP_MODULO", offset);
+
     case OP_NEGATE:
         return simpleInstruction("OP_NEGATE", offset);
 
+    case OP_CALL:
+        return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_COROUTINE:
+        return byteInstruction("OP_COROUTINE", chunk, offset);
+    case OP_RESUME:
+        return simpleInstruction("OP_RESUME", offset);
+    case OP_YIELD:
+        return simpleInstruction("OP_YIELD", offset);
+    case OP_CLASS:
+        return constantInstruction("OP_CLASS", chunk, offset, 2);
+    case OP_CLASS_LONG:
+        return constantInstruction("OP_CLASS_LONG", chunk, offset, 4);
+    case OP_METHOD:
+        return constantInstruction("OP_METHOD", chunk, offset, 2);
+    case OP_METHOD_LONG:
+        return constantInstruction("OP_METHOD_LONG", chunk, offset, 4);
+    case OP_GET_PROPERTY:
+        return propertyInstruction("OP_GET_PROPERTY", chunk, offset, false);
+    case OP_SET_PROPERTY:
+        return propertyInstruction("OP_SET_PROPERTY", chunk, offset, false);
+    case OP_INVOKE:
+        return propertyInstruction("OP_INVOKE", chunk, offset, true);
+    case OP_TAIL_INVOKE:
+        return propertyInstruction("OP_TAIL_INVOKE", chunk, offset, true);
+    case OP_LIST:
+        return shortInstruction("OP_LIST", chunk, offset);
+    case OP_MAP:
+        return shortInstruction("OP_MAP", chunk, offset);
+    case OP_INDEX_GET:
+        return simpleInstruction("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:
+        return simpleInstruction("OP_INDEX_SET", offset);
+    case OP_CLOSURE:
+        return closureInstruction("OP_CLOSURE", chunk, offset, 2);
+    case OP_CLOSURE_LONG:
+        return closureInstruction("OP_CLOSURE_LONG", chunk, offset, 4);
+    case OP_GET_UPVALUE:
+        return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+    case OP_SET_UPVALUE:
+        return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_CAPTURED:
+        return byteInstruction("OP_GET_CAPTURED", chunk, offset);
+    case OP_CLOSE_UPVALUE:
+        return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
 
@@ -97,6 +305,24 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_NOT:
         return simpleInstruction("OP_NOT", offset);
 
+    case OP_BIT_AND:
+        return simpleInstruction("OP_BIT_AND", offset);
+
+    case OP_BIT_OR:
+        return simpleInstruction("OP_BIT_OR", offset);
+
+    case OP_BIT_XOR:
+        return simpleInstruction("OP_BIT_XOR", offset);
+
+    case OP_SHIFT_LEFT:
+        return simpleInstruction("OP_SHIFT_LEFT", offset);
+
+    case OP_SHIFT_RIGHT:
+        return simpleInstruction("OP_SHIFT_RIGHT", offset);
+
+    case OP_BIT_NOT:
+        return simpleInstruction("OP_BIT_NOT", offset);
+
     case OP_EQUAL:
         return simpleInstruction("OP_EQUAL", offset);
 
@@ -131,16 +357,16 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return constantInstruction("OP_SET_GLOBAL_LONG", chunk, offset, 4);
 
     case OP_GET_LOCAL:
-        return constantInstruction("OP_GET_LOCAL", chunk, offset, 2);
+        return byteInstruction("OP_GET_LOCAL", chunk, offset);
 
     case OP_GET_LOCAL_LONG:
-        return constantInstruction("OP_GET_LOCAL_LONG", chunk, offset, 4);
+        return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
 
     case OP_SET_LOCAL:
-        return constantInstruction("OP_SET_LOCAL", chunk, offset, 2);
+        return byteInstruction("OP_SET_LOCAL", chunk, offset);
 
     case OP_SET_LOCAL_LONG:
-        return constantInstruction("OP_SET_LOCAL_LONG", chunk, offset, 4);
+        return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
 
     case OP_JUMP:
         return jumpInstruction("OP_JUMP", chunk, offset, 1);
@@ -151,8 +377,238 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_JUMP_IF_FALSE:
         return jumpInstruction("OP_JUMP_IF_FALSE", chunk, offset, 1);
 
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+
+    case OP_SUBSTRACT_NUM:
+        return simpleInstruction("OP_SUBSTRACT_NUM", offset);
+
+    case OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+
+    case OP_DIVIDE_NUM:
+        return simpleInstruction("OP_DIVIDE_NUM", offset);
+
+    case OP_MODULO_NUM:
+        return simpleInstruction("OP_MODULO_NUM", offset);
+
+    case OP_NEGATE_NUM:
+        return simpleInstruction("OP_NEGATE_NUM", offset);
+
+    case OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+
+    case OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+
+    case OP_ADD_NUM_QUICK:
+        return simpleInstruction("OP_ADD_NUM_QUICK", offset);
+
+    case OP_ADD_INT_QUICK:
+        return simpleInstruction("OP_ADD_INT_QUICK", offset);
+
+    case OP_ADD_STRING_QUICK:
+        return simpleInstruction("OP_ADD_STRING_QUICK", offset);
+
+    case OP_SUBSTRACT_NUM_QUICK:
+        return simpleInstruction("OP_SUBSTRACT_NUM_QUICK", offset);
+
+    case OP_SUBSTRACT_INT_QUICK:
+        return simpleInstruction("OP_SUBSTRACT_INT_QUICK", offset);
+
+    case OP_MULTIPLY_NUM_QUICK:
+        return simpleInstruction("OP_MULTIPLY_NUM_QUICK", offset);
+
+    case OP_MULTIPLY_INT_QUICK:
+        return simpleInstruction("OP_MULTIPLY_INT_QUICK", offset);
+
+    case OP_DIVIDE_NUM_QUICK:
+        return simpleInstruction("OP_DIVIDE_NUM_QUICK", offset);
+
+    case OP_DIVIDE_INT_QUICK:
+        return simpleInstruction("OP_DIVIDE_INT_QUICK", offset);
+
+    case OP_MODULO_NUM_QUICK:
+        return simpleInstruction("OP_MODULO_NUM_QUICK", offset);
+
+    case OP_MODULO_INT_QUICK:
+        return simpleInstruction("OP_MODULO_INT_QUICK", offset);
+
+    case OP_LESS_NUM_QUICK:
+        return simpleInstruction("OP_LESS_NUM_QUICK", offset);
+
+    case OP_LESS_INT_QUICK:
+        return simpleInstruction("OP_LESS_INT_QUICK", offset);
+
+    case OP_GREATER_NUM_QUICK:
+        return simpleInstruction("OP_GREATER_NUM_QUICK", offset);
+
+    case OP_GREATER_INT_QUICK:
+        return simpleInstruction("OP_GREATER_INT_QUICK", offset);
+
+    case OP_GET_GLOBAL_QUICK:
+        return constantInstruction("OP_GET_GLOBAL_QUICK", chunk, offset, 2);
+
+    case OP_SET_GLOBAL_QUICK:
+        return constantInstruction("OP_SET_GLOBAL_QUICK", chunk, offset, 2);
+
     default:
         printf("Unknow code %d\n", instruction);
         return offset + 1;
     }
-}
\ No newline at end of file
+}
+void disassembleRegisterChunk(Chunk *chunk, const char *name)
+{
+    printf("== %s ==\n", name);
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        offset = disassembleRegisterInstruction(chunk, offset);
+    }
+}
+
+static void printOperand(Chunk *chunk, uint8_t operand)
+{
+    if (operand & RK_CONSTANT)
+    {
+        printf("k%d '", operand & ~RK_CONSTANT);
+        printConstant(chunk->constants.value[operand & ~RK_CONSTANT]);
+        printf("'");
+    }
+    else
+    {
+        printf("r%d", operand);
+    }
+}
+
+static int registerABC(const char *name, Chunk *chunk, int offset, int operands)
+{
+    uint8_t *code = &chunk->code[offset];
+    printf("%-21s r%d", name, code[1]);
+    for (int i = 2; i < operands + 2; i++)
+    {
+        printf(", ");
+        printOperand(chunk, code[i]);
+    }
+    printf("\n");
+    return offset + 4;
+}
+
+static int registerABx(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    int constant = (code[2] << 8) | code[3];
+    printf("%-21s r%d, k%d '", name, code[1], constant);
+    printConstant(chunk->constants.value[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int registerJump(const char *name, Chunk *chunk, int offset, int sign)
+{
+    uint8_t *code = &chunk->code[offset];
+    int jump = (code[2] << 8) | code[3];
+    printf("%-21s r%d, %d -> %d\n", name, code[1], offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+int disassembleRegisterInstruction(Chunk *chunk, int offset)
+{
+    printf("%04d ", offset);
+    if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1))
+    {
+        printf("   | ");
+    }
+    else
+    {
+        printf("%4d ", getLine(chunk, offset));
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction)
+    {
+    case OP_R_LOADK:
+        return registerABx("OP_R_LOADK", chunk, offset);
+
+    case OP_R_MOVE:
+        printf("%-21s r%d, r%d\n", "OP_R_MOVE", chunk->code[offset + 1], chunk->code[offset + 2]);
+        return offset + 4;
+
+    case OP_R_DEFINE_GLOBAL:
+        return registerABx("OP_R_DEFINE_GLOBAL", chunk, offset);
+
+    case OP_R_GET_GLOBAL:
+        return registerABx("OP_R_GET_GLOBAL", chunk, offset);
+
+    case OP_R_SET_GLOBAL:
+        return registerABx("OP_R_SET_GLOBAL", chunk, offset);
+
+    case OP_R_ADD:
+        return registerABC("OP_R_ADD", chunk, offset, 2);
+
+    case OP_R_SUBSTRACT:
+        return registerABC("OP_R_SUBSTRACT", chunk, offset, 2);
+
+    case OP_R_MULTIPLY:
+        return registerABC("OP_R_MULTIPLY", chunk, offset, 2);
+
+    case OP_R_DIVIDE:
+        return registerABC("OP_R_DIVIDE", chunk, offset, 2);
+
+    case OP_R_MODULO:
+        return registerABC("OP_R_MODULO", chunk, offset, 2);
+
+    case OP_R_EQUAL:
+        return registerABC("OP_R_EQUAL", chunk, offset, 2);
+
+    case OP_R_LESS:
+        return registerABC("OP_R_LESS", chunk, offset, 2);
+
+    case OP_R_GREATER:
+        return registerABC("OP_R_GREATER", chunk, offset, 2);
+
+    case OP_R_BIT_AND:
+        return registerABC("OP_R_BIT_AND", chunk, offset, 2);
+
+    case OP_R_BIT_OR:
+        return registerABC("OP_R_BIT_OR", chunk, offset, 2);
+
+    case OP_R_BIT_XOR:
+        return registerABC("OP_R_BIT_XOR", chunk, offset, 2);
+
+    case OP_R_SHIFT_LEFT:
+        return registerABC("OP_R_SHIFT_LEFT", chunk, offset, 2);
+
+    case OP_R_SHIFT_RIGHT:
+        return registerABC("OP_R_SHIFT_RIGHT", chunk, offset, 2);
+
+    case OP_R_NEGATE:
+        return registerABC("OP_R_NEGATE", chunk, offset, 1);
+
+    case OP_R_NOT:
+        return registerABC("OP_R_NOT", chunk, offset, 1);
+
+    case OP_R_BIT_NOT:
+        return registerABC("OP_R_BIT_NOT", chunk, offset, 1);
+
+    case OP_R_PRINT:
+        return registerABC("OP_R_PRINT", chunk, offset, 0);
+
+    case OP_R_JUMP:
+        return registerJump("OP_R_JUMP", chunk, offset, 1);
+
+    case OP_R_JUMP_BACK:
+        return registerJump("OP_R_JUMP_BACK", chunk, offset, -1);
+
+    case OP_R_JUMP_IF_FALSE:
+        return registerJump("OP_R_JUMP_IF_FALSE", chunk, offset, 1);
+
+    case OP_R_RETURN:
+        printf("OP_R_RETURN\n");
+        return offset + 4;
+
+    default:
+        printf("Unknow code %d\n", instruction);
+        return offset + 4;
+    }
+}
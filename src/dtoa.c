@@ -0,0 +1,423 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dtoa.h"
+
+// Grisu3, after Florian Loitsch's "Printing Floating-Point Numbers Quickly
+// and Accurately with Integers". The double and the halfway points to its
+// neighbours are scaled by a cached power of ten into a range where 64 bit
+// integer arithmetic gives their leading digits, and digits are generated
+// until they are inside those bounds. The scaling is off by a little, so
+// for about one double in two hundred it can't be sure the digits are the
+// shortest, and those are found with the C library instead.
+
+// f * 2^e, with a 64 bit significand
+typedef struct
+{
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT ((uint64_t)1 << SIGNIFICAND_BITS)
+#define EXPONENT_BIAS (1023 + SIGNIFICAND_BITS)
+
+// 10^k for k = -348, -340, ..., 340, normalized and rounded
+static const uint64_t powerSignificands[] = {
+    0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76,
+    0xcf42894a5dce35ea, 0x9a6bb0aa55653b2d, 0xe61acf033d1a45df,
+    0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f, 0xbe5691ef416bd60c,
+    0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+    0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57,
+    0xc21094364dfb5637, 0x9096ea6f3848984f, 0xd77485cb25823ac7,
+    0xa086cfcd97bf97f4, 0xef340a98172aace5, 0xb23867fb2a35b28e,
+    0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+    0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126,
+    0xb5b5ada8aaff80b8, 0x87625f056c7c4a8b, 0xc9bcff6034c13053,
+    0x964e858c91ba2655, 0xdff9772470297ebd, 0xa6dfbd9fb8e5b88f,
+    0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+    0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06,
+    0xaa242499697392d3, 0xfd87b5f28300ca0e, 0xbce5086492111aeb,
+    0x8cbccc096f5088cc, 0xd1b71758e219652c, 0x9c40000000000000,
+    0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+    0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068,
+    0x9f4f2726179a2245, 0xed63a231d4c4fb27, 0xb0de65388cc8ada8,
+    0x83c7088e1aab65db, 0xc45d1df942711d9a, 0x924d692ca61be758,
+    0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+    0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d,
+    0x952ab45cfa97a0b3, 0xde469fbd99a05fe3, 0xa59bc234db398c25,
+    0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece, 0x88fcf317f22241e2,
+    0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+    0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410,
+    0x8bab8eefb6409c1a, 0xd01fef10a657842c, 0x9b10a4e5e9913129,
+    0xe7109bfba19c0c9d, 0xac2820d9623bf429, 0x80444b5e7aa7cf85,
+    0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+    0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b,
+};
+
+static const int16_t powerExponents[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901,
+    -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502,
+    -475, -449, -422, -396, -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103,
+    -77, -50, -24, 3, 30, 56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402,
+    428, 455, 481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t powersOf10[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static DiyFp multiply(DiyFp x, DiyFp y)
+{
+    unsigned __int128 product = (unsigned __int128)x.f * y.f;
+    uint64_t high = (uint64_t)(product >> 64);
+    // rounded to nearest
+    if ((uint64_t)product & ((uint64_t)1 << 63))
+        high++;
+    return (DiyFp){high, x.e + y.e + 64};
+}
+
+static DiyFp normalize(DiyFp x)
+{
+    int shift = __builtin_clzll(x.f);
+    return (DiyFp){x.f << shift, x.e - shift};
+}
+
+// the points halfway to the neighbouring doubles, with the exponent of the
+// upper one once it is normalized
+static void boundaries(DiyFp v, DiyFp *minus, DiyFp *plus)
+{
+    *plus = normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+    // the double below a power of two is half as far away
+    if (v.f == HIDDEN_BIT)
+        *minus = (DiyFp){(v.f << 2) - 1, v.e - 2};
+    else
+        *minus = (DiyFp){(v.f << 1) - 1, v.e - 1};
+    minus->f <<= minus->e - plus->e;
+    minus->e = plus->e;
+}
+
+// the cached power that scales a number of binary exponent `e` to one of
+// exponent -60 to -32, and its decimal exponent negated in `k`
+static DiyFp cachedPower(int e, int *k)
+{
+    double estimate = (-61 - e) * 0.30102999566398114 + 347;
+    int power = (int)estimate;
+    if (estimate - power > 0.0)
+        power++;
+    int index = (power >> 3) + 1;
+    *k = -(-348 + (index << 3));
+    return (DiyFp){powerSignificands[index], powerExponents[index]};
+}
+
+static int countDigits(uint32_t n)
+{
+    int count = 1;
+    while (n >= 10)
+    {
+        n /= 10;
+        count++;
+    }
+    return count;
+}
+
+// two digits at a time, from the last
+static int formatUnsigned(uint64_t value, char *buffer)
+{
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+    while (value >= 100)
+    {
+        start -= 2;
+        memcpy(start, digitPairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10)
+    {
+        start -= 2;
+        memcpy(start, digitPairs + value * 2, 2);
+    }
+    else
+    {
+        *--start = (char)('0' + value);
+    }
+    memcpy(buffer, start, end - start);
+    return (int)(end - start);
+}
+
+// Move the last digit down while that brings the number closer to the
+// scaled double, `distance` below the upper bound, and keeps it within
+// `unsafe` of it. Each scaled number may be off by up to `unit`, so whether
+// the digits are the closest, and inside the bounds, is only certain
+// when that holds for the distance give or take a unit; false if it isn't.
+static bool roundWeed(char *digits, int length, uint64_t distance, uint64_t unsafe,
+                      uint64_t rest, uint64_t tenKappa, uint64_t unit)
+{
+    uint64_t smallDistance = distance - unit;
+    uint64_t bigDistance = distance + unit;
+    while (rest < smallDistance && unsafe - rest >= tenKappa &&
+           (rest + tenKappa < smallDistance ||
+            smallDistance - rest >= rest + tenKappa - smallDistance))
+    {
+        digits[length - 1]--;
+        rest += tenKappa;
+    }
+    // a step further might be closer, measured from the far end
+    if (rest < bigDistance && unsafe - rest >= tenKappa &&
+        (rest + tenKappa < bigDistance || bigDistance - rest > rest + tenKappa - bigDistance))
+        return false;
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+// The digits of the scaled upper bound, widened by the error of the
+// scaling, down to where they are inside the widened bounds; `k` gains
+// the exponent of the last one. False if they may not be the shortest.
+static bool generateDigits(DiyFp w, DiyFp lower, DiyFp upper, char *digits, int *length,
+                           int *k)
+{
+    uint64_t unit = 1;
+    uint64_t tooHigh = upper.f + unit;
+    uint64_t unsafe = tooHigh - (lower.f - unit);
+    DiyFp one = {(uint64_t)1 << -w.e, w.e};
+    uint32_t integral = (uint32_t)(tooHigh >> -one.e);
+    uint64_t fraction = tooHigh & (one.f - 1);
+    int kappa = countDigits(integral);
+    *length = 0;
+
+    while (kappa > 0)
+    {
+        uint32_t divisor = (uint32_t)powersOf10[kappa - 1];
+        digits[(*length)++] = (char)('0' + integral / divisor);
+        integral %= divisor;
+        kappa--;
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest < unsafe)
+        {
+            *k += kappa;
+            return roundWeed(digits, *length, tooHigh - w.f, unsafe, rest,
+                             powersOf10[kappa] << -one.e, unit);
+        }
+    }
+
+    for (;;)
+    {
+        fraction *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        digits[(*length)++] = (char)('0' + (fraction >> -one.e));
+        fraction &= one.f - 1;
+        kappa--;
+        if (fraction < unsafe)
+        {
+            *k += kappa;
+            return roundWeed(digits, *length, (tooHigh - w.f) * unit, unsafe, fraction, one.f,
+                             unit);
+        }
+    }
+}
+
+// Grisu3: the shortest digits of a positive, finite double, whose value is
+// digits * 10^k, or false for the few doubles where the error of the
+// scaling leaves it uncertain which digits those are
+static bool grisu3(double value, char *digits, int *length, int *k)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (int)(bits >> SIGNIFICAND_BITS);
+    uint64_t significand = bits & (HIDDEN_BIT - 1);
+    DiyFp v = biased != 0 ? (DiyFp){significand + HIDDEN_BIT, biased - EXPONENT_BIAS}
+                          : (DiyFp){significand, 1 - EXPONENT_BIAS};
+
+    DiyFp minus, plus;
+    boundaries(v, &minus, &plus);
+    DiyFp power = cachedPower(plus.e, k);
+    DiyFp w = multiply(normalize(v), power);
+    DiyFp upper = multiply(plus, power);
+    DiyFp lower = multiply(minus, power);
+    return generateDigits(w, lower, upper, digits, length, k);
+}
+
+// drop the trailing zeros of digits * 10^k
+static int trimZeros(char *digits, int length, int *k)
+{
+    while (length > 1 && digits[length - 1] == '0')
+    {
+        length--;
+        (*k)++;
+    }
+    return length;
+}
+
+// The shortest digits that read back as the double, for when Grisu3 can't
+// tell: for each precision in turn, the closest decimal, which the C
+// library rounds exactly, and the one on the other side of the double.
+// Either is the shortest once one of them reads back.
+static int exactDigits(double value, char *digits, int *k)
+{
+    for (int precision = 1;; precision++)
+    {
+        char text[40];
+        snprintf(text, sizeof(text), "%.*e", precision - 1, value);
+        double closest = strtod(text, NULL);
+
+        uint64_t n = (uint64_t)(text[0] - '0');
+        char *c = text + 1;
+        if (*c == '.')
+            c++;
+        while (*c != 'e')
+            n = n * 10 + (uint64_t)(*c++ - '0');
+        int exponent = atoi(c + 1) - (precision - 1);
+
+        if (closest != value)
+        {
+            n = closest < value ? n + 1 : n - 1;
+            snprintf(text, sizeof(text), "%llue%d", (unsigned long long)n, exponent);
+            if (strtod(text, NULL) != value)
+                continue;
+        }
+        *k = exponent;
+        return trimZeros(digits, formatUnsigned(n, digits), k);
+    }
+}
+
+static int writeExponent(int exponent, char *buffer)
+{
+    char *end = buffer;
+    if (exponent < 0)
+    {
+        *end++ = '-';
+        exponent = -exponent;
+    }
+    else
+    {
+        *end++ = '+';
+    }
+    if (exponent >= 100)
+    {
+        *end++ = (char)('0' + exponent / 100);
+        exponent %= 100;
+        memcpy(end, digitPairs + exponent * 2, 2);
+        end += 2;
+    }
+    else if (exponent >= 10)
+    {
+        memcpy(end, digitPairs + exponent * 2, 2);
+        end += 2;
+    }
+    else
+    {
+        *end++ = (char)('0' + exponent);
+    }
+    return (int)(end - buffer);
+}
+
+// lay out the digits of digits * 10^k in place
+static int layOut(char *buffer, int length, int k)
+{
+    // the value is 0.digits * 10^point
+    int point = length + k;
+    if (k >= 0 && point <= 21)
+    {
+        // 1234e7 is 12340000000
+        memset(buffer + length, '0', k);
+        return point;
+    }
+    if (point > 0 && point <= 21)
+    {
+        // 1234e-2 is 12.34
+        memmove(buffer + point + 1, buffer + point, length - point);
+        buffer[point] = '.';
+        return length + 1;
+    }
+    if (point > -6 && point <= 0)
+    {
+        // 1234e-6 is 0.001234
+        int offset = 2 - point;
+        memmove(buffer + offset, buffer, length);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        memset(buffer + 2, '0', -point);
+        return offset + length;
+    }
+    if (length == 1)
+    {
+        // 1e30
+        buffer[1] = 'e';
+        return 2 + writeExponent(point - 1, buffer + 2);
+    }
+    // 1234e30 is 1.234e+33
+    memmove(buffer + 2, buffer + 1, length - 1);
+    buffer[1] = '.';
+    buffer[length + 1] = 'e';
+    return length + 2 + writeExponent(point - 1, buffer + length + 2);
+}
+
+int formatInt(int64_t value, char *buffer)
+{
+    if (value < 0)
+    {
+        buffer[0] = '-';
+        // negated as unsigned, so INT64_MIN doesn't overflow
+        return 1 + formatUnsigned(-(uint64_t)value, buffer + 1);
+    }
+    return formatUnsigned((uint64_t)value, buffer);
+}
+
+int formatDouble(double value, char *buffer)
+{
+    if (isnan(value))
+    {
+        memcpy(buffer, "nan", 3);
+        return 3;
+    }
+
+    char *start = buffer;
+    if (signbit(value))
+    {
+        *start++ = '-';
+        value = -value;
+    }
+    if (isinf(value))
+    {
+        memcpy(start, "inf", 3);
+        return (int)(start - buffer) + 3;
+    }
+    // whole numbers a double holds exactly, zero among them, are written as
+    // integers
+    if (value < 9007199254740992.0 && value == (double)(int64_t)value)
+        return (int)(start - buffer) + formatUnsigned((uint64_t)value, start);
+
+    int k;
+    int length;
+    if (!grisu3(value, start, &length, &k))
+        length = exactDigits(value, start, &k);
+    return (int)(start - buffer) + layOut(start, length, k);
+}
@@ -0,0 +1,744 @@
+// for accept4
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "memory.h"
+#include "object.h"
+#include "output.h"
+#include "vm.h"
+
+// what one read from a socket takes at most
+#define READ_SIZE 65536
+#define EVENTS_MAX 64
+
+typedef enum
+{
+    IO_ACCEPT,
+    IO_CONNECT,
+    IO_READ,
+    IO_WRITE,
+    IO_READ_FILE,
+    IO_WRITE_FILE,
+    IO_SLEEP,
+} IoKind;
+
+struct IoOperation
+{
+    IoKind kind;
+    ObjCoroutine *coroutine; // waiting for it, NULL if the VM blocks instead
+    int slot;                // of the coroutine's stack, for the result
+    bool finished;           // for the VM blocking on it
+    Value result;
+    ObjSocket *socket;
+    // what to write, or what was read from a file
+    char *chars;
+    int length;
+    int written;
+    bool succeeded; // set by the file thread
+    char *path;
+    int64_t deadline;  // of a sleep, in nanoseconds
+    uint64_t sequence; // orders sleeps with the same deadline
+    IoOperation *next; // in the file thread's queues
+};
+
+typedef struct
+{
+    int epoll; // -1 until the first operation
+    int pending;
+    // sleeps, a binary heap by deadline
+    IoOperation **timers;
+    int timerCount;
+    int timerCapacity;
+    uint64_t timerSequence;
+    // coroutines whose operation is done, for wait() to hand back
+    Value *ready;
+    int readyCount;
+    int readyCapacity;
+    // The file thread takes requests and hands back completions, then
+    // signals the event fd so epoll wakes for them.
+    bool fileThreadRunning;
+    pthread_t fileThread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stopping;
+    IoOperation *requests;
+    IoOperation *lastRequest;
+    IoOperation *completions;
+    int eventFd;
+} IoLoop;
+
+static _Thread_local IoLoop loop = {.epoll = -1, .eventFd = -1};
+
+static int64_t now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void initLoop()
+{
+    if (loop.epoll >= 0)
+        return;
+    loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll < 0)
+        PANIC("can't create an epoll instance");
+}
+
+static IoOperation *newOperation(IoKind kind)
+{
+    initLoop();
+    IoOperation *operation = ALLOCATE(IoOperation, 1);
+    operation->kind = kind;
+    operation->coroutine = NULL;
+    operation->slot = 0;
+    operation->finished = false;
+    operation->result = NIL_VAL;
+    operation->socket = NULL;
+    operation->chars = NULL;
+    operation->length = 0;
+    operation->written = 0;
+    operation->succeeded = false;
+    operation->path = NULL;
+    operation->deadline = 0;
+    operation->sequence = 0;
+    operation->next = NULL;
+    return operation;
+}
+
+static void freeOperation(IoOperation *operation)
+{
+    if (operation->chars != NULL)
+        FREE_ARRAY(char, operation->chars, operation->length + 1);
+    if (operation->path != NULL)
+        FREE_ARRAY(char, operation->path, strlen(operation->path) + 1);
+    FREE(IoOperation, operation);
+}
+
+// Hand the result to whoever waits for the operation. A coroutine is ready
+// to resume, with the result where its native's would be.
+static void finishOperation(IoOperation *operation, Value result)
+{
+    loop.pending--;
+    if (operation->socket != NULL)
+    {
+        if (operation->socket->reader == operation)
+            operation->socket->reader = NULL;
+        if (operation->socket->writer == operation)
+            operation->socket->writer = NULL;
+    }
+
+    if (operation->coroutine == NULL)
+    {
+        operation->result = result;
+        operation->finished = true;
+        return;
+    }
+    ObjCoroutine *coroutine = operation->coroutine;
+    coroutine->fiber.stack[operation->slot] = result;
+    coroutine->state = COROUTINE_SUSPENDED;
+    if (loop.readyCount == loop.readyCapacity)
+    {
+        int oldCapacity = loop.readyCapacity;
+        loop.readyCapacity = GROW_CAPACITY(oldCapacity);
+        loop.ready = GROW_ARRAY(Value, loop.ready, oldCapacity, loop.readyCapacity);
+    }
+    loop.ready[loop.readyCount++] = OBJ_VAL(coroutine);
+    freeOperation(operation);
+}
+
+static void pollOnce();
+
+// the result of an operation that has to wait: at once when the VM blocks,
+// later when a coroutine does
+static Value await(IoOperation *operation, Value *result)
+{
+    loop.pending++;
+    if (vm.coroutine == NULL)
+    {
+        while (!operation->finished)
+            pollOnce();
+        Value value = operation->result;
+        freeOperation(operation);
+        return value;
+    }
+
+    operation->coroutine = vm.coroutine;
+    operation->slot = (int)(result - vm.stack);
+    vm.suspending = true;
+    return NIL_VAL;
+}
+
+// Sockets
+
+static bool watchSocket(int fd, ObjSocket *socket)
+{
+    initLoop();
+    // edge triggered: an operation only waits after its call would block
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = socket;
+    return epoll_ctl(loop.epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+static ObjSocket *openSocket(int fd)
+{
+    ObjSocket *socket = newSocket(fd);
+    if (!watchSocket(fd, socket))
+    {
+        close(fd);
+        socket->fd = -1;
+    }
+    return socket;
+}
+
+// a socket for a localhost port or a Unix socket path, and its address;
+// -1 if the address is neither
+static int addressSocket(Value address, struct sockaddr_storage *storage, socklen_t *length)
+{
+    memset(storage, 0, sizeof(*storage));
+    if (IS_NUMBER(address))
+    {
+        double port = AS_NUMBER(address);
+        if (port < 0 || port > 65535 || port != (int)port)
+            return -1;
+        struct sockaddr_in *inet = (struct sockaddr_in *)storage;
+        inet->sin_family = AF_INET;
+        inet->sin_port = htons((uint16_t)port);
+        inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *length = sizeof(*inet);
+    }
+    else if (IS_STRING(address))
+    {
+        struct sockaddr_un *local = (struct sockaddr_un *)storage;
+        ObjString *path = AS_STRING(address);
+        if (path->length >= (int)sizeof(local->sun_path))
+            return -1;
+        local->sun_family = AF_UNIX;
+        memcpy(local->sun_path, path->chars, path->length);
+        *length = sizeof(*local);
+    }
+    else
+    {
+        return -1;
+    }
+    return socket(storage->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+ObjSocket *ioListen(Value address)
+{
+    struct sockaddr_storage storage;
+    socklen_t length;
+    int fd = addressSocket(address, &storage, &length);
+    if (fd < 0)
+        return NULL;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, (struct sockaddr *)&storage, length) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    ObjSocket *socket = openSocket(fd);
+    return socket->fd < 0 ? NULL : socket;
+}
+
+// Each of these tries the operation, returning whether it is done; they are
+// tried again each time epoll reports the socket ready.
+
+static bool tryAccept(IoOperation *operation)
+{
+    int fd = accept4(operation->socket->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return false;
+    operation->result = fd < 0 ? NIL_VAL : OBJ_VAL(openSocket(fd));
+    return true;
+}
+
+// only once epoll reports the socket writable, when connecting has ended
+static bool tryConnect(IoOperation *operation)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(operation->socket->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    operation->result = error == 0 ? OBJ_VAL(operation->socket) : NIL_VAL;
+    return true;
+}
+
+static bool tryRead(IoOperation *operation)
+{
+    char buffer[READ_SIZE];
+    ssize_t count = read(operation->socket->fd, buffer, sizeof(buffer));
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return false;
+    operation->result = count <= 0 ? NIL_VAL : OBJ_VAL(copyString(buffer, (int)count));
+    return true;
+}
+
+static bool tryWrite(IoOperation *operation)
+{
+    while (operation->written < operation->length)
+    {
+        ssize_t count = send(operation->socket->fd, operation->chars + operation->written,
+                             operation->length - operation->written, MSG_NOSIGNAL);
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return false;
+        if (count < 0)
+        {
+            operation->result = BOOL_VAL(false);
+            return true;
+        }
+        operation->written += (int)count;
+    }
+    operation->result = BOOL_VAL(true);
+    return true;
+}
+
+static bool trySocket(IoOperation *operation)
+{
+    switch (operation->kind)
+    {
+    case IO_ACCEPT:
+        return tryAccept(operation);
+    case IO_CONNECT:
+        return tryConnect(operation);
+    case IO_READ:
+        return tryRead(operation);
+    case IO_WRITE:
+        return tryWrite(operation);
+    default:
+        PANIC("not a socket operation");
+    }
+}
+
+// the result of a socket operation, waiting for the socket only if it
+// isn't ready already
+static Value startSocket(IoOperation *operation, Value *result)
+{
+    if (operation->kind != IO_CONNECT && trySocket(operation))
+    {
+        Value value = operation->result;
+        freeOperation(operation);
+        return value;
+    }
+    ObjSocket *socket = operation->socket;
+    if (operation->kind == IO_ACCEPT || operation->kind == IO_READ)
+        socket->reader = operation;
+    else
+        socket->writer = operation;
+    return await(operation, result);
+}
+
+Value ioConnect(Value address, Value *result)
+{
+    struct sockaddr_storage storage;
+    socklen_t length;
+    int fd = addressSocket(address, &storage, &length);
+    if (fd < 0)
+        return NIL_VAL;
+    bool connected = connect(fd, (struct sockaddr *)&storage, length) == 0;
+    if (!connected && errno != EINPROGRESS)
+    {
+        close(fd);
+        return NIL_VAL;
+    }
+    ObjSocket *socket = openSocket(fd);
+    if (socket->fd < 0)
+        return NIL_VAL;
+    if (connected)
+        return OBJ_VAL(socket);
+
+    IoOperation *operation = newOperation(IO_CONNECT);
+    operation->socket = socket;
+    return startSocket(operation, result);
+}
+
+Value ioAccept(ObjSocket *server, Value *result)
+{
+    IoOperation *operation = newOperation(IO_ACCEPT);
+    operation->socket = server;
+    return startSocket(operation, result);
+}
+
+Value ioRead(ObjSocket *socket, Value *result)
+{
+    IoOperation *operation = newOperation(IO_READ);
+    operation->socket = socket;
+    return startSocket(operation, result);
+}
+
+Value ioWrite(ObjSocket *socket, ObjString *text, Value *result)
+{
+    IoOperation *operation = newOperation(IO_WRITE);
+    operation->socket = socket;
+    operation->chars = ALLOCATE(char, text->length + 1);
+    memcpy(operation->chars, text->chars, text->length + 1);
+    operation->length = text->length;
+    return startSocket(operation, result);
+}
+
+void ioClose(ObjSocket *socket)
+{
+    if (socket->fd < 0)
+        return;
+    close(socket->fd);
+    socket->fd = -1;
+    if (socket->reader != NULL)
+        finishOperation(socket->reader, NIL_VAL);
+    if (socket->writer != NULL)
+        finishOperation(socket->writer, socket->writer->kind == IO_WRITE ? BOOL_VAL(false)
+                                                                         : NIL_VAL);
+}
+
+void freeSocket(ObjSocket *socket)
+{
+    if (socket->reader != NULL)
+        freeOperation(socket->reader);
+    if (socket->writer != NULL)
+        freeOperation(socket->writer);
+    if (socket->fd >= 0)
+        close(socket->fd);
+}
+
+// Files
+
+static void readFileNow(IoOperation *operation)
+{
+    int fd = open(operation->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    int capacity = 0;
+    int length = 0;
+    char *chars = NULL;
+    for (;;)
+    {
+        if (length + 1 >= capacity)
+        {
+            int oldCapacity = capacity;
+            capacity = capacity < 4096 ? 4096 : capacity * 2;
+            chars = GROW_ARRAY(char, chars, oldCapacity, capacity);
+        }
+        ssize_t count = read(fd, chars + length, capacity - length - 1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            close(fd);
+            if (count < 0)
+            {
+                FREE_ARRAY(char, chars, capacity);
+                return;
+            }
+            break;
+        }
+        length += (int)count;
+    }
+    chars[length] = '\0';
+    // shrunk to the size takeString will free it with
+    operation->chars = GROW_ARRAY(char, chars, capacity, length + 1);
+    operation->length = length;
+    operation->succeeded = true;
+}
+
+static void writeFileNow(IoOperation *operation)
+{
+    int fd = open(operation->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    int written = 0;
+    while (written < operation->length)
+    {
+        ssize_t count = write(fd, operation->chars + written, operation->length - written);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            break;
+        written += (int)count;
+    }
+    operation->succeeded = close(fd) == 0 && written == operation->length;
+}
+
+static void *runFileThread(void *argument)
+{
+    IoLoop *owner = (IoLoop *)argument;
+    pthread_mutex_lock(&owner->lock);
+    for (;;)
+    {
+        while (owner->requests == NULL && !owner->stopping)
+            pthread_cond_wait(&owner->wake, &owner->lock);
+        if (owner->requests == NULL)
+            break;
+        IoOperation *operation = owner->requests;
+        owner->requests = operation->next;
+        if (owner->requests == NULL)
+            owner->lastRequest = NULL;
+        pthread_mutex_unlock(&owner->lock);
+
+        if (operation->kind == IO_READ_FILE)
+            readFileNow(operation);
+        else
+            writeFileNow(operation);
+
+        pthread_mutex_lock(&owner->lock);
+        operation->next = owner->completions;
+        owner->completions = operation;
+        uint64_t one = 1;
+        if (write(owner->eventFd, &one, sizeof(one)) < 0)
+            PANIC("can't signal the event loop");
+    }
+    pthread_mutex_unlock(&owner->lock);
+    return NULL;
+}
+
+static void startFileThread()
+{
+    loop.eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop.eventFd < 0)
+        PANIC("can't create an event fd");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &loop; // no socket is at this address
+    epoll_ctl(loop.epoll, EPOLL_CTL_ADD, loop.eventFd, &event);
+
+    pthread_mutex_init(&loop.lock, NULL);
+    pthread_cond_init(&loop.wake, NULL);
+    loop.stopping = false;
+    loop.requests = NULL;
+    loop.lastRequest = NULL;
+    loop.completions = NULL;
+    if (pthread_create(&loop.fileThread, NULL, runFileThread, &loop) != 0)
+        PANIC("can't start the file thread");
+    loop.fileThreadRunning = true;
+}
+
+static Value startFile(IoOperation *operation, ObjString *path, Value *result)
+{
+    operation->path = ALLOCATE(char, path->length + 1);
+    memcpy(operation->path, path->chars, path->length + 1);
+    if (!loop.fileThreadRunning)
+        startFileThread();
+
+    pthread_mutex_lock(&loop.lock);
+    if (loop.lastRequest == NULL)
+        loop.requests = operation;
+    else
+        loop.lastRequest->next = operation;
+    loop.lastRequest = operation;
+    pthread_cond_signal(&loop.wake);
+    pthread_mutex_unlock(&loop.lock);
+    return await(operation, result);
+}
+
+Value ioReadFile(ObjString *path, Value *result)
+{
+    return startFile(newOperation(IO_READ_FILE), path, result);
+}
+
+Value ioWriteFile(ObjString *path, ObjString *text, Value *result)
+{
+    IoOperation *operation = newOperation(IO_WRITE_FILE);
+    operation->chars = ALLOCATE(char, text->length + 1);
+    memcpy(operation->chars, text->chars, text->length + 1);
+    operation->length = text->length;
+    return startFile(operation, path, result);
+}
+
+static void finishFiles()
+{
+    uint64_t count;
+    if (read(loop.eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        PANIC("can't read the event fd");
+    pthread_mutex_lock(&loop.lock);
+    IoOperation *operation = loop.completions;
+    loop.completions = NULL;
+    pthread_mutex_unlock(&loop.lock);
+
+    while (operation != NULL)
+    {
+        IoOperation *next = operation->next;
+        Value result;
+        if (operation->kind == IO_WRITE_FILE)
+        {
+            result = BOOL_VAL(operation->succeeded);
+        }
+        else if (operation->succeeded)
+        {
+            // the string takes over the characters
+            result = OBJ_VAL(takeString(operation->chars, operation->length));
+            operation->chars = NULL;
+        }
+        else
+        {
+            result = NIL_VAL;
+        }
+        finishOperation(operation, result);
+        operation = next;
+    }
+}
+
+// Timers
+
+static bool earlier(IoOperation *a, IoOperation *b)
+{
+    return a->deadline < b->deadline ||
+           (a->deadline == b->deadline && a->sequence < b->sequence);
+}
+
+static void swapTimers(int a, int b)
+{
+    IoOperation *operation = loop.timers[a];
+    loop.timers[a] = loop.timers[b];
+    loop.timers[b] = operation;
+}
+
+static void addTimer(IoOperation *operation)
+{
+    if (loop.timerCount == loop.timerCapacity)
+    {
+        int oldCapacity = loop.timerCapacity;
+        loop.timerCapacity = GROW_CAPACITY(oldCapacity);
+        loop.timers = GROW_ARRAY(IoOperation *, loop.timers, oldCapacity, loop.timerCapacity);
+    }
+    int index = loop.timerCount++;
+    loop.timers[index] = operation;
+    while (index > 0 && earlier(loop.timers[index], loop.timers[(index - 1) / 2]))
+    {
+        swapTimers(index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+}
+
+static IoOperation *removeFirstTimer()
+{
+    IoOperation *first = loop.timers[0];
+    loop.timers[0] = loop.timers[--loop.timerCount];
+    int index = 0;
+    for (;;)
+    {
+        int smallest = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+        if (left < loop.timerCount && earlier(loop.timers[left], loop.timers[smallest]))
+            smallest = left;
+        if (right < loop.timerCount && earlier(loop.timers[right], loop.timers[smallest]))
+            smallest = right;
+        if (smallest == index)
+            break;
+        swapTimers(index, smallest);
+        index = smallest;
+    }
+    return first;
+}
+
+Value ioSleep(int64_t nanoseconds, Value *result)
+{
+    IoOperation *operation = newOperation(IO_SLEEP);
+    operation->deadline = now() + nanoseconds;
+    operation->sequence = loop.timerSequence++;
+    addTimer(operation);
+    return await(operation, result);
+}
+
+// The loop
+
+// wait once for epoll, at most until the first timer is due, and finish
+// what is done
+static void pollOnce()
+{
+    int timeout = -1;
+    if (loop.timerCount > 0)
+    {
+        int64_t wait = loop.timers[0]->deadline - now();
+        // rounded up, so a timer is never woken for early
+        timeout = wait <= 0 ? 0 : (int)((wait + 999999) / 1000000);
+    }
+
+    // what was printed shows up while the VM waits
+    if (timeout != 0)
+        flushOutput();
+
+    struct epoll_event events[EVENTS_MAX];
+    int count = epoll_wait(loop.epoll, events, EVENTS_MAX, timeout);
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].data.ptr == &loop)
+        {
+            finishFiles();
+            continue;
+        }
+        ObjSocket *socket = (ObjSocket *)events[i].data.ptr;
+        uint32_t ready = events[i].events;
+        if ((ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && socket->reader != NULL &&
+            trySocket(socket->reader))
+            finishOperation(socket->reader, socket->reader->result);
+        if ((ready & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && socket->writer != NULL &&
+            trySocket(socket->writer))
+            finishOperation(socket->writer, socket->writer->result);
+    }
+
+    int64_t time = now();
+    while (loop.timerCount > 0 && loop.timers[0]->deadline <= time)
+        finishOperation(removeFirstTimer(), NIL_VAL);
+}
+
+int ioPending()
+{
+    return loop.pending + loop.readyCount;
+}
+
+ObjList *ioWait()
+{
+    while (loop.readyCount == 0 && loop.pending > 0)
+        pollOnce();
+    ObjList *list = newList(loop.ready, loop.readyCount);
+    loop.readyCount = 0;
+    return list;
+}
+
+void freeIo()
+{
+    if (loop.fileThreadRunning)
+    {
+        pthread_mutex_lock(&loop.lock);
+        loop.stopping = true;
+        pthread_cond_signal(&loop.wake);
+        pthread_mutex_unlock(&loop.lock);
+        pthread_join(loop.fileThread, NULL);
+        while (loop.requests != NULL)
+        {
+            IoOperation *next = loop.requests->next;
+            freeOperation(loop.requests);
+            loop.requests = next;
+        }
+        while (loop.completions != NULL)
+        {
+            IoOperation *next = loop.completions->next;
+            freeOperation(loop.completions);
+            loop.completions = next;
+        }
+        pthread_mutex_destroy(&loop.lock);
+        pthread_cond_destroy(&loop.wake);
+        close(loop.eventFd);
+        loop.fileThreadRunning = false;
+    }
+    for (int i = 0; i < loop.timerCount; i++)
+        freeOperation(loop.timers[i]);
+    FREE_ARRAY(IoOperation *, loop.timers, loop.timerCapacity);
+    FREE_ARRAY(Value, loop.ready, loop.readyCapacity);
+    if (loop.epoll >= 0)
+        close(loop.epoll);
+    loop = (IoLoop){.epoll = -1, .eventFd = -1};
+}
@@ -0,0 +1,370 @@
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "isolate.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+typedef enum
+{
+    MESSAGE_VALUE,
+    MESSAGE_STRING,
+    MESSAGE_CHANNEL,
+} MessageType;
+
+// A value on its way between isolates, owning what it carries
+typedef struct
+{
+    MessageType type;
+    union
+    {
+        Value value;
+        struct
+        {
+            char *chars;
+            int length;
+        } string;
+        Channel *channel;
+    } as;
+} Message;
+
+// A cell can be sent into when its sequence equals the position sending
+// reached, and received from when it is one past the position receiving
+// reached.
+typedef struct
+{
+    atomic_size_t sequence;
+    Message message;
+} Cell;
+
+// Where one side of a channel sleeps once spinning hasn't helped. `events`
+// is a futex word the other side bumps when it sends or receives while
+// anyone is asleep, which `waiting` counts.
+typedef struct
+{
+    atomic_uint events;
+    atomic_int waiting;
+} Waiters;
+
+// Dmitry Vyukov's bounded queue: senders and receivers each claim a cell by
+// moving their position forward, so neither side waits on a lock.
+struct Channel
+{
+    atomic_int references;
+    size_t mask; // the capacity is a power of two
+    Cell *cells;
+    // on lines of their own, so senders and receivers don't contend on them
+    alignas(64) atomic_size_t sendPosition;
+    alignas(64) atomic_size_t receivePosition;
+    // receivers waiting for a value, and senders waiting for room
+    alignas(64) Waiters receivers;
+    alignas(64) Waiters senders;
+};
+
+struct Isolate
+{
+    pthread_t thread;
+    char *source;
+    Message argument;
+    bool registerMachine;
+    bool unbuffered;
+    bool succeeded;
+    bool finished; // and joined
+};
+
+Channel *createChannel(int capacity)
+{
+    size_t size = 2;
+    while (size < (size_t)capacity)
+        size *= 2;
+
+    // aligned for the positions; the memory allocator doesn't know of it
+    Channel *channel = aligned_alloc(alignof(Channel), sizeof(Channel));
+    if (channel == NULL)
+        exit(1);
+    atomic_init(&channel->references, 1);
+    channel->mask = size - 1;
+    channel->cells = ALLOCATE(Cell, size);
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&channel->cells[i].sequence, i);
+    atomic_init(&channel->sendPosition, 0);
+    atomic_init(&channel->receivePosition, 0);
+    atomic_init(&channel->receivers.events, 0);
+    atomic_init(&channel->receivers.waiting, 0);
+    atomic_init(&channel->senders.events, 0);
+    atomic_init(&channel->senders.waiting, 0);
+    return channel;
+}
+
+static void retainChannel(Channel *channel)
+{
+    atomic_fetch_add_explicit(&channel->references, 1, memory_order_relaxed);
+}
+
+static bool tryReceive(Channel *channel, Message *message);
+
+static void freeMessage(Message *message)
+{
+    switch (message->type)
+    {
+    case MESSAGE_VALUE:
+        break;
+    case MESSAGE_STRING:
+        FREE_ARRAY(char, message->as.string.chars, message->as.string.length + 1);
+        break;
+    case MESSAGE_CHANNEL:
+        releaseChannel(message->as.channel);
+        break;
+    }
+}
+
+void releaseChannel(Channel *channel)
+{
+    if (atomic_fetch_sub_explicit(&channel->references, 1, memory_order_acq_rel) != 1)
+        return;
+
+    // nobody can receive what is left any more
+    Message message;
+    while (tryReceive(channel, &message))
+        freeMessage(&message);
+    FREE_ARRAY(Cell, channel->cells, channel->mask + 1);
+    free(channel);
+}
+
+bool isSendable(Value value)
+{
+    return !IS_OBJ(value) || IS_STRING(value) || IS_CHANNEL(value);
+}
+
+static Message toMessage(Value value)
+{
+    Message message;
+    if (IS_STRING(value))
+    {
+        ObjString *string = AS_STRING(value);
+        message.type = MESSAGE_STRING;
+        message.as.string.chars = ALLOCATE(char, string->length + 1);
+        memcpy(message.as.string.chars, string->chars, string->length + 1);
+        message.as.string.length = string->length;
+    }
+    else if (IS_CHANNEL(value))
+    {
+        message.type = MESSAGE_CHANNEL;
+        message.as.channel = AS_CHANNEL(value)->channel;
+        retainChannel(message.as.channel);
+    }
+    else
+    {
+        ASSERT(!IS_OBJ(value), "only sendable values make messages");
+        message.type = MESSAGE_VALUE;
+        message.as.value = value;
+    }
+    return message;
+}
+
+// the message as a value of the running isolate, which takes over what the
+// message owned
+static Value fromMessage(Message *message)
+{
+    switch (message->type)
+    {
+    case MESSAGE_VALUE:
+        return message->as.value;
+    case MESSAGE_STRING:
+        return OBJ_VAL(takeString(message->as.string.chars, message->as.string.length));
+    case MESSAGE_CHANNEL:
+        return OBJ_VAL(newChannel(message->as.channel));
+    }
+    PANIC("unknown message type");
+}
+
+static bool trySend(Channel *channel, Message *message)
+{
+    size_t position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    for (;;)
+    {
+        Cell *cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->sendPosition, &position,
+                                                      position + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                cell->message = *message;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false; // full: the cell still holds a value a lap behind
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+        }
+    }
+}
+
+static bool tryReceive(Channel *channel, Message *message)
+{
+    size_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    for (;;)
+    {
+        Cell *cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->receivePosition, &position,
+                                                      position + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                *message = cell->message;
+                // free for the send a lap ahead
+                atomic_store_explicit(&cell->sequence, position + channel->mask + 1,
+                                      memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false; // empty
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+        }
+    }
+}
+
+// Channels are only shared between the threads of this process, so the
+// futexes can be private ones.
+static void futexWait(atomic_uint *word, unsigned expected)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futexWake(atomic_uint *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// trySend or tryReceive
+typedef bool (*Attempt)(Channel *channel, Message *message);
+
+// Retry until the attempt succeeds: spinning for a while, since the other
+// side usually catches up within microseconds, then asleep until it sends
+// or receives.
+static void waitFor(Channel *channel, Waiters *waiters, Attempt attempt, Message *message)
+{
+    for (int spins = 0; spins < 64; spins++)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        if (attempt(channel, message))
+            return;
+    }
+
+    atomic_fetch_add_explicit(&waiters->waiting, 1, memory_order_relaxed);
+    for (;;)
+    {
+        // Either the other side sees this one waiting after the fence, or
+        // this attempt sees what it sent or received before its own.
+        atomic_thread_fence(memory_order_seq_cst);
+        unsigned events = atomic_load_explicit(&waiters->events, memory_order_acquire);
+        if (attempt(channel, message))
+            break;
+        // returns at once if there was an event since it was read
+        futexWait(&waiters->events, events);
+    }
+    atomic_fetch_sub_explicit(&waiters->waiting, 1, memory_order_relaxed);
+}
+
+// wake one of the waiters, if any sleep
+static void notify(Waiters *waiters)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&waiters->waiting, memory_order_relaxed) == 0)
+        return;
+    atomic_fetch_add_explicit(&waiters->events, 1, memory_order_release);
+    futexWake(&waiters->events);
+}
+
+void sendValue(Channel *channel, Value value)
+{
+    Message message = toMessage(value);
+    if (!trySend(channel, &message))
+        waitFor(channel, &channel->senders, trySend, &message);
+    notify(&channel->receivers);
+}
+
+Value receiveValue(Channel *channel)
+{
+    Message message;
+    if (!tryReceive(channel, &message))
+        waitFor(channel, &channel->receivers, tryReceive, &message);
+    notify(&channel->senders);
+    return fromMessage(&message);
+}
+
+static void *runIsolate(void *argument)
+{
+    Isolate *isolate = (Isolate *)argument;
+    initVM();
+    vm.registerMachine = isolate->registerMachine;
+    vm.output.unbuffered = isolate->unbuffered;
+    tableSet(copyString("argument", 8), fromMessage(&isolate->argument), &vm.globals);
+    isolate->succeeded = interpret(isolate->source) == INTERPRET_OK;
+    freeVM();
+    return NULL;
+}
+
+Isolate *spawnIsolate(const char *source, int length, Value argument)
+{
+    Isolate *isolate = ALLOCATE(Isolate, 1);
+    isolate->source = ALLOCATE(char, length + 1);
+    memcpy(isolate->source, source, length);
+    isolate->source[length] = '\0';
+    isolate->argument = toMessage(argument);
+    isolate->registerMachine = vm.registerMachine;
+    isolate->unbuffered = vm.output.unbuffered;
+    isolate->succeeded = false;
+    isolate->finished = false;
+
+    if (pthread_create(&isolate->thread, NULL, runIsolate, isolate) != 0)
+    {
+        freeMessage(&isolate->argument);
+        FREE_ARRAY(char, isolate->source, length + 1);
+        FREE(Isolate, isolate);
+        return NULL;
+    }
+    return isolate;
+}
+
+bool waitIsolate(Isolate *isolate)
+{
+    if (!isolate->finished)
+    {
+        pthread_join(isolate->thread, NULL);
+        isolate->finished = true;
+    }
+    return isolate->succeeded;
+}
+
+void freeIsolate(Isolate *isolate)
+{
+    waitIsolate(isolate);
+    FREE_ARRAY(char, isolate->source, strlen(isolate->source) + 1);
+    FREE(Isolate, isolate);
+}
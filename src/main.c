@@ -1,4 +1,3 @@
-#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +5,7 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "pool.h"
 #include "value.h"
 #include "vm.h"
 
@@ -73,23 +73,51 @@ static void runFile(const char *path)
         exit(70);
 }
 
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--register] [--compile-time] [--unbuffered] [--profile=ops|samples] [path]\n");
+    exit(64);
+}
+
 int main(int argc, char *argv[])
 {
     initVM();
-    if (argc == 1)
+
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++)
     {
-        repl();
+        if (strcmp(argv[i], "--register") == 0)
+            vm.registerMachine = true;
+        else if (strcmp(argv[i], "--compile-time") == 0)
+            vm.printCompileTime = true;
+        else if (strcmp(argv[i], "--unbuffered") == 0)
+            vm.output.unbuffered = true;
+        else if (strcmp(argv[i], "--profile=ops") == 0 && !vm.profileSamples)
+            vm.profileOps = true;
+        else if (strcmp(argv[i], "--profile=samples") == 0 && !vm.profileOps)
+            vm.profileSamples = true;
+        else if (argv[i][0] != '-' && path == NULL)
+            path = argv[i];
+        else
+            usage();
     }
-    else if (argc == 2)
+
+    if (vm.profileSamples && !startSampling())
     {
-        runFile(argv[1]);
+        fprintf(stderr, "Could not start the sampling profiler.\n");
+        exit(71);
+    }
+
+    if (path == NULL)
+    {
+        repl();
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
 
+    stopPool();
     freeVM();
     return 0;
 }
\ No newline at end of file
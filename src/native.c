@@ -0,0 +1,685 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "io.h"
+#include "isolate.h"
+#include "native.h"
+#include "object.h"
+#include "output.h"
+#include "pool.h"
+#include "simd.h"
+#include "vm.h"
+
+// Natives are called with exactly as many arguments as their arity, so they
+// only check the types.
+
+static Value clockNative(int argCount, Value *args)
+{
+    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+static Value nanotimeNative(int argCount, Value *args)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return NUMBER_VAL((double)time.tv_sec * 1e9 + (double)time.tv_nsec);
+}
+
+#define MATH_NATIVE(name, function)                                          \
+    static Value name##Native(int argCount, Value *args)                     \
+    {                                                                        \
+        if (!IS_NUMBER(args[0]))                                             \
+            return nativeError("Argument of " #name "() must be a number."); \
+        return NUMBER_VAL(function(AS_NUMBER(args[0])));                     \
+    }
+
+MATH_NATIVE(sqrt, sqrt)
+MATH_NATIVE(floor, floor)
+MATH_NATIVE(ceil, ceil)
+MATH_NATIVE(abs, fabs)
+
+#undef MATH_NATIVE
+
+static Value powNative(int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1]))
+        return nativeError("Arguments of pow() must be numbers.");
+    return NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+}
+
+// Lists. Elements are copied in bulk rather than one value at a time.
+
+static Value lenNative(int argCount, Value *args)
+{
+    if (IS_LIST(args[0]))
+        return INT_VAL(AS_LIST(args[0])->items.count);
+    if (IS_MAP(args[0]))
+        return INT_VAL(AS_MAP(args[0])->count);
+    if (IS_FLOAT64_ARRAY(args[0]))
+        return INT_VAL(AS_FLOAT64_ARRAY(args[0])->count);
+    if (IS_STRING(args[0]))
+        return INT_VAL(AS_STRING(args[0])->length);
+    if (IS_STRING_BUILDER(args[0]))
+        return INT_VAL(AS_STRING_BUILDER(args[0])->length);
+    return nativeError("Argument of len() must be a list, an array, a map, a string or a StringBuilder.");
+}
+
+static Value pushNative(int argCount, Value *args)
+{
+    if (!IS_LIST(args[0]))
+        return nativeError("First argument of push() must be a list.");
+    writeValueArray(&AS_LIST(args[0])->items, args[1]);
+    return NIL_VAL;
+}
+
+static Value popNative(int argCount, Value *args)
+{
+    if (!IS_LIST(args[0]))
+        return nativeError("Argument of pop() must be a list.");
+    ValueArray *items = &AS_LIST(args[0])->items;
+    if (items->count == 0)
+        return nativeError("Can't pop from an empty list.");
+    return items->value[--items->count];
+}
+
+// whether a value is an integer in [0, limit]
+static bool isBound(Value value, int limit)
+{
+    if (!IS_NUMBER(value))
+        return false;
+    double number = AS_NUMBER(value);
+    return number >= 0 && number <= limit && number == (int)number;
+}
+
+static Value sliceNative(int argCount, Value *args)
+{
+    if (!IS_LIST(args[0]))
+        return nativeError("First argument of slice() must be a list.");
+    ValueArray *items = &AS_LIST(args[0])->items;
+    if (!isBound(args[1], items->count) || !isBound(args[2], items->count) ||
+        AS_NUMBER(args[1]) > AS_NUMBER(args[2]))
+        return nativeError("Slice bounds out of range.");
+
+    int start = (int)AS_NUMBER(args[1]);
+    int end = (int)AS_NUMBER(args[2]);
+    return OBJ_VAL(newList(items->value + start, end - start));
+}
+
+static Value extendNative(int argCount, Value *args)
+{
+    if (!IS_LIST(args[0]) || !IS_LIST(args[1]))
+        return nativeError("Arguments of extend() must be lists.");
+    ValueArray *items = &AS_LIST(args[0])->items;
+    ValueArray *other = &AS_LIST(args[1])->items;
+    // a list may extend itself, so count before growing
+    int count = other->count;
+    reserveValueArray(items, items->count + count);
+    memcpy(items->value + items->count, other->value, sizeof(Value) * count);
+    items->count += count;
+    return NIL_VAL;
+}
+
+// Maps. keys() and values() walk the entry array once into a list sized
+// up front, which is how scripts iterate a map.
+
+static Value hasNative(int argCount, Value *args)
+{
+    if (!IS_MAP(args[0]))
+        return nativeError("First argument of has() must be a map.");
+    Value value;
+    return BOOL_VAL(tableGetValue(&AS_MAP(args[0])->table, args[1], &value));
+}
+
+static Value removeNative(int argCount, Value *args)
+{
+    if (!IS_MAP(args[0]))
+        return nativeError("First argument of remove() must be a map.");
+    ObjMap *map = AS_MAP(args[0]);
+    if (!tableDeleteValue(&map->table, args[1]))
+        return BOOL_VAL(false);
+    map->count--;
+    return BOOL_VAL(true);
+}
+
+static Value mapEntries(ObjMap *map, bool keys)
+{
+    ObjList *list = newList(NULL, 0);
+    reserveValueArray(&list->items, map->count);
+    for (int i = 0; i < map->table.capacity; i++)
+    {
+        Entry *entry = &map->table.entries[i];
+        if (!IS_EMPTY_KEY(entry->key))
+            list->items.value[list->items.count++] = keys ? entry->key : entry->value;
+    }
+    return OBJ_VAL(list);
+}
+
+static Value keysNative(int argCount, Value *args)
+{
+    if (!IS_MAP(args[0]))
+        return nativeError("Argument of keys() must be a map.");
+    return mapEntries(AS_MAP(args[0]), true);
+}
+
+static Value valuesNative(int argCount, Value *args)
+{
+    if (!IS_MAP(args[0]))
+        return nativeError("Argument of values() must be a map.");
+    return mapEntries(AS_MAP(args[0]), false);
+}
+
+// Strings. A StringBuilder collects pieces in a growing buffer and only
+// toString() makes an interned string of them, so building a line piece by
+// piece doesn't intern every partial result the way + does.
+
+// the characters of a string or a formatted number in `buffer`; the length,
+// or -1 for any other value
+static int textOf(Value value, const char **chars, char *buffer)
+{
+    if (IS_STRING(value))
+    {
+        *chars = AS_CSTRING(value);
+        return AS_STRING(value)->length;
+    }
+    if (IS_NUMBER(value))
+    {
+        *chars = buffer;
+        return formatNumber(value, buffer);
+    }
+    return -1;
+}
+
+static Value stringBuilderNative(int argCount, Value *args)
+{
+    return OBJ_VAL(newStringBuilder());
+}
+
+static Value appendNative(int argCount, Value *args)
+{
+    if (!IS_STRING_BUILDER(args[0]))
+        return nativeError("First argument of append() must be a StringBuilder.");
+    const char *chars;
+    char buffer[NUMBER_BUFFER_SIZE];
+    int length = textOf(args[1], &chars, buffer);
+    if (length < 0)
+        return nativeError("Can only append strings and numbers.");
+    appendToBuilder(AS_STRING_BUILDER(args[0]), chars, length);
+    return args[0];
+}
+
+static Value toStringNative(int argCount, Value *args)
+{
+    if (!IS_STRING_BUILDER(args[0]))
+        return nativeError("Argument of toString() must be a StringBuilder.");
+    return OBJ_VAL(builderToString(AS_STRING_BUILDER(args[0])));
+}
+
+static Value joinNative(int argCount, Value *args)
+{
+    if (!IS_LIST(args[0]) || !IS_STRING(args[1]))
+        return nativeError("Arguments of join() must be a list and a string.");
+    ValueArray *items = &AS_LIST(args[0])->items;
+    ObjString *separator = AS_STRING(args[1]);
+    const char *chars = NULL;
+    char buffer[NUMBER_BUFFER_SIZE];
+
+    // measure first so the result is allocated once
+    int length = items->count > 0 ? separator->length * (items->count - 1) : 0;
+    for (int i = 0; i < items->count; i++)
+    {
+        int itemLength = textOf(items->value[i], &chars, buffer);
+        if (itemLength < 0)
+            return nativeError("Can only join strings and numbers.");
+        length += itemLength;
+    }
+
+    char *result = ALLOCATE(char, length + 1);
+    char *end = result;
+    for (int i = 0; i < items->count; i++)
+    {
+        if (i > 0)
+        {
+            memcpy(end, separator->chars, separator->length);
+            end += separator->length;
+        }
+        int itemLength = textOf(items->value[i], &chars, buffer);
+        memcpy(end, chars, itemLength);
+        end += itemLength;
+    }
+    *end = '\0';
+    return OBJ_VAL(takeString(result, length));
+}
+
+static Value strNative(int argCount, Value *args)
+{
+    if (IS_STRING(args[0]))
+        return args[0];
+    if (!IS_NUMBER(args[0]))
+        return nativeError("Argument of str() must be a number or a string.");
+    char buffer[NUMBER_BUFFER_SIZE];
+    return OBJ_VAL(copyString(buffer, formatNumber(args[0], buffer)));
+}
+
+// Coroutines are made and switched by the `coroutine`, `resume` and `yield`
+// syntax; a consumer asks whether one has returned.
+
+static Value doneNative(int argCount, Value *args)
+{
+    if (!IS_COROUTINE(args[0]))
+        return nativeError("Argument of done() must be a coroutine.");
+    return BOOL_VAL(AS_COROUTINE(args[0])->state == COROUTINE_DONE);
+}
+
+// Isolates. spawn() runs a script in a VM on a new thread and channels carry
+// copies of values between the isolates; see isolate.h.
+
+#define CHANNEL_MAX (1 << 24)
+
+static Value spawnNative(int argCount, Value *args)
+{
+    if (!IS_STRING(args[0]))
+        return nativeError("First argument of spawn() must be a string.");
+    if (!isSendable(args[1]))
+        return nativeError("Can only send numbers, booleans, nil, strings and channels.");
+    ObjString *source = AS_STRING(args[0]);
+    Isolate *isolate = spawnIsolate(source->chars, source->length, args[1]);
+    if (isolate == NULL)
+        return nativeError("Can't start a thread for the isolate.");
+    return OBJ_VAL(newIsolate(isolate));
+}
+
+static Value waitNative(int argCount, Value *args)
+{
+    if (!IS_ISOLATE(args[0]))
+        return nativeError("Argument of wait() must be an isolate.");
+    return BOOL_VAL(waitIsolate(AS_ISOLATE(args[0])->isolate));
+}
+
+static Value channelNative(int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 || AS_NUMBER(args[0]) > CHANNEL_MAX ||
+        AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0]))
+        return nativeError("Capacity of a channel must be an integer from 1 to 16777216.");
+    return OBJ_VAL(newChannel(createChannel((int)AS_NUMBER(args[0]))));
+}
+
+static Value sendNative(int argCount, Value *args)
+{
+    if (!IS_CHANNEL(args[0]))
+        return nativeError("First argument of send() must be a channel.");
+    if (!isSendable(args[1]))
+        return nativeError("Can only send numbers, booleans, nil, strings and channels.");
+    sendValue(AS_CHANNEL(args[0])->channel, args[1]);
+    return NIL_VAL;
+}
+
+static Value receiveNative(int argCount, Value *args)
+{
+    if (!IS_CHANNEL(args[0]))
+        return nativeError("Argument of receive() must be a channel.");
+    return receiveValue(AS_CHANNEL(args[0])->channel);
+}
+
+#undef CHANNEL_MAX
+
+// Parallel operations, run by the work-stealing pool in pool.c over a
+// Float64Array or the ints below a count. The callback can't be a function
+// of this VM, whose code belongs to this thread, so it is given as source
+// that each worker compiles once.
+
+#define RANGE_MAX 2147483647
+
+// the input of a parallel operation, false if the argument isn't one
+static bool parallelInput(Value input, const double **values, int64_t *count)
+{
+    if (IS_FLOAT64_ARRAY(input))
+    {
+        *values = AS_FLOAT64_ARRAY(input)->values;
+        *count = AS_FLOAT64_ARRAY(input)->count;
+        return true;
+    }
+    if (IS_NUMBER(input) && AS_NUMBER(input) >= 0 && AS_NUMBER(input) <= RANGE_MAX &&
+        AS_NUMBER(input) == (int64_t)AS_NUMBER(input))
+    {
+        *values = NULL;
+        *count = (int64_t)AS_NUMBER(input);
+        return true;
+    }
+    return false;
+}
+
+static Value parallelMapNative(int argCount, Value *args)
+{
+    const double *values;
+    int64_t count;
+    if (!parallelInput(args[0], &values, &count))
+        return nativeError("First argument of parallelMap() must be a Float64Array or a count.");
+    if (!IS_STRING(args[1]))
+        return nativeError("Second argument of parallelMap() must be a string.");
+
+    ObjFloat64Array *result = newFloat64Array((int)count);
+    const char *error = parallelMap(AS_CSTRING(args[1]), AS_STRING(args[1])->length, values,
+                                    count, result->values);
+    if (error != NULL)
+        return nativeError(error);
+    return OBJ_VAL(result);
+}
+
+static Value parallelReduceNative(int argCount, Value *args)
+{
+    const double *values;
+    int64_t count;
+    if (!parallelInput(args[0], &values, &count))
+        return nativeError("First argument of parallelReduce() must be a Float64Array or a count.");
+    if (!IS_STRING(args[1]))
+        return nativeError("Second argument of parallelReduce() must be a string.");
+    if (count == 0)
+        return nativeError("Can't reduce an empty input.");
+
+    Value result;
+    const char *error = parallelReduce(AS_CSTRING(args[1]), AS_STRING(args[1])->length, values,
+                                       count, &result);
+    if (error != NULL)
+        return nativeError(error);
+    return result;
+}
+
+static Value parallelismNative(int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 || AS_NUMBER(args[0]) > UINT8_COUNT ||
+        AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0]))
+        return nativeError("Argument of parallelism() must be an integer from 0 to 256.");
+    setWorkerCount((int)AS_NUMBER(args[0]));
+    return NIL_VAL;
+}
+
+static Value coresNative(int argCount, Value *args)
+{
+    return INT_VAL(cpuCount());
+}
+
+#undef RANGE_MAX
+
+// I/O through the event loop in io.c. The natives that may wait suspend
+// the coroutine calling them until their result is in, and poll() hands
+// back the coroutines that can go on; outside a coroutine they block.
+
+// the result slot of the native whose arguments start at `args`
+#define RESULT_SLOT(args) ((args) - 1)
+
+static bool isAddress(Value value)
+{
+    return IS_NUMBER(value) || IS_STRING(value);
+}
+
+// the error of using the socket for reading or writing, NULL if there is none
+static const char *socketError(Value value, bool reading)
+{
+    if (!IS_SOCKET(value))
+        return "Can only do socket I/O on sockets.";
+    ObjSocket *socket = AS_SOCKET(value);
+    if (socket->fd < 0)
+        return "The socket is closed.";
+    if (reading ? socket->reader != NULL : socket->writer != NULL)
+        return reading ? "Another coroutine is reading from the socket."
+                       : "Another coroutine is writing to the socket.";
+    return NULL;
+}
+
+static Value listenNative(int argCount, Value *args)
+{
+    if (!isAddress(args[0]))
+        return nativeError("Address must be a port or a Unix socket path.");
+    ObjSocket *socket = ioListen(args[0]);
+    if (socket == NULL)
+        return nativeError("Can't listen on the address.");
+    return OBJ_VAL(socket);
+}
+
+static Value connectNative(int argCount, Value *args)
+{
+    if (!isAddress(args[0]))
+        return nativeError("Address must be a port or a Unix socket path.");
+    return ioConnect(args[0], RESULT_SLOT(args));
+}
+
+static Value acceptNative(int argCount, Value *args)
+{
+    const char *error = socketError(args[0], true);
+    if (error != NULL)
+        return nativeError(error);
+    return ioAccept(AS_SOCKET(args[0]), RESULT_SLOT(args));
+}
+
+static Value readNative(int argCount, Value *args)
+{
+    const char *error = socketError(args[0], true);
+    if (error != NULL)
+        return nativeError(error);
+    return ioRead(AS_SOCKET(args[0]), RESULT_SLOT(args));
+}
+
+static Value writeNative(int argCount, Value *args)
+{
+    const char *error = socketError(args[0], false);
+    if (error != NULL)
+        return nativeError(error);
+    if (!IS_STRING(args[1]))
+        return nativeError("Can only write strings.");
+    return ioWrite(AS_SOCKET(args[0]), AS_STRING(args[1]), RESULT_SLOT(args));
+}
+
+static Value closeNative(int argCount, Value *args)
+{
+    if (!IS_SOCKET(args[0]))
+        return nativeError("Argument of close() must be a socket.");
+    ioClose(AS_SOCKET(args[0]));
+    return NIL_VAL;
+}
+
+static Value readFileNative(int argCount, Value *args)
+{
+    if (!IS_STRING(args[0]))
+        return nativeError("Argument of readFile() must be a path.");
+    return ioReadFile(AS_STRING(args[0]), RESULT_SLOT(args));
+}
+
+static Value writeFileNative(int argCount, Value *args)
+{
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1]))
+        return nativeError("Arguments of writeFile() must be a path and a string.");
+    return ioWriteFile(AS_STRING(args[0]), AS_STRING(args[1]), RESULT_SLOT(args));
+}
+
+static Value sleepNative(int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0)
+        return nativeError("Argument of sleep() must be a number of milliseconds.");
+    return ioSleep((int64_t)(AS_NUMBER(args[0]) * 1e6), RESULT_SLOT(args));
+}
+
+static Value pendingNative(int argCount, Value *args)
+{
+    return INT_VAL(ioPending());
+}
+
+static Value pollNative(int argCount, Value *args)
+{
+    return OBJ_VAL(ioWait());
+}
+
+static Value flushNative(int argCount, Value *args)
+{
+    flushOutput();
+    return NIL_VAL;
+}
+
+#undef RESULT_SLOT
+
+// Float64Arrays. The bulk operations run the vector kernels in simd.c over
+// the raw doubles instead of one instruction per element; the binary ones
+// write into their first argument, so a loop doesn't allocate.
+
+static Value float64ArrayNative(int argCount, Value *args)
+{
+    if (IS_LIST(args[0]))
+    {
+        ValueArray *items = &AS_LIST(args[0])->items;
+        ObjFloat64Array *array = newFloat64Array(items->count);
+        for (int i = 0; i < items->count; i++)
+        {
+            if (!IS_NUMBER(items->value[i]))
+                return nativeError("Float64Array elements must be numbers.");
+            array->values[i] = AS_NUMBER(items->value[i]);
+        }
+        return OBJ_VAL(array);
+    }
+    if (!isBound(args[0], INT32_MAX))
+        return nativeError("Argument of Float64Array() must be a length or a list.");
+    return OBJ_VAL(newFloat64Array((int)AS_NUMBER(args[0])));
+}
+
+// the arrays of a binary operation, or NULL after reporting why they can't be
+static ObjFloat64Array *sameLengthArrays(Value *args, int count, const char *name)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!IS_FLOAT64_ARRAY(args[i]))
+        {
+            nativeError(name);
+            return NULL;
+        }
+        if (AS_FLOAT64_ARRAY(args[i])->count != AS_FLOAT64_ARRAY(args[0])->count)
+        {
+            nativeError("Float64Arrays must have the same length.");
+            return NULL;
+        }
+    }
+    return AS_FLOAT64_ARRAY(args[0]);
+}
+
+static Value arrayAddNative(int argCount, Value *args)
+{
+    ObjFloat64Array *out =
+        sameLengthArrays(args, 3, "Arguments of arrayAdd() must be Float64Arrays.");
+    if (out == NULL)
+        return NIL_VAL;
+    addDoubles(out->values, AS_FLOAT64_ARRAY(args[1])->values,
+               AS_FLOAT64_ARRAY(args[2])->values, out->count);
+    return NIL_VAL;
+}
+
+static Value arrayMulNative(int argCount, Value *args)
+{
+    ObjFloat64Array *out =
+        sameLengthArrays(args, 3, "Arguments of arrayMul() must be Float64Arrays.");
+    if (out == NULL)
+        return NIL_VAL;
+    mulDoubles(out->values, AS_FLOAT64_ARRAY(args[1])->values,
+               AS_FLOAT64_ARRAY(args[2])->values, out->count);
+    return NIL_VAL;
+}
+
+static Value arrayDotNative(int argCount, Value *args)
+{
+    ObjFloat64Array *a =
+        sameLengthArrays(args, 2, "Arguments of arrayDot() must be Float64Arrays.");
+    if (a == NULL)
+        return NIL_VAL;
+    return NUMBER_VAL(dotDoubles(a->values, AS_FLOAT64_ARRAY(args[1])->values, a->count));
+}
+
+static Value arraySumNative(int argCount, Value *args)
+{
+    if (!IS_FLOAT64_ARRAY(args[0]))
+        return nativeError("Argument of arraySum() must be a Float64Array.");
+    ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+    return NUMBER_VAL(sumDoubles(array->values, array->count));
+}
+
+static Value arrayMinNative(int argCount, Value *args)
+{
+    if (!IS_FLOAT64_ARRAY(args[0]))
+        return nativeError("Argument of arrayMin() must be a Float64Array.");
+    ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+    if (array->count == 0)
+        return nativeError("Can't take the minimum of an empty Float64Array.");
+    return NUMBER_VAL(minDoubles(array->values, array->count));
+}
+
+static Value arrayMaxNative(int argCount, Value *args)
+{
+    if (!IS_FLOAT64_ARRAY(args[0]))
+        return nativeError("Argument of arrayMax() must be a Float64Array.");
+    ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+    if (array->count == 0)
+        return nativeError("Can't take the maximum of an empty Float64Array.");
+    return NUMBER_VAL(maxDoubles(array->values, array->count));
+}
+
+static Value arrayFillNative(int argCount, Value *args)
+{
+    if (!IS_FLOAT64_ARRAY(args[0]) || !IS_NUMBER(args[1]))
+        return nativeError("Arguments of arrayFill() must be a Float64Array and a number.");
+    ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+    fillDoubles(array->values, AS_NUMBER(args[1]), array->count);
+    return NIL_VAL;
+}
+
+void defineNatives()
+{
+    defineNative("clock", clockNative, 0);
+    defineNative("nanotime", nanotimeNative, 0);
+    defineNative("sqrt", sqrtNative, 1);
+    defineNative("floor", floorNative, 1);
+    defineNative("ceil", ceilNative, 1);
+    defineNative("abs", absNative, 1);
+    defineNative("pow", powNative, 2);
+    defineNative("len", lenNative, 1);
+    defineNative("push", pushNative, 2);
+    defineNative("pop", popNative, 1);
+    defineNative("slice", sliceNative, 3);
+    defineNative("extend", extendNative, 2);
+    defineNative("has", hasNative, 2);
+    defineNative("remove", removeNative, 2);
+    defineNative("keys", keysNative, 1);
+    defineNative("values", valuesNative, 1);
+    defineNative("StringBuilder", stringBuilderNative, 0);
+    defineNative("append", appendNative, 2);
+    defineNative("toString", toStringNative, 1);
+    defineNative("join", joinNative, 2);
+    defineNative("str", strNative, 1);
+    defineNative("done", doneNative, 1);
+    defineNative("spawn", spawnNative, 2);
+    defineNative("wait", waitNative, 1);
+    defineNative("Channel", channelNative, 1);
+    defineNative("send", sendNative, 2);
+    defineNative("receive", receiveNative, 1);
+    defineNative("parallelMap", parallelMapNative, 2);
+    defineNative("parallelReduce", parallelReduceNative, 2);
+    defineNative("parallelism", parallelismNative, 1);
+    defineNative("cores", coresNative, 0);
+    defineNative("listen", listenNative, 1);
+    defineNative("connect", connectNative, 1);
+    defineNative("accept", acceptNative, 1);
+    defineNative("read", readNative, 1);
+    defineNative("write", writeNative, 2);
+    defineNative("close", closeNative, 1);
+    defineNative("readFile", readFileNative, 1);
+    defineNative("writeFile", writeFileNative, 2);
+    defineNative("sleep", sleepNative, 1);
+    defineNative("pending", pendingNative, 0);
+    defineNative("poll", pollNative, 0);
+    defineNative("flush", flushNative, 0);
+
+    initKernels();
+    defineNative("Float64Array", float64ArrayNative, 1);
+    defineNative("arrayAdd", arrayAddNative, 3);
+    defineNative("arrayMul", arrayMulNative, 3);
+    defineNative("arrayDot", arrayDotNative, 2);
+    defineNative("arraySum", arraySumNative, 1);
+    defineNative("arrayMin", arrayMinNative, 1);
+    defineNative("arrayMax", arrayMaxNative, 1);
+    defineNative("arrayFill", arrayFillNative, 2);
+}
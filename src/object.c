@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "io.h"
 #include "object.h"
+#include "output.h"
 #include "vm.h"
 #include "value.h"
 
@@ -18,6 +20,239 @@ static Obj *allocateObject(size_t size, ObjType type)
 #define ALLOCATE_OBJ(type, objectType) \
     ((type *)allocateObject(sizeof(type), objectType))
 
+ObjBoundMethod *newBoundMethod(Value receiver, Value method)
+{
+    ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+static ObjShape *newShape(ObjClass *klass, ObjShape *parent, ObjString *name)
+{
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    shape->transitions = NULL;
+    shape->transitionCount = 0;
+    shape->transitionCapacity = 0;
+    return shape;
+}
+
+ObjChannel *newChannel(Channel *channel)
+{
+    ObjChannel *handle = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    handle->channel = channel;
+    return handle;
+}
+
+ObjClass *newClass(ObjString *name)
+{
+    ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+    klass->name = name;
+    initTable(&klass->methods);
+    klass->shape = newShape(klass, NULL, NULL);
+    klass->initializer = NIL_VAL;
+    return klass;
+}
+
+ObjClosure *newClosure(ObjFunction *function)
+{
+    ObjClosure *closure = (ObjClosure *)allocateObject(
+        sizeof(ObjClosure) + sizeof(Value) * function->captureCount, OBJ_CLOSURE);
+    closure->function = function;
+    return closure;
+}
+
+ObjCoroutine *newCoroutine(int slotCount)
+{
+    ObjCoroutine *coroutine = ALLOCATE_OBJ(ObjCoroutine, OBJ_COROUTINE);
+    coroutine->state = COROUTINE_SUSPENDED;
+    coroutine->previous = NULL;
+    Fiber *fiber = &coroutine->fiber;
+    // a stream that calls nothing never grows them
+    fiber->frameCapacity = 1;
+    fiber->frames = ALLOCATE(CallFrame, fiber->frameCapacity);
+    fiber->frameCount = 0;
+    fiber->stackCapacity = slotCount;
+    fiber->stack = ALLOCATE(Value, fiber->stackCapacity);
+    fiber->stackTop = fiber->stack;
+    fiber->openUpvalues = NULL;
+    return coroutine;
+}
+
+void freeFiber(Fiber *fiber)
+{
+    FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    fiber->frames = NULL;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackCapacity = 0;
+}
+
+ObjFloat64Array *newFloat64Array(int count)
+{
+    ObjFloat64Array *array = ALLOCATE_OBJ(ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+    array->count = count;
+    array->values = NULL;
+    if (count > 0)
+    {
+        array->values = ALLOCATE(double, count);
+        memset(array->values, 0, sizeof(double) * count);
+    }
+    return array;
+}
+
+ObjFunction *newFunction()
+{
+    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    function->arity = 0;
+    function->captureCount = 0;
+    function->maxSlots = 0;
+    function->name = NULL;
+    initChunk(&function->chunk);
+    return function;
+}
+
+ObjInstance *newInstance(ObjClass *klass)
+{
+    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    instance->shape = klass->shape;
+    instance->fields = NULL;
+    instance->capacity = 0;
+    return instance;
+}
+
+ObjIsolate *newIsolate(Isolate *isolate)
+{
+    ObjIsolate *handle = ALLOCATE_OBJ(ObjIsolate, OBJ_ISOLATE);
+    handle->isolate = isolate;
+    return handle;
+}
+
+ObjList *newList(Value *items, int count)
+{
+    ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    if (count > 0)
+    {
+        list->items.value = ALLOCATE(Value, count);
+        list->items.capacity = count;
+        list->items.count = count;
+        memcpy(list->items.value, items, sizeof(Value) * count);
+    }
+    return list;
+}
+
+ObjMap *newMap(int count)
+{
+    ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initTable(&map->table);
+    map->count = 0;
+    if (count > 0)
+        tableReserve(&map->table, count);
+    return map;
+}
+
+int shapeField(ObjShape *shape, ObjString *name)
+{
+    for (; shape->parent != NULL; shape = shape->parent)
+    {
+        if (shape->name == name)
+            return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name)
+{
+    for (int i = 0; i < shape->transitionCount; i++)
+    {
+        if (shape->transitions[i]->name == name)
+            return shape->transitions[i];
+    }
+
+    if (shape->transitionCapacity < shape->transitionCount + 1)
+    {
+        int oldCapacity = shape->transitionCapacity;
+        shape->transitionCapacity = GROW_CAPACITY(oldCapacity);
+        shape->transitions = GROW_ARRAY(ObjShape *, shape->transitions, oldCapacity,
+                                        shape->transitionCapacity);
+    }
+    ObjShape *next = newShape(shape->klass, shape, name);
+    shape->transitions[shape->transitionCount++] = next;
+    return next;
+}
+
+ObjNative *newNative(NativeFn function, int arity, ObjString *name)
+{
+    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->function = function;
+    native->arity = arity;
+    native->name = name;
+    return native;
+}
+
+ObjSocket *newSocket(int fd)
+{
+    ObjSocket *socket = ALLOCATE_OBJ(ObjSocket, OBJ_SOCKET);
+    socket->fd = fd;
+    socket->reader = NULL;
+    socket->writer = NULL;
+    return socket;
+}
+
+ObjStringBuilder *newStringBuilder()
+{
+    ObjStringBuilder *builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->chars = NULL;
+    builder->length = 0;
+    builder->capacity = 0;
+    return builder;
+}
+
+void reserveBuilder(ObjStringBuilder *builder, int length)
+{
+    if (builder->capacity >= builder->length + length)
+        return;
+
+    int oldCapacity = builder->capacity;
+    int newCapacity = oldCapacity;
+    while (newCapacity < builder->length + length)
+        newCapacity = GROW_CAPACITY(newCapacity);
+    builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, newCapacity);
+    builder->capacity = newCapacity;
+}
+
+void appendToBuilder(ObjStringBuilder *builder, const char *chars, int length)
+{
+    reserveBuilder(builder, length);
+    memcpy(builder->chars + builder->length, chars, length);
+    builder->length += length;
+}
+
+ObjString *builderToString(ObjStringBuilder *builder)
+{
+    char *chars = ALLOCATE(char, builder->length + 1);
+    if (builder->length > 0)
+        memcpy(chars, builder->chars, builder->length);
+    chars[builder->length] = '\0';
+    return takeString(chars, builder->length);
+}
+
+ObjUpvalue *newUpvalue(Value *slot)
+{
+    ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+    upvalue->location = slot;
+    upvalue->closed = NIL_VAL;
+    upvalue->next = NULL;
+    return upvalue;
+}
+
 ObjString *allocateSting(const char *chars, int length, uint32_t hash)
 {
     ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
@@ -52,12 +287,127 @@ ObjString *copyString(const char *chars, int length)
     return allocateSting(heapChars, length, hash);
 }
 
+// for the fixed parts of what objects print as
+static void writeText(const char *text)
+{
+    writeOutput(text, strlen(text));
+}
+
+static void printFunction(ObjFunction *function)
+{
+    if (function->name == NULL)
+    {
+        writeText("<script>");
+        return;
+    }
+    writeText("<fn ");
+    writeOutput(function->name->chars, function->name->length);
+    writeText(">");
+}
+
 void printObject(Value value)
 {
     switch (OBJ_TYPE(value))
     {
+    case OBJ_BOUND_METHOD:
+    {
+        Value method = AS_BOUND_METHOD(value)->method;
+        printFunction(IS_CLOSURE(method) ? AS_CLOSURE(method)->function : AS_FUNCTION(method));
+        break;
+    }
+    case OBJ_CLASS:
+        writeOutput(AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
+        break;
+    case OBJ_CLOSURE:
+        printFunction(AS_CLOSURE(value)->function);
+        break;
+    case OBJ_CHANNEL:
+        writeText("<channel>");
+        break;
+    case OBJ_COROUTINE:
+        writeText("<coroutine>");
+        break;
+    case OBJ_FLOAT64_ARRAY:
+    {
+        ObjFloat64Array *array = AS_FLOAT64_ARRAY(value);
+        writeText("Float64Array[");
+        for (int i = 0; i < array->count; i++)
+        {
+            if (i > 0)
+                writeText(", ");
+            printValue(NUMBER_VAL(array->values[i]));
+        }
+        writeText("]");
+        break;
+    }
+    case OBJ_FUNCTION:
+        printFunction(AS_FUNCTION(value));
+        break;
+    case OBJ_INSTANCE:
+    {
+        ObjString *name = AS_INSTANCE(value)->shape->klass->name;
+        writeOutput(name->chars, name->length);
+        writeText(" instance");
+        break;
+    }
+    case OBJ_ISOLATE:
+        writeText("<isolate>");
+        break;
+    case OBJ_LIST:
+    {
+        ValueArray *items = &AS_LIST(value)->items;
+        writeText("[");
+        for (int i = 0; i < items->count; i++)
+        {
+            if (i > 0)
+                writeText(", ");
+            printValue(items->value[i]);
+        }
+        writeText("]");
+        break;
+    }
+    case OBJ_MAP:
+    {
+        Table *table = &AS_MAP(value)->table;
+        bool first = true;
+        writeText("{");
+        for (int i = 0; i < table->capacity; i++)
+        {
+            Entry *entry = &table->entries[i];
+            if (IS_EMPTY_KEY(entry->key))
+                continue;
+            if (!first)
+                writeText(", ");
+            first = false;
+            printValue(entry->key);
+            writeText(": ");
+            printValue(entry->value);
+        }
+        writeText("}");
+        break;
+    }
+    case OBJ_NATIVE:
+        writeText("<native fn ");
+        writeOutput(AS_NATIVE(value)->name->chars, AS_NATIVE(value)->name->length);
+        writeText(">");
+        break;
+    case OBJ_SHAPE:
+        writeText("shape");
+        break;
+    case OBJ_SOCKET:
+        writeText("<socket>");
+        break;
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        writeOutput(AS_STRING(value)->chars, AS_STRING(value)->length);
+        break;
+    case OBJ_STRING_BUILDER:
+    {
+        ObjStringBuilder *builder = AS_STRING_BUILDER(value);
+        writeOutput(builder->chars, builder->length);
+        break;
+    }
+    case OBJ_UPVALUE:
+        writeText("upvalue");
         break;
     }
 }
@@ -79,6 +429,78 @@ void freeObject(Obj *object)
 {
     switch (object->type)
     {
+    case OBJ_BOUND_METHOD:
+        FREE(ObjBoundMethod, object);
+        break;
+    case OBJ_CLASS:
+    {
+        ObjClass *klass = (ObjClass *)object;
+        freeTable(&klass->methods);
+        FREE(ObjClass, klass);
+        break;
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        reallocate(closure, sizeof(ObjClosure) + sizeof(Value) * closure->function->captureCount,
+                   0);
+        break;
+    }
+    case OBJ_CHANNEL:
+        releaseChannel(((ObjChannel *)object)->channel);
+        FREE(ObjChannel, object);
+        break;
+    case OBJ_COROUTINE:
+        freeFiber(&((ObjCoroutine *)object)->fiber);
+        FREE(ObjCoroutine, object);
+        break;
+    case OBJ_FLOAT64_ARRAY:
+    {
+        ObjFloat64Array *array = (ObjFloat64Array *)object;
+        FREE_ARRAY(double, array->values, array->count);
+        FREE(ObjFloat64Array, array);
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        freeChunk(&function->chunk);
+        FREE(ObjFunction, function);
+        break;
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)object;
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+        FREE(ObjInstance, instance);
+        break;
+    }
+    case OBJ_ISOLATE:
+        freeIsolate(((ObjIsolate *)object)->isolate);
+        FREE(ObjIsolate, object);
+        break;
+    case OBJ_LIST:
+        freeValueArray(&((ObjList *)object)->items);
+        FREE(ObjList, object);
+        break;
+    case OBJ_MAP:
+        freeTable(&((ObjMap *)object)->table);
+        FREE(ObjMap, object);
+        break;
+    case OBJ_NATIVE:
+        FREE(ObjNative, object);
+        break;
+    case OBJ_SHAPE:
+    {
+        ObjShape *shape = (ObjShape *)object;
+        FREE_ARRAY(ObjShape *, shape->transitions, shape->transitionCapacity);
+        FREE(ObjShape, shape);
+        break;
+    }
+    case OBJ_SOCKET:
+        freeSocket((ObjSocket *)object);
+        FREE(ObjSocket, object);
+        break;
     case OBJ_STRING:
     {
         ObjString *string = (ObjString *)object;
@@ -86,6 +508,16 @@ void freeObject(Obj *object)
         FREE(ObjString, string);
         break;
     }
+    case OBJ_STRING_BUILDER:
+    {
+        ObjStringBuilder *builder = (ObjStringBuilder *)object;
+        FREE_ARRAY(char, builder->chars, builder->capacity);
+        FREE(ObjStringBuilder, builder);
+        break;
+    }
+    case OBJ_UPVALUE:
+        FREE(ObjUpvalue, object);
+        break;
     }
 }
 
@@ -0,0 +1,1663 @@
+#include <string.h>
+
+#include "optimizer.h"
+#include "object.h"
+#include "memory.h"
+#include "table.h"
+
+// Constant folding and copy propagation. A local that is never assigned
+// after its declaration and is initialized with a constant or with another
+// such local is replaced by its initializer everywhere. Operators are folded
+// only where the VM would not report an error.
+
+static bool isFalseyConstant(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static Node *constantNode(Node *node, Value value)
+{
+    Node *folded = newNode(NODE_CONSTANT, node->line);
+    folded->as.constant = value;
+    return folded;
+}
+
+static ObjString *concatenateConstants(ObjString *a, ObjString *b)
+{
+    int length = a->length + b->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+
+    return takeString(chars, length);
+}
+
+static Node *foldUnary(Node *node)
+{
+    Node *operand = node->as.unary.operand;
+    if (operand->type != NODE_CONSTANT)
+        return node;
+
+    Value value = operand->as.constant;
+    switch (node->as.unary.op)
+    {
+    case TOKEN_MINUS:
+        if (IS_NUMBER(value))
+            return constantNode(node, negateNumber(value));
+        return node;
+    case TOKEN_TILDE:
+        if (IS_INT(value))
+            return constantNode(node, INT_VAL(~AS_INT(value)));
+        return node;
+    case TOKEN_BANG:
+        if (IS_BOOL(value) || IS_NIL(value))
+            return constantNode(node, BOOL_VAL(isFalseyConstant(value)));
+        return node;
+    default:
+        return node;
+    }
+}
+
+static Node *foldBinary(Node *node)
+{
+    Node *left = node->as.binary.left;
+    Node *right = node->as.binary.right;
+    if (left->type != NODE_CONSTANT || right->type != NODE_CONSTANT)
+        return node;
+
+    Value a = left->as.constant;
+    Value b = right->as.constant;
+    switch (node->as.binary.op)
+    {
+    case TOKEN_EQUAL_EQUAL:
+        return constantNode(node, BOOL_VAL(valuesEqual(a, b)));
+    case TOKEN_BANG_EQUAL:
+        return constantNode(node, BOOL_VAL(!valuesEqual(a, b)));
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b))
+            return constantNode(node, OBJ_VAL(concatenateConstants(AS_STRING(a), AS_STRING(b))));
+        break;
+    default:
+        break;
+    }
+
+    if (IS_INT(a) && IS_INT(b))
+    {
+        int64_t x = AS_INT(a);
+        int64_t y = AS_INT(b);
+        int64_t shifted;
+        switch (node->as.binary.op)
+        {
+        case TOKEN_AMPERSAND:
+            return constantNode(node, INT_VAL(x & y));
+        case TOKEN_PIPE:
+            return constantNode(node, INT_VAL(x | y));
+        case TOKEN_CARET:
+            return constantNode(node, INT_VAL(x ^ y));
+        case TOKEN_LESS_LESS:
+        case TOKEN_GREATER_GREATER:
+            if (!shiftInt(x, y, node->as.binary.op == TOKEN_LESS_LESS, &shifted))
+                return node;
+            return constantNode(node, INT_VAL(shifted));
+        default:
+            break;
+        }
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return node;
+
+    switch (node->as.binary.op)
+    {
+    case TOKEN_PLUS:
+        return constantNode(node, addNumbers(a, b));
+    case TOKEN_MINUS:
+        return constantNode(node, subtractNumbers(a, b));
+    case TOKEN_STAR:
+        return constantNode(node, multiplyNumbers(a, b));
+    case TOKEN_SLASH:
+        return constantNode(node, divideNumbers(a, b));
+    case TOKEN_PERCENT:
+        return constantNode(node, moduloNumbers(a, b));
+    case TOKEN_LESS:
+        return constantNode(node, BOOL_VAL(lessNumbers(a, b)));
+    case TOKEN_GREATER:
+        return constantNode(node, BOOL_VAL(greaterNumbers(a, b)));
+    // compiled as the negated comparison, which differs for NaN
+    case TOKEN_LESS_EQUAL:
+        return constantNode(node, BOOL_VAL(!greaterNumbers(a, b)));
+    case TOKEN_GREATER_EQUAL:
+        return constantNode(node, BOOL_VAL(!lessNumbers(a, b)));
+    default:
+        return node;
+    }
+}
+
+static Node *foldLogical(Node *node)
+{
+    Node *left = node->as.binary.left;
+    if (left->type != NODE_CONSTANT)
+        return node;
+
+    // any other condition is a runtime error
+    Value value = left->as.constant;
+    if (!IS_BOOL(value) && !IS_NIL(value))
+        return node;
+
+    bool falsey = isFalseyConstant(value);
+    if (node->as.binary.op == TOKEN_AND)
+        return falsey ? left : node->as.binary.right;
+    return falsey ? node->as.binary.right : left;
+}
+
+// whether a condition is a constant the VM accepts, and which way it goes
+static bool constantCondition(Node *condition, bool *taken)
+{
+    if (condition == NULL || condition->type != NODE_CONSTANT)
+        return false;
+    Value value = condition->as.constant;
+    if (!IS_BOOL(value) && !IS_NIL(value))
+        return false;
+    *taken = !isFalseyConstant(value);
+    return true;
+}
+
+static void propagateStatement(Node **slot);
+
+static void propagateExpression(Node **slot)
+{
+    Node *node = *slot;
+    switch (node->type)
+    {
+    case NODE_CONSTANT:
+    case NODE_GET_GLOBAL:
+        return;
+    case NODE_GET_LOCAL:
+    {
+        Node *copyOf = node->as.local.variable->copyOf;
+        if (copyOf != NULL)
+        {
+            *slot = copyNode(copyOf);
+            (*slot)->line = node->line;
+        }
+        return;
+    }
+    case NODE_SET_LOCAL:
+        propagateExpression(&node->as.local.value);
+        return;
+    case NODE_SET_GLOBAL:
+        propagateExpression(&node->as.global.value);
+        return;
+    case NODE_UNARY:
+        propagateExpression(&node->as.unary.operand);
+        *slot = foldUnary(node);
+        return;
+    case NODE_BINARY:
+        propagateExpression(&node->as.binary.left);
+        propagateExpression(&node->as.binary.right);
+        *slot = foldBinary(node);
+        return;
+    case NODE_LOGICAL:
+        propagateExpression(&node->as.binary.left);
+        propagateExpression(&node->as.binary.right);
+        *slot = foldLogical(node);
+        return;
+    case NODE_CALL:
+        propagateExpression(&node->as.call.callee);
+        for (int i = 0; i < node->as.call.arguments.count; i++)
+        {
+            propagateExpression(&node->as.call.arguments.nodes[i]);
+        }
+        return;
+    case NODE_RESUME:
+        propagateExpression(&node->as.expression);
+        return;
+    case NODE_GET_PROPERTY:
+        propagateExpression(&node->as.property.object);
+        return;
+    case NODE_SET_PROPERTY:
+        propagateExpression(&node->as.property.object);
+        propagateExpression(&node->as.property.value);
+        return;
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            propagateExpression(&node->as.elements.nodes[i]);
+        }
+        return;
+    case NODE_GET_INDEX:
+        propagateExpression(&node->as.subscript.object);
+        propagateExpression(&node->as.subscript.index);
+        return;
+    case NODE_SET_INDEX:
+        propagateExpression(&node->as.subscript.object);
+        propagateExpression(&node->as.subscript.index);
+        propagateExpression(&node->as.subscript.value);
+        return;
+    case NODE_FUNCTION:
+        propagateStatement(&node->as.function.body);
+        return;
+    case NODE_CLASS:
+        for (int i = 0; i < node->as.klass.methods.count; i++)
+        {
+            propagateExpression(&node->as.klass.methods.nodes[i]);
+        }
+        return;
+    default:
+        PANIC("Unreachable code.");
+    }
+}
+
+static void propagateStatement(Node **slot)
+{
+    Node *node = *slot;
+    switch (node->type)
+    {
+    case NODE_PRINT:
+    case NODE_EXPRESSION:
+        propagateExpression(&node->as.expression);
+        return;
+    case NODE_RETURN:
+    case NODE_YIELD:
+        if (node->as.expression != NULL)
+            propagateExpression(&node->as.expression);
+        return;
+    case NODE_DEFINE_GLOBAL:
+        propagateExpression(&node->as.global.value);
+        return;
+    case NODE_VAR:
+    {
+        propagateExpression(&node->as.local.value);
+        Variable *variable = node->as.local.variable;
+        Node *value = node->as.local.value;
+        if (variable->writes == 0 &&
+            (value->type == NODE_CONSTANT ||
+             (value->type == NODE_GET_LOCAL && value->as.local.variable->writes == 0)))
+        {
+            variable->copyOf = value;
+        }
+        return;
+    }
+    case NODE_BLOCK:
+        for (int i = 0; i < node->as.block.count; i++)
+        {
+            propagateStatement(&node->as.block.nodes[i]);
+        }
+        return;
+    case NODE_IF:
+    {
+        propagateExpression(&node->as.branch.condition);
+        propagateStatement(&node->as.branch.thenBranch);
+        if (node->as.branch.elseBranch != NULL)
+            propagateStatement(&node->as.branch.elseBranch);
+
+        bool taken;
+        if (constantCondition(node->as.branch.condition, &taken))
+        {
+            Node *branch = taken ? node->as.branch.thenBranch : node->as.branch.elseBranch;
+            *slot = branch != NULL ? branch : newNode(NODE_BLOCK, node->line);
+        }
+        return;
+    }
+    case NODE_WHILE:
+    {
+        if (node->as.loop.condition != NULL)
+            propagateExpression(&node->as.loop.condition);
+        propagateStatement(&node->as.loop.body);
+
+        bool taken;
+        if (constantCondition(node->as.loop.condition, &taken))
+        {
+            if (taken)
+                node->as.loop.condition = NULL;
+            else
+                *slot = newNode(NODE_BLOCK, node->line);
+        }
+        return;
+    }
+    default:
+        PANIC("Unreachable code.");
+    }
+}
+
+// Dead store elimination. Locals nobody reads are removed together with
+// their stores, keeping only the part of a stored value that may have an
+// effect, and so are stores that the next statement overwrites.
+
+_Thread_local bool changed;
+
+static void countStatement(Node *node);
+
+static void countExpression(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_GET_LOCAL:
+        node->as.local.variable->reads++;
+        return;
+    case NODE_SET_LOCAL:
+        node->as.local.variable->writes++;
+        countExpression(node->as.local.value);
+        return;
+    case NODE_SET_GLOBAL:
+        countExpression(node->as.global.value);
+        return;
+    case NODE_UNARY:
+        countExpression(node->as.unary.operand);
+        return;
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        countExpression(node->as.binary.left);
+        countExpression(node->as.binary.right);
+        return;
+    case NODE_CALL:
+        countExpression(node->as.call.callee);
+        for (int i = 0; i < node->as.call.arguments.count; i++)
+        {
+            countExpression(node->as.call.arguments.nodes[i]);
+        }
+        return;
+    case NODE_RESUME:
+        countExpression(node->as.expression);
+        return;
+    case NODE_GET_PROPERTY:
+        countExpression(node->as.property.object);
+        return;
+    case NODE_SET_PROPERTY:
+        countExpression(node->as.property.object);
+        countExpression(node->as.property.value);
+        return;
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            countExpression(node->as.elements.nodes[i]);
+        }
+        return;
+    case NODE_GET_INDEX:
+        countExpression(node->as.subscript.object);
+        countExpression(node->as.subscript.index);
+        return;
+    case NODE_SET_INDEX:
+        countExpression(node->as.subscript.object);
+        countExpression(node->as.subscript.index);
+        countExpression(node->as.subscript.value);
+        return;
+    case NODE_FUNCTION:
+        countStatement(node->as.function.body);
+        return;
+    case NODE_CLASS:
+        for (int i = 0; i < node->as.klass.methods.count; i++)
+        {
+            countExpression(node->as.klass.methods.nodes[i]);
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+// recount the reads and writes of every local after the tree has changed;
+// a declaration always comes before the uses of its variable
+static void countStatement(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_PRINT:
+    case NODE_EXPRESSION:
+        countExpression(node->as.expression);
+        return;
+    case NODE_RETURN:
+    case NODE_YIELD:
+        if (node->as.expression != NULL)
+            countExpression(node->as.expression);
+        return;
+    case NODE_DEFINE_GLOBAL:
+        countExpression(node->as.global.value);
+        return;
+    case NODE_VAR:
+        node->as.local.variable->reads = 0;
+        node->as.local.variable->writes = 0;
+        countExpression(node->as.local.value);
+        return;
+    case NODE_BLOCK:
+        for (int i = 0; i < node->as.block.count; i++)
+        {
+            countStatement(node->as.block.nodes[i]);
+        }
+        return;
+    case NODE_IF:
+        countExpression(node->as.branch.condition);
+        countStatement(node->as.branch.thenBranch);
+        if (node->as.branch.elseBranch != NULL)
+            countStatement(node->as.branch.elseBranch);
+        return;
+    case NODE_WHILE:
+        if (node->as.loop.condition != NULL)
+            countExpression(node->as.loop.condition);
+        countStatement(node->as.loop.body);
+        return;
+    default:
+        PANIC("Unreachable code.");
+    }
+}
+
+// whether evaluating an expression can neither fail nor change anything
+static bool isPure(Node *node)
+{
+    return node->type == NODE_CONSTANT || node->type == NODE_GET_LOCAL ||
+           node->type == NODE_FUNCTION || node->type == NODE_CLASS;
+}
+
+static bool usesVariable(Node *node, Variable *variable)
+{
+    switch (node->type)
+    {
+    case NODE_GET_LOCAL:
+        return node->as.local.variable == variable;
+    case NODE_SET_LOCAL:
+        return node->as.local.variable == variable ||
+               usesVariable(node->as.local.value, variable);
+    case NODE_SET_GLOBAL:
+        return usesVariable(node->as.global.value, variable);
+    case NODE_UNARY:
+        return usesVariable(node->as.unary.operand, variable);
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        return usesVariable(node->as.binary.left, variable) ||
+               usesVariable(node->as.binary.right, variable);
+    case NODE_CALL:
+        // the callee may be a closure reading the variable
+        if (variable->captured || usesVariable(node->as.call.callee, variable))
+            return true;
+        for (int i = 0; i < node->as.call.arguments.count; i++)
+        {
+            if (usesVariable(node->as.call.arguments.nodes[i], variable))
+                return true;
+        }
+        return false;
+    case NODE_RESUME:
+        // so may the code of the coroutine
+        return variable->captured || usesVariable(node->as.expression, variable);
+    case NODE_GET_PROPERTY:
+        return usesVariable(node->as.property.object, variable);
+    case NODE_SET_PROPERTY:
+        return usesVariable(node->as.property.object, variable) ||
+               usesVariable(node->as.property.value, variable);
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            if (usesVariable(node->as.elements.nodes[i], variable))
+                return true;
+        }
+        return false;
+    case NODE_GET_INDEX:
+    case NODE_SET_INDEX:
+        return usesVariable(node->as.subscript.object, variable) ||
+               usesVariable(node->as.subscript.index, variable) ||
+               (node->type == NODE_SET_INDEX &&
+                usesVariable(node->as.subscript.value, variable));
+    default:
+        // a function body cannot see the locals around it
+        return false;
+    }
+}
+
+// the local an expression statement does nothing but store to
+static Variable *storedVariable(Node *node)
+{
+    if (node->type != NODE_EXPRESSION || node->as.expression->type != NODE_SET_LOCAL)
+        return NULL;
+    return node->as.expression->as.local.variable;
+}
+
+static void eliminateBlock(Node *block);
+
+static void eliminateExpression(Node **slot)
+{
+    Node *node = *slot;
+    switch (node->type)
+    {
+    case NODE_SET_LOCAL:
+        eliminateExpression(&node->as.local.value);
+        if (node->as.local.variable->reads == 0)
+        {
+            *slot = node->as.local.value;
+            changed = true;
+        }
+        return;
+    case NODE_SET_GLOBAL:
+        eliminateExpression(&node->as.global.value);
+        return;
+    case NODE_UNARY:
+        eliminateExpression(&node->as.unary.operand);
+        return;
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        eliminateExpression(&node->as.binary.left);
+        eliminateExpression(&node->as.binary.right);
+        return;
+    case NODE_CALL:
+        eliminateExpression(&node->as.call.callee);
+        for (int i = 0; i < node->as.call.arguments.count; i++)
+        {
+            eliminateExpression(&node->as.call.arguments.nodes[i]);
+        }
+        return;
+    case NODE_RESUME:
+        eliminateExpression(&node->as.expression);
+        return;
+    case NODE_GET_PROPERTY:
+        eliminateExpression(&node->as.property.object);
+        return;
+    case NODE_SET_PROPERTY:
+        eliminateExpression(&node->as.property.object);
+        eliminateExpression(&node->as.property.value);
+        return;
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            eliminateExpression(&node->as.elements.nodes[i]);
+        }
+        return;
+    case NODE_GET_INDEX:
+        eliminateExpression(&node->as.subscript.object);
+        eliminateExpression(&node->as.subscript.index);
+        return;
+    case NODE_SET_INDEX:
+        eliminateExpression(&node->as.subscript.object);
+        eliminateExpression(&node->as.subscript.index);
+        eliminateExpression(&node->as.subscript.value);
+        return;
+    case NODE_FUNCTION:
+        eliminateBlock(node->as.function.body);
+        return;
+    case NODE_CLASS:
+        for (int i = 0; i < node->as.klass.methods.count; i++)
+        {
+            eliminateExpression(&node->as.klass.methods.nodes[i]);
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+static Node *eliminateStatement(Node *node);
+
+// a statement that is not in a block cannot be removed, only emptied
+static Node *eliminateNested(Node *node)
+{
+    Node *statement = eliminateStatement(node);
+    return statement != NULL ? statement : newNode(NODE_BLOCK, node->line);
+}
+
+static void eliminateBlock(Node *block)
+{
+    NodeList *list = &block->as.block;
+    int count = 0;
+    for (int i = 0; i < list->count; i++)
+    {
+        Node *statement = eliminateStatement(list->nodes[i]);
+        if (statement != NULL)
+            list->nodes[count++] = statement;
+        else
+            changed = true;
+    }
+    list->count = count;
+
+    for (int i = 0; i + 1 < list->count; i++)
+    {
+        Node *node = list->nodes[i];
+        Variable *variable = node->type == NODE_VAR ? node->as.local.variable
+                                                    : storedVariable(node);
+        if (variable == NULL || storedVariable(list->nodes[i + 1]) != variable)
+            continue;
+        Node *store = list->nodes[i + 1]->as.expression;
+        if (usesVariable(store->as.local.value, variable))
+            continue;
+
+        if (node->type == NODE_VAR)
+        {
+            // the declaration takes the stored value instead
+            if (!isPure(node->as.local.value))
+                continue;
+            node->as.local.value = store->as.local.value;
+            removeNode(list, i + 1);
+            i--;
+        }
+        else if (isPure(node->as.expression->as.local.value))
+        {
+            removeNode(list, i);
+            i--;
+        }
+        else
+        {
+            node->as.expression = node->as.expression->as.local.value;
+        }
+        changed = true;
+    }
+}
+
+// the statement left after removing dead stores, NULL if nothing is left
+static Node *eliminateStatement(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_PRINT:
+        eliminateExpression(&node->as.expression);
+        return node;
+    case NODE_EXPRESSION:
+        eliminateExpression(&node->as.expression);
+        return isPure(node->as.expression) ? NULL : node;
+    case NODE_RETURN:
+    case NODE_YIELD:
+        if (node->as.expression != NULL)
+            eliminateExpression(&node->as.expression);
+        return node;
+    case NODE_DEFINE_GLOBAL:
+        eliminateExpression(&node->as.global.value);
+        return node;
+    case NODE_VAR:
+    {
+        eliminateExpression(&node->as.local.value);
+        Variable *variable = node->as.local.variable;
+        if (variable->reads > 0)
+            return node;
+
+        variable->eliminated = true;
+        Node *value = node->as.local.value;
+        if (isPure(value))
+            return NULL;
+        Node *statement = newNode(NODE_EXPRESSION, node->line);
+        statement->as.expression = value;
+        return statement;
+    }
+    case NODE_BLOCK:
+        eliminateBlock(node);
+        return node->as.block.count > 0 ? node : NULL;
+    case NODE_IF:
+        eliminateExpression(&node->as.branch.condition);
+        node->as.branch.thenBranch = eliminateNested(node->as.branch.thenBranch);
+        if (node->as.branch.elseBranch != NULL)
+            node->as.branch.elseBranch = eliminateNested(node->as.branch.elseBranch);
+        return node;
+    case NODE_WHILE:
+        if (node->as.loop.condition != NULL)
+            eliminateExpression(&node->as.loop.condition);
+        node->as.loop.body = eliminateNested(node->as.loop.body);
+        return node;
+    default:
+        PANIC("Unreachable code.");
+        return node;
+    }
+}
+
+// Global promotion. A loop keeps the globals it uses in hidden locals while
+// it runs, and stores the ones it assigns back when it exits. Only globals
+// defined earlier in the same script are promoted, so that reading one is
+// never an undefined variable error, and loops that call, return, resume or
+// yield are left alone, since other code may use the globals meanwhile and a
+// return skips the stores.
+
+typedef struct
+{
+    ObjString *name;
+    Variable *local;
+    bool written;
+} Promotion;
+
+typedef struct
+{
+    Promotion *promotions;
+    int count;
+    int capacity;
+} PromotionList;
+
+_Thread_local PromotionList promotions;
+_Thread_local Table definedGlobals;
+_Thread_local bool leavesLoop; // the loop being promoted calls or returns
+
+static Promotion *findPromotion(ObjString *name)
+{
+    for (int i = 0; i < promotions.count; i++)
+    {
+        if (promotions.promotions[i].name == name)
+            return &promotions.promotions[i];
+    }
+    return NULL;
+}
+
+static void addPromotion(ObjString *name, bool written)
+{
+    Value defined;
+    if (!tableGet(&definedGlobals, name, &defined))
+        return;
+
+    Promotion *promotion = findPromotion(name);
+    if (promotion == NULL)
+    {
+        if (promotions.capacity < promotions.count + 1)
+        {
+            int oldCapacity = promotions.capacity;
+            promotions.capacity = GROW_CAPACITY(oldCapacity);
+            promotions.promotions = GROW_ARRAY(Promotion, promotions.promotions, oldCapacity,
+                                               promotions.capacity);
+        }
+        promotion = &promotions.promotions[promotions.count++];
+        promotion->name = name;
+        promotion->local = NULL;
+        promotion->written = false;
+    }
+    promotion->written |= written;
+}
+
+static void collectGlobals(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_CALL:
+    case NODE_RESUME:
+    case NODE_RETURN:
+    case NODE_YIELD:
+        leavesLoop = true;
+        return;
+    case NODE_GET_GLOBAL:
+        addPromotion(node->as.global.name, false);
+        return;
+    case NODE_SET_GLOBAL:
+        collectGlobals(node->as.global.value);
+        addPromotion(node->as.global.name, true);
+        return;
+    case NODE_SET_LOCAL:
+        collectGlobals(node->as.local.value);
+        return;
+    case NODE_GET_PROPERTY:
+        collectGlobals(node->as.property.object);
+        return;
+    case NODE_SET_PROPERTY:
+        collectGlobals(node->as.property.object);
+        collectGlobals(node->as.property.value);
+        return;
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            collectGlobals(node->as.elements.nodes[i]);
+        }
+        return;
+    case NODE_GET_INDEX:
+        collectGlobals(node->as.subscript.object);
+        collectGlobals(node->as.subscript.index);
+        return;
+    case NODE_SET_INDEX:
+        collectGlobals(node->as.subscript.object);
+        collectGlobals(node->as.subscript.index);
+        collectGlobals(node->as.subscript.value);
+        return;
+    case NODE_UNARY:
+        collectGlobals(node->as.unary.operand);
+        return;
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        collectGlobals(node->as.binary.left);
+        collectGlobals(node->as.binary.right);
+        return;
+    case NODE_PRINT:
+    case NODE_EXPRESSION:
+        collectGlobals(node->as.expression);
+        return;
+    case NODE_VAR:
+        collectGlobals(node->as.local.value);
+        return;
+    case NODE_BLOCK:
+        for (int i = 0; i < node->as.block.count; i++)
+        {
+            collectGlobals(node->as.block.nodes[i]);
+        }
+        return;
+    case NODE_IF:
+        collectGlobals(node->as.branch.condition);
+        collectGlobals(node->as.branch.thenBranch);
+        if (node->as.branch.elseBranch != NULL)
+            collectGlobals(node->as.branch.elseBranch);
+        return;
+    case NODE_WHILE:
+        if (node->as.loop.condition != NULL)
+            collectGlobals(node->as.loop.condition);
+        collectGlobals(node->as.loop.body);
+        return;
+    default:
+        return;
+    }
+}
+
+static void replaceGlobals(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_GET_GLOBAL:
+    {
+        Promotion *promotion = findPromotion(node->as.global.name);
+        if (promotion == NULL)
+            return;
+        node->type = NODE_GET_LOCAL;
+        node->as.local.variable = promotion->local;
+        node->as.local.value = NULL;
+        promotion->local->reads++;
+        return;
+    }
+    case NODE_SET_GLOBAL:
+    {
+        replaceGlobals(node->as.global.value);
+        Promotion *promotion = findPromotion(node->as.global.name);
+        if (promotion == NULL)
+            return;
+        Node *value = node->as.global.value;
+        node->type = NODE_SET_LOCAL;
+        node->as.local.variable = promotion->local;
+        node->as.local.value = value;
+        promotion->local->writes++;
+        return;
+    }
+    case NODE_SET_LOCAL:
+        replaceGlobals(node->as.local.value);
+        return;
+    case NODE_GET_PROPERTY:
+        replaceGlobals(node->as.property.object);
+        return;
+    case NODE_SET_PROPERTY:
+        replaceGlobals(node->as.property.object);
+        replaceGlobals(node->as.property.value);
+        return;
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            replaceGlobals(node->as.elements.nodes[i]);
+        }
+        return;
+    case NODE_GET_INDEX:
+        replaceGlobals(node->as.subscript.object);
+        replaceGlobals(node->as.subscript.index);
+        return;
+    case NODE_SET_INDEX:
+        replaceGlobals(node->as.subscript.object);
+        replaceGlobals(node->as.subscript.index);
+        replaceGlobals(node->as.subscript.value);
+        return;
+    case NODE_UNARY:
+        replaceGlobals(node->as.unary.operand);
+        return;
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        replaceGlobals(node->as.binary.left);
+        replaceGlobals(node->as.binary.right);
+        return;
+    case NODE_PRINT:
+    case NODE_EXPRESSION:
+        replaceGlobals(node->as.expression);
+        return;
+    case NODE_VAR:
+        replaceGlobals(node->as.local.value);
+        return;
+    case NODE_BLOCK:
+        for (int i = 0; i < node->as.block.count; i++)
+        {
+            replaceGlobals(node->as.block.nodes[i]);
+        }
+        return;
+    case NODE_IF:
+        replaceGlobals(node->as.branch.condition);
+        replaceGlobals(node->as.branch.thenBranch);
+        if (node->as.branch.elseBranch != NULL)
+            replaceGlobals(node->as.branch.elseBranch);
+        return;
+    case NODE_WHILE:
+        if (node->as.loop.condition != NULL)
+            replaceGlobals(node->as.loop.condition);
+        replaceGlobals(node->as.loop.body);
+        return;
+    default:
+        return;
+    }
+}
+
+// turn the loop at `slot` into a block that loads its globals into hidden
+// locals first, returning whether there was anything to promote
+static bool promoteLoop(Ast *ast, Node **slot)
+{
+    Node *loop = *slot;
+    promotions.count = 0;
+    leavesLoop = false;
+    collectGlobals(loop);
+    if (promotions.count == 0 || leavesLoop)
+        return false;
+
+    Node *block = newNode(NODE_BLOCK, loop->line);
+    for (int i = 0; i < promotions.count; i++)
+    {
+        Promotion *promotion = &promotions.promotions[i];
+        Token name = {TOKEN_IDENTIFIER, "", 0, loop->line};
+        Variable *local = newVariable(ast, name);
+        local->depth = 0;
+        local->hidden = true;
+        promotion->local = local;
+
+        Node *load = newNode(NODE_GET_GLOBAL, loop->line);
+        load->as.global.name = promotion->name;
+        Node *declaration = newNode(NODE_VAR, loop->line);
+        declaration->as.local.variable = local;
+        declaration->as.local.value = load;
+        appendNode(&block->as.block, declaration);
+    }
+
+    replaceGlobals(loop);
+
+    for (int i = 0; i < promotions.count; i++)
+    {
+        Promotion *promotion = &promotions.promotions[i];
+        if (!promotion->written)
+            continue;
+
+        Node *read = newNode(NODE_GET_LOCAL, loop->line);
+        read->as.local.variable = promotion->local;
+        promotion->local->reads++;
+        Node *store = newNode(NODE_SET_GLOBAL, loop->line);
+        store->as.global.name = promotion->name;
+        store->as.global.value = read;
+        appendNode(&loop->as.loop.writeBack, store);
+    }
+
+    appendNode(&block->as.block, loop);
+    *slot = block;
+    return true;
+}
+
+static void promoteStatement(Ast *ast, Node **slot);
+
+// the bodies of a declared function or of the methods of a class
+static void promoteValue(Ast *ast, Node *value)
+{
+    if (value->type == NODE_FUNCTION)
+    {
+        promoteStatement(ast, &value->as.function.body);
+    }
+    else if (value->type == NODE_CLASS)
+    {
+        for (int i = 0; i < value->as.klass.methods.count; i++)
+        {
+            promoteValue(ast, value->as.klass.methods.nodes[i]);
+        }
+    }
+}
+
+// promote in the outermost loops that use any global
+static void promoteStatement(Ast *ast, Node **slot)
+{
+    Node *node = *slot;
+    switch (node->type)
+    {
+    case NODE_DEFINE_GLOBAL:
+        promoteValue(ast, node->as.global.value);
+        return;
+    case NODE_VAR:
+        promoteValue(ast, node->as.local.value);
+        return;
+    case NODE_BLOCK:
+        for (int i = 0; i < node->as.block.count; i++)
+        {
+            promoteStatement(ast, &node->as.block.nodes[i]);
+        }
+        return;
+    case NODE_IF:
+        promoteStatement(ast, &node->as.branch.thenBranch);
+        if (node->as.branch.elseBranch != NULL)
+            promoteStatement(ast, &node->as.branch.elseBranch);
+        return;
+    case NODE_WHILE:
+        if (!promoteLoop(ast, slot))
+            promoteStatement(ast, &node->as.loop.body);
+        return;
+    default:
+        return;
+    }
+}
+
+static void promoteGlobals(Ast *ast)
+{
+    initTable(&definedGlobals);
+    NodeList *statements = &ast->root->as.block;
+    for (int i = 0; i < statements->count; i++)
+    {
+        promoteStatement(ast, &statements->nodes[i]);
+        Node *statement = statements->nodes[i];
+        if (statement->type == NODE_DEFINE_GLOBAL)
+            tableSet(statement->as.global.name, NIL_VAL, &definedGlobals);
+    }
+
+    freeTable(&definedGlobals);
+    FREE_ARRAY(Promotion, promotions.promotions, promotions.capacity);
+    promotions.promotions = NULL;
+    promotions.count = 0;
+    promotions.capacity = 0;
+}
+
+// Common subexpression elimination. Within one statement, an operator tree
+// computed more than once is stored in a hidden local the first time and
+// read from it afterwards. Statements that assign or call anything are
+// skipped, and so is the right operand of `and` and `or`, which may not run.
+
+typedef struct
+{
+    Node **slot;
+    int size;  // nodes in the subtree
+    int end;   // index of the first candidate outside the subtree
+    bool consumed;
+} Candidate;
+
+typedef struct
+{
+    Candidate *candidates;
+    int count;
+    int capacity;
+} CandidateList;
+
+_Thread_local CandidateList candidates;
+
+static bool hasAssignment(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_SET_LOCAL:
+    case NODE_SET_GLOBAL:
+    case NODE_SET_PROPERTY:
+    case NODE_SET_INDEX:
+    case NODE_CALL:
+    case NODE_RESUME:
+        return true;
+    case NODE_GET_PROPERTY:
+        return hasAssignment(node->as.property.object);
+    case NODE_GET_INDEX:
+        return hasAssignment(node->as.subscript.object) ||
+               hasAssignment(node->as.subscript.index);
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            if (hasAssignment(node->as.elements.nodes[i]))
+                return true;
+        }
+        return false;
+    case NODE_UNARY:
+        return hasAssignment(node->as.unary.operand);
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        return hasAssignment(node->as.binary.left) || hasAssignment(node->as.binary.right);
+    default:
+        return false;
+    }
+}
+
+static int countNodes(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_UNARY:
+        return 1 + countNodes(node->as.unary.operand);
+    case NODE_BINARY:
+    case NODE_LOGICAL:
+        return 1 + countNodes(node->as.binary.left) + countNodes(node->as.binary.right);
+    default:
+        return 1;
+    }
+}
+
+static int addCandidate(Node **slot)
+{
+    if (candidates.capacity < candidates.count + 1)
+    {
+        int oldCapacity = candidates.capacity;
+        candidates.capacity = GROW_CAPACITY(oldCapacity);
+        candidates.candidates = GROW_ARRAY(Candidate, candidates.candidates, oldCapacity,
+                                           candidates.capacity);
+    }
+
+    Candidate *candidate = &candidates.candidates[candidates.count];
+    candidate->slot = slot;
+    candidate->consumed = false;
+    return candidates.count++;
+}
+
+// list the operator subtrees in evaluation order, returning the size of the
+// tree at `slot`
+static int collectCandidates(Node **slot)
+{
+    Node *node = *slot;
+    int index;
+    int size;
+    switch (node->type)
+    {
+    case NODE_UNARY:
+        index = addCandidate(slot);
+        size = 1 + collectCandidates(&node->as.unary.operand);
+        break;
+    case NODE_BINARY:
+        index = addCandidate(slot);
+        size = 1 + collectCandidates(&node->as.binary.left);
+        size += collectCandidates(&node->as.binary.right);
+        break;
+    case NODE_LOGICAL:
+        return 1 + collectCandidates(&node->as.binary.left) + countNodes(node->as.binary.right);
+    default:
+        return 1;
+    }
+
+    candidates.candidates[index].size = size;
+    candidates.candidates[index].end = candidates.count;
+    return size;
+}
+
+static void consumeCandidate(Candidate *candidate)
+{
+    for (Candidate *inner = candidate; inner < candidates.candidates + candidate->end; inner++)
+    {
+        inner->consumed = true;
+    }
+}
+
+static bool repeats(Candidate *candidate, Candidate *other)
+{
+    return !other->consumed && other->size == candidate->size &&
+           sameExpression(*other->slot, *candidate->slot);
+}
+
+static void eliminateSubexpressions(Ast *ast, Node **root, NodeList *temps)
+{
+    if (hasAssignment(*root))
+        return;
+
+    candidates.count = 0;
+    collectCandidates(root);
+
+    for (int i = 0; i < candidates.count; i++)
+    {
+        Candidate *candidate = &candidates.candidates[i];
+        if (candidate->consumed)
+            continue;
+
+        int copies = 0;
+        for (int j = candidate->end; j < candidates.count; j++)
+        {
+            if (repeats(candidate, &candidates.candidates[j]))
+                copies++;
+        }
+        // the hidden local costs a push, a store and a pop
+        if (copies * (candidate->size - 1) <= 3)
+            continue;
+
+        Node *node = *candidate->slot;
+        Token name = {TOKEN_IDENTIFIER, "", 0, node->line};
+        Variable *temp = newVariable(ast, name);
+        temp->depth = 0;
+        temp->hidden = true;
+
+        for (int j = candidate->end; j < candidates.count; j++)
+        {
+            Candidate *other = &candidates.candidates[j];
+            if (!repeats(candidate, other))
+                continue;
+
+            Node *read = newNode(NODE_GET_LOCAL, (*other->slot)->line);
+            read->as.local.variable = temp;
+            *other->slot = read;
+            consumeCandidate(other);
+        }
+
+        Node *store = newNode(NODE_SET_LOCAL, node->line);
+        store->as.local.variable = temp;
+        store->as.local.value = node;
+        *candidate->slot = store;
+        consumeCandidate(candidate);
+
+        Node *declaration = newNode(NODE_VAR, node->line);
+        declaration->as.local.variable = temp;
+        declaration->as.local.value = constantNode(node, NIL_VAL);
+        appendNode(temps, declaration);
+    }
+}
+
+static void subexpressionsInStatement(Ast *ast, Node **slot, NodeList *temps);
+
+// hidden locals of a statement that is not in a block need a block of their own
+static void subexpressionsInNested(Ast *ast, Node **slot)
+{
+    NodeList temps = {NULL, 0, 0};
+    subexpressionsInStatement(ast, slot, &temps);
+    if (temps.count == 0)
+        return;
+
+    Node *block = newNode(NODE_BLOCK, (*slot)->line);
+    block->as.block = temps;
+    appendNode(&block->as.block, *slot);
+    *slot = block;
+}
+
+static void subexpressionsInBlock(Ast *ast, Node *block)
+{
+    NodeList *list = &block->as.block;
+    for (int i = 0; i < list->count; i++)
+    {
+        NodeList temps = {NULL, 0, 0};
+        subexpressionsInStatement(ast, &list->nodes[i], &temps);
+        for (int j = 0; j < temps.count; j++)
+        {
+            insertNode(list, i++, temps.nodes[j]);
+        }
+    }
+}
+
+// the initializer of a variable, which may be a function or a class
+static void subexpressionsInValue(Ast *ast, Node **slot, NodeList *temps)
+{
+    Node *value = *slot;
+    if (value->type == NODE_FUNCTION)
+    {
+        subexpressionsInBlock(ast, value->as.function.body);
+    }
+    else if (value->type == NODE_CLASS)
+    {
+        for (int i = 0; i < value->as.klass.methods.count; i++)
+        {
+            subexpressionsInValue(ast, &value->as.klass.methods.nodes[i], temps);
+        }
+    }
+    else
+    {
+        eliminateSubexpressions(ast, slot, temps);
+    }
+}
+
+static void subexpressionsInStatement(Ast *ast, Node **slot, NodeList *temps)
+{
+    Node *node = *slot;
+    switch (node->type)
+    {
+    case NODE_PRINT:
+    case NODE_EXPRESSION:
+        eliminateSubexpressions(ast, &node->as.expression, temps);
+        return;
+    case NODE_RETURN:
+    case NODE_YIELD:
+        if (node->as.expression != NULL)
+            eliminateSubexpressions(ast, &node->as.expression, temps);
+        return;
+    case NODE_DEFINE_GLOBAL:
+        subexpressionsInValue(ast, &node->as.global.value, temps);
+        return;
+    case NODE_VAR:
+        subexpressionsInValue(ast, &node->as.local.value, temps);
+        return;
+    case NODE_BLOCK:
+        subexpressionsInBlock(ast, node);
+        return;
+    case NODE_IF:
+        eliminateSubexpressions(ast, &node->as.branch.condition, temps);
+        subexpressionsInNested(ast, &node->as.branch.thenBranch);
+        if (node->as.branch.elseBranch != NULL)
+            subexpressionsInNested(ast, &node->as.branch.elseBranch);
+        return;
+    case NODE_WHILE:
+        if (node->as.loop.condition != NULL)
+            eliminateSubexpressions(ast, &node->as.loop.condition, temps);
+        subexpressionsInNested(ast, &node->as.loop.body);
+        return;
+    default:
+        PANIC("Unreachable code.");
+    }
+}
+
+void optimize(Ast *ast)
+{
+    // removing a store can leave a local that is never assigned again, and
+    // propagating it can leave a local that is never read
+    do
+    {
+        changed = false;
+        countStatement(ast->root);
+        propagateStatement(&ast->root);
+        countStatement(ast->root);
+        eliminateBlock(ast->root);
+    } while (changed);
+
+    promoteGlobals(ast);
+    subexpressionsInBlock(ast, ast->root);
+    FREE_ARRAY(Candidate, candidates.candidates, candidates.capacity);
+    candidates.candidates = NULL;
+    candidates.count = 0;
+    candidates.capacity = 0;
+}
+
+// Type inference. The types of the locals in scope are tracked through the
+// tree; branches are joined, and a loop is walked again until the types at
+// its head stop changing, so what is recorded for its body holds on every
+// iteration.
+
+typedef struct
+{
+    StaticType *types;
+    int count;
+} TypeSnapshot;
+
+typedef struct
+{
+    StaticType *types; // by variable id
+    Variable **live;
+    int liveCount;
+    int liveCapacity;
+} TypeState;
+
+_Thread_local TypeState typeState;
+
+static StaticType joinType(StaticType a, StaticType b)
+{
+    return a == b ? a : TYPE_ANY;
+}
+
+#define typeOf(variable) typeState.types[(variable)->id]
+
+static TypeSnapshot saveTypes()
+{
+    TypeSnapshot snapshot;
+    snapshot.count = typeState.liveCount;
+    snapshot.types = astAllocate(sizeof(StaticType) * snapshot.count);
+    for (int i = 0; i < snapshot.count; i++)
+    {
+        snapshot.types[i] = typeOf(typeState.live[i]);
+    }
+    return snapshot;
+}
+
+static void restoreTypes(TypeSnapshot *snapshot)
+{
+    for (int i = 0; i < snapshot->count; i++)
+    {
+        typeOf(typeState.live[i]) = snapshot->types[i];
+    }
+}
+
+// merge the types of another control flow path into the current one
+static void joinTypes(TypeSnapshot *snapshot)
+{
+    for (int i = 0; i < snapshot->count; i++)
+    {
+        typeOf(typeState.live[i]) = joinType(typeOf(typeState.live[i]), snapshot->types[i]);
+    }
+}
+
+static bool sameTypes(TypeSnapshot *a, TypeSnapshot *b)
+{
+    return memcmp(a->types, b->types, sizeof(StaticType) * a->count) == 0;
+}
+
+static void addLive(Variable *variable, StaticType type)
+{
+    if (typeState.liveCapacity < typeState.liveCount + 1)
+    {
+        int oldCapacity = typeState.liveCapacity;
+        typeState.liveCapacity = GROW_CAPACITY(oldCapacity);
+        typeState.live = GROW_ARRAY(Variable *, typeState.live, oldCapacity,
+                                    typeState.liveCapacity);
+    }
+    typeState.live[typeState.liveCount++] = variable;
+    typeOf(variable) = type;
+}
+
+static void inferStatement(Node *node);
+
+static StaticType inferExpression(Node *node)
+{
+    StaticType type;
+    switch (node->type)
+    {
+    case NODE_CONSTANT:
+    {
+        Value value = node->as.constant;
+        type = IS_NIL(value)      ? TYPE_NIL
+               : IS_BOOL(value)   ? TYPE_BOOL
+               : IS_NUMBER(value) ? TYPE_NUMBER
+               : IS_STRING(value) ? TYPE_STRING
+                                  : TYPE_ANY;
+        break;
+    }
+    case NODE_UNARY:
+        inferExpression(node->as.unary.operand);
+        type = node->as.unary.op == TOKEN_BANG ? TYPE_BOOL : TYPE_NUMBER;
+        break;
+    case NODE_BINARY:
+    {
+        StaticType left = inferExpression(node->as.binary.left);
+        StaticType right = inferExpression(node->as.binary.right);
+        switch (node->as.binary.op)
+        {
+        // a checked arithmetic instruction either errors or produces a number
+        case TOKEN_PLUS:
+            type = TYPE_NUMBER;
+            if (left != TYPE_NUMBER && right != TYPE_NUMBER)
+                type = left == TYPE_STRING || right == TYPE_STRING ? TYPE_STRING : TYPE_ANY;
+            break;
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+        case TOKEN_PERCENT:
+        case TOKEN_AMPERSAND:
+        case TOKEN_PIPE:
+        case TOKEN_CARET:
+        case TOKEN_LESS_LESS:
+        case TOKEN_GREATER_GREATER:
+            type = TYPE_NUMBER;
+            break;
+        default:
+            type = TYPE_BOOL;
+            break;
+        }
+        break;
+    }
+    case NODE_LOGICAL:
+    {
+        StaticType left = inferExpression(node->as.binary.left);
+        TypeSnapshot skipped = saveTypes();
+        type = joinType(left, inferExpression(node->as.binary.right));
+        joinTypes(&skipped);
+        break;
+    }
+    case NODE_GET_LOCAL:
+    {
+        // any call may assign a variable shared with a closure
+        Variable *variable = node->as.local.variable;
+        type = variable->captured && variable->writes > 0 ? TYPE_ANY : typeOf(variable);
+        break;
+    }
+    case NODE_SET_LOCAL:
+        type = inferExpression(node->as.local.value);
+        typeOf(node->as.local.variable) = type;
+        break;
+    case NODE_GET_GLOBAL:
+        type = TYPE_ANY;
+        break;
+    case NODE_SET_GLOBAL:
+        type = inferExpression(node->as.global.value);
+        break;
+    case NODE_CALL:
+        inferExpression(node->as.call.callee);
+        for (int i = 0; i < node->as.call.arguments.count; i++)
+        {
+            inferExpression(node->as.call.arguments.nodes[i]);
+        }
+        type = TYPE_ANY;
+        break;
+    case NODE_RESUME:
+        inferExpression(node->as.expression);
+        type = TYPE_ANY;
+        break;
+    case NODE_GET_PROPERTY:
+        inferExpression(node->as.property.object);
+        type = TYPE_ANY;
+        break;
+    case NODE_SET_PROPERTY:
+        inferExpression(node->as.property.object);
+        type = inferExpression(node->as.property.value);
+        break;
+    case NODE_LIST:
+    case NODE_MAP:
+        for (int i = 0; i < node->as.elements.count; i++)
+        {
+            inferExpression(node->as.elements.nodes[i]);
+        }
+        type = TYPE_ANY;
+        break;
+    case NODE_GET_INDEX:
+        inferExpression(node->as.subscript.object);
+        inferExpression(node->as.subscript.index);
+        type = TYPE_ANY;
+        break;
+    case NODE_SET_INDEX:
+        inferExpression(node->as.subscript.object);
+        inferExpression(node->as.subscript.index);
+        type = inferExpression(node->as.subscript.value);
+        break;
+    case NODE_FUNCTION:
+    {
+        // nothing is known about the receiver and the arguments
+        int liveCount = typeState.liveCount;
+        if (node->as.function.receiver != NULL)
+            addLive(node->as.function.receiver, TYPE_ANY);
+        for (int i = 0; i < node->as.function.arity; i++)
+        {
+            addLive(node->as.function.parameters[i], TYPE_ANY);
+        }
+        inferStatement(node->as.function.body);
+        typeState.liveCount = liveCount;
+        type = TYPE_ANY;
+        break;
+    }
+    case NODE_CLASS:
+        for (int i = 0; i < node->as.klass.methods.count; i++)
+        {
+            inferExpression(node->as.klass.methods.nodes[i]);
+        }
+        type = TYPE_ANY;
+        break;
+    default:
+        PANIC("Unreachable code.");
+        type = TYPE_ANY;
+    }
+
+    node->staticType = type;
+    return type;
+}
+
+static void inferStatement(Node *node)
+{
+    switch (node->type)
+    {
+    case NODE_PRINT:
+    case NODE_EXPRESSION:
+        inferExpression(node->as.expression);
+        return;
+    case NODE_DEFINE_GLOBAL:
+        inferExpression(node->as.global.value);
+        return;
+    case NODE_VAR:
+    {
+        // a function or a class may refer to itself, before it is defined
+        Node *value = node->as.local.value;
+        if (value->type == NODE_FUNCTION || value->type == NODE_CLASS)
+        {
+            addLive(node->as.local.variable, TYPE_ANY);
+            inferExpression(value);
+        }
+        else
+        {
+            addLive(node->as.local.variable, inferExpression(value));
+        }
+        return;
+    }
+    case NODE_RETURN:
+    case NODE_YIELD:
+        if (node->as.expression != NULL)
+            inferExpression(node->as.expression);
+        return;
+    case NODE_BLOCK:
+    {
+        int liveCount = typeState.liveCount;
+        for (int i = 0; i < node->as.block.count; i++)
+        {
+            inferStatement(node->as.block.nodes[i]);
+        }
+        typeState.liveCount = liveCount;
+        return;
+    }
+    case NODE_IF:
+    {
+        inferExpression(node->as.branch.condition);
+        TypeSnapshot condition = saveTypes();
+        inferStatement(node->as.branch.thenBranch);
+        TypeSnapshot then = saveTypes();
+        restoreTypes(&condition);
+        if (node->as.branch.elseBranch != NULL)
+            inferStatement(node->as.branch.elseBranch);
+        joinTypes(&then);
+        return;
+    }
+    case NODE_WHILE:
+    {
+        TypeSnapshot entry = saveTypes();
+        for (;;)
+        {
+            if (node->as.loop.condition != NULL)
+                inferExpression(node->as.loop.condition);
+            TypeSnapshot exit = saveTypes();
+            inferStatement(node->as.loop.body);
+
+            joinTypes(&entry);
+            TypeSnapshot head = saveTypes();
+            if (sameTypes(&head, &entry))
+            {
+                restoreTypes(&exit);
+                for (int i = 0; i < node->as.loop.writeBack.count; i++)
+                {
+                    inferExpression(node->as.loop.writeBack.nodes[i]);
+                }
+                return;
+            }
+            entry = head;
+        }
+    }
+    default:
+        PANIC("Unreachable code.");
+    }
+}
+
+void inferTypes(Ast *ast)
+{
+    typeState.types = ALLOCATE(StaticType, ast->variableCount);
+    for (int i = 0; i < ast->variableCount; i++)
+    {
+        typeState.types[i] = TYPE_ANY;
+    }
+    typeState.live = NULL;
+    typeState.liveCount = 0;
+    typeState.liveCapacity = 0;
+
+    inferStatement(ast->root);
+
+    FREE_ARRAY(StaticType, typeState.types, ast->variableCount);
+    FREE_ARRAY(Variable *, typeState.live, typeState.liveCapacity);
+}
+
+#undef typeOf
@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "output.h"
+#include "vm.h"
+
+// write all of the pieces, however many calls it takes
+static void writeAll(int fd, struct iovec *pieces, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, pieces, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                struct pollfd writable = {.fd = fd, .events = POLLOUT};
+                poll(&writable, 1, -1);
+                continue;
+            }
+            // the output has nowhere to go, as when a pipe is closed
+            return;
+        }
+        while (count > 0 && (size_t)written >= pieces->iov_len)
+        {
+            written -= pieces->iov_len;
+            pieces++;
+            count--;
+        }
+        if (count > 0)
+        {
+            pieces->iov_base = (char *)pieces->iov_base + written;
+            pieces->iov_len -= written;
+        }
+    }
+}
+
+static void appendMemory(Output *output, const char *chars, size_t length)
+{
+    if (output->memoryLength + length > output->memoryCapacity)
+    {
+        size_t capacity = output->memoryCapacity;
+        while (output->memoryLength + length > capacity)
+            capacity = GROW_CAPACITY(capacity);
+        output->memory = (char *)reallocate(output->memory, output->memoryCapacity, capacity);
+        output->memoryCapacity = capacity;
+    }
+    memcpy(output->memory + output->memoryLength, chars, length);
+    output->memoryLength += length;
+}
+
+static void deliver(struct iovec *pieces, int count)
+{
+    Output *output = &vm.output;
+    switch (output->sink)
+    {
+    case SINK_FD:
+        // what was printed through stdio, like the disassembler's output,
+        // comes first
+        if (output->fd == STDOUT_FILENO)
+            fflush(stdout);
+        writeAll(output->fd, pieces, count);
+        return;
+    case SINK_MEMORY:
+        for (int i = 0; i < count; i++)
+            appendMemory(output, pieces[i].iov_base, pieces[i].iov_len);
+        return;
+    case SINK_CALLBACK:
+        for (int i = 0; i < count; i++)
+        {
+            if (pieces[i].iov_len > 0)
+                output->callback(pieces[i].iov_base, pieces[i].iov_len, output->context);
+        }
+        return;
+    }
+}
+
+void initOutput()
+{
+    Output *output = &vm.output;
+    output->sink = SINK_FD;
+    output->fd = STDOUT_FILENO;
+    output->memory = NULL;
+    output->memoryLength = 0;
+    output->memoryCapacity = 0;
+    output->callback = NULL;
+    output->context = NULL;
+    output->unbuffered = isatty(STDOUT_FILENO);
+    output->length = 0;
+}
+
+void freeOutput()
+{
+    flushOutput();
+    Output *output = &vm.output;
+    reallocate(output->memory, output->memoryCapacity, 0);
+    output->memory = NULL;
+    output->memoryLength = 0;
+    output->memoryCapacity = 0;
+}
+
+void writeOutput(const char *chars, size_t length)
+{
+    // an empty string builder has no characters at all
+    if (length == 0)
+        return;
+    Output *output = &vm.output;
+    if (length <= OUTPUT_BUFFER_SIZE - output->length)
+    {
+        memcpy(output->chars + output->length, chars, length);
+        output->length += length;
+        return;
+    }
+
+    // what doesn't fit goes out along with the buffer, without being copied
+    struct iovec pieces[2] = {
+        {.iov_base = output->chars, .iov_len = output->length},
+        {.iov_base = (void *)chars, .iov_len = length},
+    };
+    deliver(pieces, 2);
+    output->length = 0;
+}
+
+void endLine()
+{
+    Output *output = &vm.output;
+    if (output->length < OUTPUT_BUFFER_SIZE)
+        output->chars[output->length++] = '\n';
+    else
+        writeOutput("\n", 1);
+    if (output->unbuffered)
+        flushOutput();
+}
+
+void flushOutput()
+{
+    Output *output = &vm.output;
+    if (output->length == 0)
+        return;
+    struct iovec piece = {.iov_base = output->chars, .iov_len = output->length};
+    deliver(&piece, 1);
+    output->length = 0;
+}
+
+void outputToFd(int fd)
+{
+    flushOutput();
+    vm.output.sink = SINK_FD;
+    vm.output.fd = fd;
+}
+
+void outputToMemory()
+{
+    flushOutput();
+    vm.output.sink = SINK_MEMORY;
+}
+
+void outputToCallback(OutputFn callback, void *context)
+{
+    flushOutput();
+    vm.output.sink = SINK_CALLBACK;
+    vm.output.callback = callback;
+    vm.output.context = context;
+}
+
+const char *outputMemory(size_t *length)
+{
+    flushOutput();
+    *length = vm.output.memoryLength;
+    return vm.output.memory;
+}
@@ -0,0 +1,965 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "object.h"
+
+typedef struct
+{
+    Token previous;
+    Token current;
+    bool hadError;
+    bool panicMode;
+} Parser;
+
+typedef enum
+{
+    PREC_NONE,
+    PREC_ASSIGNMENT, // =
+    PREC_OR,         // or
+    PREC_AND,        // and
+    PREC_EQUALITY,   // == !=
+    PREC_COMPARISON, // < > <= >=
+    PREC_BIT_OR,     // |
+    PREC_BIT_XOR,    // ^
+    PREC_BIT_AND,    // &
+    PREC_SHIFT,      // << >>
+    PREC_TERM,       // + -
+    PREC_FACTOR,     // * / %
+    PREC_UNARY,      // ! - ~
+    PREC_CALL,       // . ()
+    PREC_PRIMARY
+} Precedence;
+
+typedef Node *(*PrefixFn)(bool canAssign);
+typedef Node *(*InfixFn)(Node *left, bool canAssign);
+
+typedef struct
+{
+    PrefixFn prefix;
+    InfixFn infix;
+    Precedence precedence;
+} ParseRule;
+
+// the locals of the function being parsed visible at the current point of
+// the parse
+typedef struct Scope
+{
+    struct Scope *enclosing;
+    Variable *receiver; // `this` when parsing a method
+    bool initializer;   // the method is init(), which always returns `this`
+    Variable **locals;
+    int localCount;
+    int capacity;
+    int scopeDepth;
+} Scope;
+
+static Node *grouping(bool canAssign);
+static Node *unary(bool canAssign);
+static Node *binary(Node *left, bool canAssign);
+static Node *number(bool canAssign);
+static Node *literal(bool canAssign);
+static Node *string(bool canAssign);
+static Node *statement();
+static Node *declaration();
+static Node *variable(bool canAssign);
+static Node *and_(Node *left, bool canAssign);
+static Node *or_(Node *left, bool canAssign);
+static Node *call(Node *left, bool canAssign);
+static Node *dot(Node *left, bool canAssign);
+static Node *list(bool canAssign);
+static Node *map(bool canAssign);
+static Node *subscript(Node *left, bool canAssign);
+static Node *this_(bool canAssign);
+static Node *coroutine(bool canAssign);
+static Node *resume(bool canAssign);
+
+ParseRule rules[] = {
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
+    [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
+    [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
+    [TOKEN_MINUS] = {unary, binary, PREC_TERM},
+    [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
+    [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_PERCENT] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_AMPERSAND] = {NULL, binary, PREC_BIT_AND},
+    [TOKEN_PIPE] = {NULL, binary, PREC_BIT_OR},
+    [TOKEN_CARET] = {NULL, binary, PREC_BIT_XOR},
+    [TOKEN_TILDE] = {unary, NULL, PREC_NONE},
+    [TOKEN_BANG] = {unary, NULL, PREC_NONE},
+    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
+    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_LESS] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
+    [TOKEN_STRING] = {string, NULL, PREC_NONE},
+    [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
+    [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COROUTINE] = {coroutine, NULL, PREC_NONE},
+    [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
+    [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_NIL] = {literal, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
+    [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_RESUME] = {resume, NULL, PREC_NONE},
+    [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
+    [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
+    [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_YIELD] = {NULL, NULL, PREC_NONE},
+    [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
+};
+
+_Thread_local Parser parser;
+_Thread_local Scope *current = NULL;
+_Thread_local int classDepth; // of the class declarations being parsed
+_Thread_local Ast *parsingAst;
+
+void errorAt(Token *token, const char *message)
+{
+    if (parser.panicMode)
+        return;
+    parser.panicMode = true;
+    fprintf(stderr, "[\x1b[32mLine %d\x1b[0m] \x1b[31mError\x1b[0m: ", token->line);
+
+    if (token->type == TOKEN_EOF)
+    {
+        fprintf(stderr, "at end");
+    }
+    else if (token->type == TOKEN_ERROR)
+    {
+        // nothing
+    }
+    else
+    {
+        fprintf(stderr, "at '%.*s'", (int)token->length, token->start);
+    }
+
+    fprintf(stderr, ": %s\n", message);
+    parser.hadError = true;
+}
+
+void errorAtCurrent(const char *message)
+{
+    errorAt(&parser.current, message);
+}
+
+void error(const char *message)
+{
+    errorAt(&parser.previous, message);
+}
+
+static void advance()
+{
+    parser.previous = parser.current;
+    for (;;)
+    {
+        parser.current = scanToken();
+
+        if (parser.current.type != TOKEN_ERROR)
+            break;
+
+        errorAtCurrent(parser.current.start);
+    }
+}
+
+void consume(TokenType type, const char *message)
+{
+    if (parser.current.type == type)
+    {
+        advance();
+        return;
+    }
+
+    errorAtCurrent(message);
+}
+
+#define CHECK(type_) (parser.current.type == type_)
+
+static bool match(TokenType type)
+{
+    if (!CHECK(type))
+        return false;
+
+    advance();
+    return true;
+}
+
+#define getRule(type) (&rules[type])
+#define beginScope() current->scopeDepth++
+#define previousNode(type) newNode(type, parser.previous.line)
+
+static Node *constantNode(Value value)
+{
+    Node *node = previousNode(NODE_CONSTANT);
+    node->as.constant = value;
+    return node;
+}
+
+static void endScope()
+{
+    current->scopeDepth--;
+
+    while (current->localCount > 0 &&
+           current->locals[current->localCount - 1]->depth > current->scopeDepth)
+    {
+        current->localCount--;
+    }
+}
+
+static void initScope(Scope *scope)
+{
+    scope->enclosing = current;
+    scope->receiver = NULL;
+    scope->initializer = false;
+    scope->scopeDepth = 0;
+    scope->capacity = 256;
+    scope->localCount = 0;
+    scope->locals = GROW_ARRAY(Variable *, NULL, 0, 256);
+    current = scope;
+}
+
+static void freeScope(Scope *scope)
+{
+    FREE_ARRAY(Variable *, scope->locals, scope->capacity);
+    current = scope->enclosing;
+}
+
+static Node *parsePrecedence(Precedence precedence)
+{
+    advance();
+    PrefixFn prefixRule = getRule(parser.previous.type)->prefix;
+
+    if (prefixRule == NULL)
+    {
+        error("Expect expression.");
+        return constantNode(NIL_VAL);
+    }
+
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    Node *node = prefixRule(canAssign);
+
+    while (precedence <= getRule(parser.current.type)->precedence)
+    {
+        advance();
+        InfixFn infixRule = getRule(parser.previous.type)->infix;
+
+        node = infixRule(node, canAssign);
+    }
+
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        error("Invalid assignment target.");
+    }
+    return node;
+}
+
+#define expression() parsePrecedence(PREC_ASSIGNMENT)
+
+static Node *block()
+{
+    Node *node = previousNode(NODE_BLOCK);
+    while (!CHECK(TOKEN_RIGHT_BRACE) && !CHECK(TOKEN_EOF))
+    {
+        appendNode(&node->as.block, declaration());
+    }
+
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    return node;
+}
+
+static bool identifiersEqual(Token *a, Token *b)
+{
+    if (a->length != b->length)
+        return false;
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+static Variable *resolveLocal(Scope *scope, Token *name)
+{
+    for (int i = scope->localCount - 1; i >= 0; i--)
+    {
+        Variable *local = scope->locals[i];
+        if (identifiersEqual(name, &local->name))
+        {
+            if (local->depth == -1)
+            {
+                error("Can't read local variable in its own initializer.");
+            }
+            return local;
+        }
+    }
+    return NULL;
+}
+
+// a local of one of the functions the current one is declared in
+static Variable *resolveCaptured(Scope *scope, Token *name)
+{
+    for (Scope *enclosing = scope->enclosing; enclosing != NULL; enclosing = enclosing->enclosing)
+    {
+        Variable *local = resolveLocal(enclosing, name);
+        if (local != NULL)
+        {
+            local->captured = true;
+            return local;
+        }
+    }
+    return NULL;
+}
+
+static Variable *addLocal(Token name)
+{
+    if (current->localCount >= MAX_LOCAL)
+    {
+        error("Too many local variables in function.");
+    }
+    if (current->localCount + 1 > current->capacity)
+    {
+        int oldCapacity = current->capacity;
+        current->capacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Variable *, current->locals, oldCapacity, current->capacity);
+    }
+
+    Variable *local = newVariable(parsingAst, name);
+    current->locals[current->localCount++] = local;
+    return local;
+}
+
+static Variable *declareVariable()
+{
+    Token *name = &parser.previous;
+    for (int i = current->localCount - 1; i >= 0; i--)
+    {
+        Variable *local = current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth)
+            break;
+
+        if (identifiersEqual(name, &local->name))
+            error("Already have a variable with this name in this scope.");
+    }
+
+    return addLocal(*name);
+}
+
+static Node *and_(Node *left, bool canAssign)
+{
+    Node *node = previousNode(NODE_LOGICAL);
+    node->as.binary.op = TOKEN_AND;
+    node->as.binary.left = left;
+    node->as.binary.right = parsePrecedence(PREC_AND);
+    return node;
+}
+
+static Node *or_(Node *left, bool canAssign)
+{
+    Node *node = previousNode(NODE_LOGICAL);
+    node->as.binary.op = TOKEN_OR;
+    node->as.binary.left = left;
+    node->as.binary.right = parsePrecedence(PREC_OR);
+    return node;
+}
+
+static void synchronize()
+{
+    parser.panicMode = false;
+
+    while (parser.current.type != TOKEN_EOF)
+    {
+        if (parser.previous.type == TOKEN_SEMICOLON)
+            return;
+        switch (parser.current.type)
+        {
+        case TOKEN_CLASS:
+        case TOKEN_FUN:
+        case TOKEN_VAR:
+        case TOKEN_FOR:
+        case TOKEN_IF:
+        case TOKEN_WHILE:
+        case TOKEN_PRINT:
+        case TOKEN_RETURN:
+        case TOKEN_YIELD:
+            return;
+        default:;
+        }
+
+        advance();
+    }
+}
+
+static Node *printStatement()
+{
+    Node *node = previousNode(NODE_PRINT);
+    node->as.expression = expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after value in print statement.");
+    return node;
+}
+
+static Node *expressionStatement()
+{
+    Node *node = newNode(NODE_EXPRESSION, parser.current.line);
+    node->as.expression = expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after value in expression statement.");
+    return node;
+}
+
+static Node *ifStatement()
+{
+    Node *node = previousNode(NODE_IF);
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    node->as.branch.condition = expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+
+    node->as.branch.thenBranch = statement();
+    if (match(TOKEN_ELSE))
+        node->as.branch.elseBranch = statement();
+    return node;
+}
+
+static Node *whileStatement()
+{
+    Node *node = previousNode(NODE_WHILE);
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    node->as.loop.condition = expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    node->as.loop.body = statement();
+    return node;
+}
+
+// a read of `this` in the method being parsed
+static Node *receiverNode(int line)
+{
+    Node *node = newNode(NODE_GET_LOCAL, line);
+    node->as.local.variable = current->receiver;
+    current->receiver->reads++;
+    return node;
+}
+
+// a yield suspends whichever coroutine is running, which is only known when
+// the function is called
+static Node *yieldStatement()
+{
+    Node *node = previousNode(NODE_YIELD);
+    if (current->enclosing == NULL)
+        error("Can't yield from top-level code.");
+
+    if (!match(TOKEN_SEMICOLON))
+    {
+        node->as.expression = expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after yielded value.");
+    }
+    return node;
+}
+
+static Node *returnStatement()
+{
+    Node *node = previousNode(NODE_RETURN);
+    if (current->enclosing == NULL)
+        error("Can't return from top-level code.");
+
+    if (!match(TOKEN_SEMICOLON))
+    {
+        if (current->initializer)
+            error("Can't return a value from an initializer.");
+        node->as.expression = expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    }
+    else if (current->initializer)
+    {
+        node->as.expression = receiverNode(node->line);
+    }
+    return node;
+}
+
+// the declaration of a local, or of a global when `local` is NULL
+static Node *defineVariable(Token name, Variable *local, Node *value)
+{
+    Node *node;
+    if (local != NULL)
+    {
+        local->depth = current->scopeDepth;
+        node = newNode(NODE_VAR, name.line);
+        node->as.local.variable = local;
+        node->as.local.value = value;
+    }
+    else
+    {
+        node = newNode(NODE_DEFINE_GLOBAL, name.line);
+        node->as.global.name = copyString(name.start, name.length);
+        node->as.global.value = value;
+    }
+    return node;
+}
+
+static Node *varDeclaration()
+{
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    Token name = parser.previous;
+    Variable *local = current->scopeDepth > 0 ? declareVariable() : NULL;
+
+    Node *value = match(TOKEN_EQUAL) ? expression() : constantNode(NIL_VAL);
+    consume(TOKEN_SEMICOLON, "Expect ';' after var declaration.");
+    return defineVariable(name, local, value);
+}
+
+// The body of a function is parsed with a scope of its own, whose first
+// locals are the parameters, after `this` in a method.
+static Node *function(Token name, bool method)
+{
+    Node *node = previousNode(NODE_FUNCTION);
+    node->as.function.name = copyString(name.start, name.length);
+    Scope scope;
+    initScope(&scope);
+    beginScope();
+    if (method)
+    {
+        Token receiver = {TOKEN_THIS, "this", 4, name.line};
+        current->receiver = addLocal(receiver);
+        current->receiver->depth = current->scopeDepth;
+        current->initializer = name.length == 4 && memcmp(name.start, "init", 4) == 0;
+        node->as.function.receiver = current->receiver;
+    }
+    int receivers = method ? 1 : 0;
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    int arity = 0;
+    if (!CHECK(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            if (++arity > 255)
+                errorAtCurrent("Can't have more than 255 parameters.");
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+            declareVariable()->depth = current->scopeDepth;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+
+    node->as.function.arity = current->localCount - receivers;
+    node->as.function.parameters = astAllocate(sizeof(Variable *) * node->as.function.arity);
+    memcpy(node->as.function.parameters, current->locals + receivers,
+           sizeof(Variable *) * node->as.function.arity);
+
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    node->as.function.body = block();
+    if (current->initializer)
+    {
+        Node *implicitReturn = previousNode(NODE_RETURN);
+        implicitReturn->as.expression = receiverNode(parser.previous.line);
+        appendNode(&node->as.function.body->as.block, implicitReturn);
+    }
+
+    freeScope(&scope);
+    return node;
+}
+
+static Node *funDeclaration()
+{
+    consume(TOKEN_IDENTIFIER, "Expect function name.");
+    Token name = parser.previous;
+    Variable *local = current->scopeDepth > 0 ? declareVariable() : NULL;
+    if (local != NULL)
+        local->depth = current->scopeDepth;
+
+    Node *value = function(name, false);
+    return defineVariable(name, local, value);
+}
+
+static Node *classDeclaration()
+{
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    Token name = parser.previous;
+    Variable *local = current->scopeDepth > 0 ? declareVariable() : NULL;
+    // the methods may refer to the class
+    if (local != NULL)
+        local->depth = current->scopeDepth;
+
+    Node *node = previousNode(NODE_CLASS);
+    node->as.klass.name = copyString(name.start, name.length);
+    classDepth++;
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!CHECK(TOKEN_RIGHT_BRACE) && !CHECK(TOKEN_EOF))
+    {
+        consume(TOKEN_IDENTIFIER, "Expect method name.");
+        appendNode(&node->as.klass.methods, function(parser.previous, true));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    classDepth--;
+    return defineVariable(name, local, node);
+}
+
+// A for loop is desugared into a block holding the initializer and a while
+// loop whose body runs the increment after the original body.
+static Node *forStatement()
+{
+    Node *node = previousNode(NODE_BLOCK);
+    Node *loop = previousNode(NODE_WHILE);
+    beginScope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(TOKEN_SEMICOLON))
+    {
+        // No initializer
+    }
+    else if (match(TOKEN_VAR))
+    {
+        appendNode(&node->as.block, varDeclaration());
+    }
+    else
+    {
+        appendNode(&node->as.block, expressionStatement());
+    }
+
+    if (!match(TOKEN_SEMICOLON))
+    {
+        loop->as.loop.condition = expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    }
+
+    Node *increment = NULL;
+    if (!match(TOKEN_RIGHT_PAREN))
+    {
+        increment = newNode(NODE_EXPRESSION, parser.current.line);
+        increment->as.expression = expression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after clauses.");
+    }
+
+    loop->as.loop.body = statement();
+    if (increment != NULL)
+    {
+        Node *body = newNode(NODE_BLOCK, loop->as.loop.body->line);
+        appendNode(&body->as.block, loop->as.loop.body);
+        appendNode(&body->as.block, increment);
+        loop->as.loop.body = body;
+    }
+    appendNode(&node->as.block, loop);
+
+    endScope();
+    return node;
+}
+
+static Node *declaration()
+{
+    Node *node;
+    if (match(TOKEN_CLASS))
+    {
+        node = classDeclaration();
+    }
+    else if (match(TOKEN_FUN))
+    {
+        node = funDeclaration();
+    }
+    else if (match(TOKEN_VAR))
+    {
+        node = varDeclaration();
+    }
+    else
+    {
+        node = statement();
+    }
+
+    if (parser.panicMode)
+        synchronize();
+    return node;
+}
+
+static Node *statement()
+{
+    if (match(TOKEN_PRINT))
+    {
+        return printStatement();
+    }
+    else if (match(TOKEN_LEFT_BRACE))
+    {
+        beginScope();
+        Node *node = block();
+        endScope();
+        return node;
+    }
+    else if (match(TOKEN_IF))
+    {
+        return ifStatement();
+    }
+    else if (match(TOKEN_WHILE))
+    {
+        return whileStatement();
+    }
+    else if (match(TOKEN_FOR))
+    {
+        return forStatement();
+    }
+    else if (match(TOKEN_RETURN))
+    {
+        return returnStatement();
+    }
+    else if (match(TOKEN_YIELD))
+    {
+        return yieldStatement();
+    }
+    else
+    {
+        return expressionStatement();
+    }
+}
+
+static Node *binary(Node *left, bool canAssign)
+{
+    Node *node = previousNode(NODE_BINARY);
+    node->as.binary.op = parser.previous.type;
+    node->as.binary.left = left;
+    ParseRule *rule = getRule(node->as.binary.op);
+    node->as.binary.right = parsePrecedence((Precedence)((int)rule->precedence + 1));
+    return node;
+}
+
+static Node *call(Node *left, bool canAssign)
+{
+    Node *node = previousNode(NODE_CALL);
+    node->as.call.callee = left;
+    if (!CHECK(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            if (node->as.call.arguments.count == 255)
+                error("Can't have more than 255 arguments.");
+            appendNode(&node->as.call.arguments, expression());
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return node;
+}
+
+static Node *dot(Node *left, bool canAssign)
+{
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    Node *node = previousNode(NODE_GET_PROPERTY);
+    node->as.property.object = left;
+    node->as.property.name = copyString(parser.previous.start, parser.previous.length);
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        node->type = NODE_SET_PROPERTY;
+        node->as.property.value = expression();
+    }
+    return node;
+}
+
+static Node *subscript(Node *left, bool canAssign)
+{
+    Node *node = previousNode(NODE_GET_INDEX);
+    node->as.subscript.object = left;
+    node->as.subscript.index = expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        node->type = NODE_SET_INDEX;
+        node->as.subscript.value = expression();
+    }
+    return node;
+}
+
+static Node *list(bool canAssign)
+{
+    Node *node = previousNode(NODE_LIST);
+    if (!CHECK(TOKEN_RIGHT_BRACKET))
+    {
+        do
+        {
+            if (node->as.elements.count == UINT16_MAX)
+                error("Can't have more than 65535 elements in a list literal.");
+            appendNode(&node->as.elements, expression());
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    return node;
+}
+
+static Node *map(bool canAssign)
+{
+    Node *node = previousNode(NODE_MAP);
+    if (!CHECK(TOKEN_RIGHT_BRACE))
+    {
+        do
+        {
+            if (node->as.elements.count == 2 * UINT16_MAX)
+                error("Can't have more than 65535 entries in a map literal.");
+            appendNode(&node->as.elements, expression());
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            appendNode(&node->as.elements, expression());
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    return node;
+}
+
+static Node *coroutine(bool canAssign)
+{
+    Node *node = parsePrecedence(PREC_CALL);
+    if (node->type != NODE_CALL)
+    {
+        error("Expect a call after 'coroutine'.");
+        return node;
+    }
+    node->as.call.coroutine = true;
+    return node;
+}
+
+static Node *resume(bool canAssign)
+{
+    Node *node = previousNode(NODE_RESUME);
+    node->as.expression = parsePrecedence(PREC_UNARY);
+    return node;
+}
+
+static Node *grouping(bool canAssign)
+{
+    Node *node = expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+    return node;
+}
+
+static Node *unary(bool canAssign)
+{
+    Node *node = previousNode(NODE_UNARY);
+    node->as.unary.op = parser.previous.type;
+    node->as.unary.operand = parsePrecedence(PREC_UNARY);
+    return node;
+}
+
+static Node *number(bool canAssign)
+{
+    // a literal without a fraction is an int unless it doesn't fit in one
+    if (memchr(parser.previous.start, '.', parser.previous.length) == NULL)
+    {
+        errno = 0;
+        long long value = strtoll(parser.previous.start, NULL, 10);
+        if (errno != ERANGE)
+            return constantNode(INT_VAL(value));
+    }
+    double value = strtod(parser.previous.start, NULL);
+    return constantNode(NUMBER_VAL(value));
+}
+
+static Node *literal(bool canAssign)
+{
+    switch (parser.previous.type)
+    {
+    case TOKEN_TRUE:
+        return constantNode(BOOL_VAL(true));
+    case TOKEN_FALSE:
+        return constantNode(BOOL_VAL(false));
+    case TOKEN_NIL:
+        return constantNode(NIL_VAL);
+    default:
+        PANIC("Unreachable code");
+        return NULL;
+    }
+}
+
+static Node *string(bool canAssign)
+{
+    return constantNode(
+        OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+}
+
+static Node *namedVariable(Token name, bool canAssign)
+{
+    Variable *local = resolveLocal(current, &name);
+    if (local == NULL)
+        local = resolveCaptured(current, &name);
+    Node *node;
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        Node *value = expression();
+        if (local != NULL)
+        {
+            node = newNode(NODE_SET_LOCAL, name.line);
+            node->as.local.variable = local;
+            node->as.local.value = value;
+            local->writes++;
+        }
+        else
+        {
+            node = newNode(NODE_SET_GLOBAL, name.line);
+            node->as.global.name = copyString(name.start, name.length);
+            node->as.global.value = value;
+        }
+    }
+    else if (local != NULL)
+    {
+        node = newNode(NODE_GET_LOCAL, name.line);
+        node->as.local.variable = local;
+        local->reads++;
+    }
+    else
+    {
+        node = newNode(NODE_GET_GLOBAL, name.line);
+        node->as.global.name = copyString(name.start, name.length);
+    }
+    return node;
+}
+
+static Node *variable(bool canAssign)
+{
+    return namedVariable(parser.previous, canAssign);
+}
+
+static Node *this_(bool canAssign)
+{
+    if (classDepth == 0)
+    {
+        error("Can't use 'this' outside of a class.");
+        return constantNode(NIL_VAL);
+    }
+    return namedVariable(parser.previous, false);
+}
+
+bool parse(const char *source, Ast *ast)
+{
+    initScanner(source);
+    Scope scope;
+    current = NULL;
+    classDepth = 0;
+    initScope(&scope);
+
+    parsingAst = ast;
+    ast->variableCount = 0;
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    advance();
+    ast->root = newNode(NODE_BLOCK, parser.current.line);
+
+    while (!match(TOKEN_EOF))
+    {
+        appendNode(&ast->root->as.block, declaration());
+    }
+
+    freeScope(&scope);
+    return !parser.hadError;
+}
+#undef expression
+#undef getRule
+#undef previousNode
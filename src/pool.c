@@ -0,0 +1,563 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "pool.h"
+#include "table.h"
+#include "vm.h"
+
+// the elements a task runs the callback over at once
+#define CHUNK_SIZE 1024
+#define DEQUE_CAPACITY 64
+// how long a worker with nothing to steal sleeps before looking again, in
+// case it missed being woken
+#define IDLE_NANOSECONDS 1000000
+
+typedef enum
+{
+    JOB_MAP,
+    JOB_REDUCE,
+} JobKind;
+
+// One parallel operation. It lives on the stack of the thread waiting for
+// it, which reads nothing of it until it has finished.
+typedef struct
+{
+    JobKind kind;
+    const char *source;
+    int length;
+    const char *callback; // the name of the function the source defines
+    const double *values;
+    int64_t count;
+    double *out;
+    Value *partials; // the reduction of each chunk
+    int chunkCount;
+    atomic_int remaining; // chunks
+    _Atomic(const char *) error;
+    Value result;
+    bool finished; // guarded by the pool's lock
+} Job;
+
+// the chunks from `first` up to `last` of a job
+typedef struct
+{
+    Job *job;
+    int first;
+    int last;
+} Task;
+
+typedef struct TaskArray
+{
+    struct TaskArray *previous; // outgrown, but thieves may still read it
+    int64_t capacity;           // a power of two
+    _Atomic(Task *) tasks[];
+} TaskArray;
+
+// A Chase-Lev deque, as corrected for weak memory by Lê et al. Its worker
+// pushes and pops tasks at the bottom; others steal them from the top, and
+// only contend with the worker over the last one.
+typedef struct
+{
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(TaskArray *) array;
+} Deque;
+
+typedef struct
+{
+    pthread_t thread;
+    Deque deque;
+    unsigned int seed; // of the order to look for tasks to steal in
+} Worker;
+
+// The pool is shared by every isolate, unlike the VMs.
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     // idle workers wait here for tasks
+    pthread_cond_t finished; // and callers for their jobs
+    Worker *workers;
+    int workerCount; // running
+    int wantedCount; // from the next start, 0 for one per processor
+    bool stopping;
+    // tasks handed to the pool by callers, for any worker to take
+    Task **injected;
+    int injectedCount;
+    int injectedCapacity;
+    atomic_int activeJobs;
+    // workers asleep while a job runs, since there was nothing to steal
+    atomic_int sleeping;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static _Thread_local Worker *self; // NULL outside the workers
+// each worker's compiled callbacks, by their source
+static _Thread_local Table callbacks;
+
+static TaskArray *newTaskArray(int64_t capacity)
+{
+    TaskArray *array = reallocate(NULL, 0, sizeof(TaskArray) + sizeof(Task *) * capacity);
+    array->previous = NULL;
+    array->capacity = capacity;
+    return array;
+}
+
+static void initDeque(Deque *deque)
+{
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, newTaskArray(DEQUE_CAPACITY));
+}
+
+static void freeDeque(Deque *deque)
+{
+    TaskArray *array = atomic_load(&deque->array);
+    while (array != NULL)
+    {
+        TaskArray *previous = array->previous;
+        reallocate(array, sizeof(TaskArray) + sizeof(Task *) * array->capacity, 0);
+        array = previous;
+    }
+}
+
+static TaskArray *growDeque(Deque *deque, TaskArray *old, int64_t top, int64_t bottom)
+{
+    TaskArray *array = newTaskArray(old->capacity * 2);
+    for (int64_t i = top; i < bottom; i++)
+    {
+        Task *task = atomic_load_explicit(&old->tasks[i & (old->capacity - 1)],
+                                          memory_order_relaxed);
+        atomic_store_explicit(&array->tasks[i & (array->capacity - 1)], task,
+                              memory_order_relaxed);
+    }
+    array->previous = old;
+    atomic_store_explicit(&deque->array, array, memory_order_release);
+    return array;
+}
+
+static void pushTask(Deque *deque, Task *task)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    TaskArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top > array->capacity - 1)
+        array = growDeque(deque, array, top, bottom);
+    atomic_store_explicit(&array->tasks[bottom & (array->capacity - 1)], task,
+                          memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+static Task *popTask(Deque *deque)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    TaskArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+    if (top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Task *task = atomic_load_explicit(&array->tasks[bottom & (array->capacity - 1)],
+                                      memory_order_relaxed);
+    if (top == bottom)
+    {
+        // the last task: take it before a thief does
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            task = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static Task *stealTask(Deque *deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_seq_cst);
+    if (top >= bottom)
+        return NULL;
+
+    TaskArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    Task *task = atomic_load_explicit(&array->tasks[top & (array->capacity - 1)],
+                                      memory_order_relaxed);
+    // another thief, or the worker, may have taken it first
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+static Task *newTask(Job *job, int first, int last)
+{
+    Task *task = ALLOCATE(Task, 1);
+    task->job = job;
+    task->first = first;
+    task->last = last;
+    return task;
+}
+
+static void fail(Job *job, const char *error)
+{
+    const char *none = NULL;
+    atomic_compare_exchange_strong(&job->error, &none, error);
+}
+
+// the job's callback, compiled in this worker's VM the first time the
+// worker sees its source
+static const char *findCallback(Job *job, Value *callback)
+{
+    ObjString *source = copyString(job->source, job->length);
+    if (tableGet(&callbacks, source, callback))
+        return NULL;
+
+    if (interpret(source->chars) != INTERPRET_OK)
+        return "The callback source failed to run.";
+    ObjString *name = copyString(job->callback, (int)strlen(job->callback));
+    if (!tableGet(&vm.globals, name, callback))
+        return job->kind == JOB_MAP ? "The callback source must define map(x)."
+                                    : "The callback source must define reduce(a, b).";
+    tableSet(source, *callback, &callbacks);
+    return NULL;
+}
+
+static Value inputAt(Job *job, int64_t index)
+{
+    return job->values == NULL ? INT_VAL(index) : NUMBER_VAL(job->values[index]);
+}
+
+static const char *reduceValue(Value callback, Value *accumulator, Value value)
+{
+    Value args[2] = {*accumulator, value};
+    if (callFunction(callback, args, 2, accumulator) != INTERPRET_OK)
+        return "The reduce callback failed.";
+    if (!IS_NUMBER(*accumulator))
+        return "The reduce callback must return numbers.";
+    return NULL;
+}
+
+static const char *runChunk(Job *job, int chunk)
+{
+    Value callback;
+    const char *error = findCallback(job, &callback);
+    if (error != NULL)
+        return error;
+
+    int64_t first = (int64_t)chunk * CHUNK_SIZE;
+    int64_t last = first + CHUNK_SIZE < job->count ? first + CHUNK_SIZE : job->count;
+    if (job->kind == JOB_MAP)
+    {
+        for (int64_t i = first; i < last; i++)
+        {
+            Value value = inputAt(job, i);
+            if (callFunction(callback, &value, 1, &value) != INTERPRET_OK)
+                return "The map callback failed.";
+            if (!IS_NUMBER(value))
+                return "The map callback must return numbers.";
+            job->out[i] = AS_NUMBER(value);
+        }
+        return NULL;
+    }
+
+    Value accumulator = inputAt(job, first);
+    for (int64_t i = first + 1; i < last; i++)
+    {
+        error = reduceValue(callback, &accumulator, inputAt(job, i));
+        if (error != NULL)
+            return error;
+    }
+    job->partials[chunk] = accumulator;
+    return NULL;
+}
+
+// the reduction of the chunks' reductions, in order, on the worker that
+// finished the last chunk
+static const char *combinePartials(Job *job)
+{
+    Value callback;
+    const char *error = findCallback(job, &callback);
+    if (error != NULL)
+        return error;
+
+    job->result = job->partials[0];
+    for (int i = 1; i < job->chunkCount; i++)
+    {
+        error = reduceValue(callback, &job->result, job->partials[i]);
+        if (error != NULL)
+            return error;
+    }
+    return NULL;
+}
+
+static void finishChunk(Job *job)
+{
+    if (atomic_fetch_sub(&job->remaining, 1) != 1)
+        return;
+
+    if (job->kind == JOB_REDUCE && atomic_load(&job->error) == NULL)
+    {
+        const char *error = combinePartials(job);
+        if (error != NULL)
+            fail(job, error);
+    }
+    // the job is gone once its caller wakes
+    pthread_mutex_lock(&pool.lock);
+    job->finished = true;
+    atomic_fetch_sub(&pool.activeJobs, 1);
+    pthread_cond_broadcast(&pool.finished);
+    // those sleeping for its tasks can wait for the next job instead
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// wake a worker sleeping for want of tasks, after pushing one
+static void wakeThief()
+{
+    // Either the worker, sweeping the deques after counting itself as
+    // sleeping, sees the task, or this sees it sleeping.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool.sleeping, memory_order_relaxed) == 0)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Run the first chunk of the task, leaving the others to whoever gets to
+// them: the upper half of the chunks goes into the deque until one is left.
+static void runTask(Task *task)
+{
+    while (task->last - task->first > 1)
+    {
+        int middle = task->first + (task->last - task->first) / 2;
+        pushTask(&self->deque, newTask(task->job, middle, task->last));
+        wakeThief();
+        task->last = middle;
+    }
+    Job *job = task->job;
+    int chunk = task->first;
+    FREE(Task, task);
+
+    // after a failure the remaining chunks are only counted
+    if (atomic_load(&job->error) == NULL)
+    {
+        const char *error = runChunk(job, chunk);
+        if (error != NULL)
+            fail(job, error);
+    }
+    finishChunk(job);
+}
+
+static Task *findTask()
+{
+    Task *task = popTask(&self->deque);
+    if (task != NULL)
+        return task;
+
+    int start = (int)(rand_r(&self->seed) % (unsigned int)pool.workerCount);
+    for (int i = 0; i < pool.workerCount; i++)
+    {
+        Worker *victim = &pool.workers[(start + i) % pool.workerCount];
+        if (victim != self && (task = stealTask(&victim->deque)) != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+// Take a task a caller handed in, or wait for one while no job runs. While
+// one does but others have all its tasks, sleep until more are pushed, the
+// job finishes or a while passes; `task` may be left NULL then. False once
+// the pool stops.
+static bool waitForTask(Task **task)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.injectedCount == 0 && !pool.stopping && atomic_load(&pool.activeJobs) == 0)
+        pthread_cond_wait(&pool.wake, &pool.lock);
+    bool stopping = pool.stopping;
+    *task = pool.injectedCount > 0 ? pool.injected[--pool.injectedCount] : NULL;
+    if (*task == NULL && !stopping)
+    {
+        // pushes signal under the lock, so none comes between this last
+        // sweep and the wait
+        atomic_fetch_add(&pool.sleeping, 1);
+        *task = findTask();
+        if (*task == NULL)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += IDLE_NANOSECONDS;
+            if (until.tv_nsec >= 1000000000)
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&pool.wake, &pool.lock, &until);
+        }
+        atomic_fetch_sub(&pool.sleeping, 1);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return *task != NULL || !stopping;
+}
+
+static void *runWorker(void *argument)
+{
+    self = (Worker *)argument;
+    initVM();
+    initTable(&callbacks);
+
+    for (;;)
+    {
+        Task *task = findTask();
+        if (task == NULL && !waitForTask(&task))
+            break;
+        if (task != NULL)
+            runTask(task);
+    }
+
+    freeTable(&callbacks);
+    freeVM();
+    return NULL;
+}
+
+// with the lock held
+static void startWorkers()
+{
+    int count = pool.wantedCount > 0 ? pool.wantedCount : cpuCount();
+    pool.workers = ALLOCATE(Worker, count);
+    pool.workerCount = count;
+    for (int i = 0; i < count; i++)
+    {
+        initDeque(&pool.workers[i].deque);
+        pool.workers[i].seed = (unsigned int)i * 2654435761u + 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (pthread_create(&pool.workers[i].thread, NULL, runWorker, &pool.workers[i]) != 0)
+            PANIC("can't start a worker thread");
+    }
+}
+
+// with the lock held, once no job runs
+static void stopWorkers()
+{
+    if (pool.workerCount == 0)
+        return;
+
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.workerCount; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+    pthread_mutex_lock(&pool.lock);
+
+    for (int i = 0; i < pool.workerCount; i++)
+        freeDeque(&pool.workers[i].deque);
+    FREE_ARRAY(Worker, pool.workers, pool.workerCount);
+    pool.workers = NULL;
+    pool.workerCount = 0;
+    pool.stopping = false;
+    // callers waiting to start a job
+    pthread_cond_broadcast(&pool.finished);
+}
+
+static const char *runJob(Job *job)
+{
+    if (self != NULL)
+        return "Can't run a parallel operation inside a callback.";
+
+    job->chunkCount = (int)((job->count + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    atomic_init(&job->remaining, job->chunkCount);
+    atomic_init(&job->error, NULL);
+    job->finished = false;
+    if (job->chunkCount == 0)
+        return NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.stopping)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    if (pool.workerCount == 0)
+        startWorkers();
+    if (pool.injectedCount == pool.injectedCapacity)
+    {
+        int oldCapacity = pool.injectedCapacity;
+        pool.injectedCapacity = GROW_CAPACITY(oldCapacity);
+        pool.injected = GROW_ARRAY(Task *, pool.injected, oldCapacity, pool.injectedCapacity);
+    }
+    pool.injected[pool.injectedCount++] = newTask(job, 0, job->chunkCount);
+    atomic_fetch_add(&pool.activeJobs, 1);
+    pthread_cond_broadcast(&pool.wake);
+
+    while (!job->finished)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    return atomic_load(&job->error);
+}
+
+const char *parallelMap(const char *source, int length, const double *values, int64_t count,
+                        double *out)
+{
+    Job job;
+    job.kind = JOB_MAP;
+    job.source = source;
+    job.length = length;
+    job.callback = "map";
+    job.values = values;
+    job.count = count;
+    job.out = out;
+    job.partials = NULL;
+    return runJob(&job);
+}
+
+const char *parallelReduce(const char *source, int length, const double *values,
+                           int64_t count, Value *result)
+{
+    Job job;
+    job.kind = JOB_REDUCE;
+    job.source = source;
+    job.length = length;
+    job.callback = "reduce";
+    job.values = values;
+    job.count = count;
+    job.out = NULL;
+    int chunkCount = (int)((count + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    job.partials = ALLOCATE(Value, chunkCount);
+    const char *error = runJob(&job);
+    FREE_ARRAY(Value, job.partials, chunkCount);
+    *result = job.result;
+    return error;
+}
+
+int cpuCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : (int)count;
+}
+
+void setWorkerCount(int count)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.stopping || atomic_load(&pool.activeJobs) > 0)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pool.wantedCount = count;
+    int wanted = count > 0 ? count : cpuCount();
+    if (pool.workerCount != wanted)
+        stopWorkers();
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void stopPool()
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.stopping || atomic_load(&pool.activeJobs) > 0)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    stopWorkers();
+    FREE_ARRAY(Task *, pool.injected, pool.injectedCapacity);
+    pool.injected = NULL;
+    pool.injectedCapacity = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,420 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profile.h"
+#include "table.h"
+#include "vm.h"
+
+// older C libraries don't name the field of SIGEV_THREAD_ID
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static OpProfile *sorted;
+
+static int compareCycles(const void *a, const void *b)
+{
+    uint64_t x = sorted->cycles[*(const uint8_t *)a];
+    uint64_t y = sorted->cycles[*(const uint8_t *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// what reading the counter costs, which every instruction's cycles include
+static uint64_t measuringCost()
+{
+    uint64_t least = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t start = readCycles();
+        uint64_t cost = readCycles() - start;
+        if (cost < least)
+            least = cost;
+    }
+    return least;
+}
+
+// an instruction's cycles, less what measuring them took
+static uint64_t netCycles(OpProfile *profile, int instruction, uint64_t cost)
+{
+    uint64_t measuring = profile->counts[instruction] * cost;
+    uint64_t cycles = profile->cycles[instruction];
+    return cycles > measuring ? cycles - measuring : 0;
+}
+
+void printOpProfile(OpProfile *profile)
+{
+    uint64_t cost = measuringCost();
+    uint8_t instructions[UINT8_COUNT];
+    int count = 0;
+    uint64_t totalCount = 0;
+    uint64_t totalCycles = 0;
+    for (int i = 0; i < UINT8_COUNT; i++)
+    {
+        if (profile->counts[i] == 0)
+            continue;
+        profile->cycles[i] = netCycles(profile, i, cost);
+        instructions[count++] = (uint8_t)i;
+        totalCount += profile->counts[i];
+        totalCycles += profile->cycles[i];
+    }
+    sorted = profile;
+    qsort(instructions, count, sizeof(instructions[0]), compareCycles);
+
+    fprintf(stderr, "%llu cycles of measuring taken off each instruction\n",
+            (unsigned long long)cost);
+    fprintf(stderr, "%-24s %14s %16s %10s %7s\n", "instruction", "count", "cycles", "cycles/op",
+            "time");
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t executed = profile->counts[instructions[i]];
+        uint64_t cycles = profile->cycles[instructions[i]];
+        fprintf(stderr, "%-24s %14llu %16llu %10.1f %6.2f%%\n", opcodeName(instructions[i]),
+                (unsigned long long)executed, (unsigned long long)cycles,
+                (double)cycles / executed, totalCycles == 0 ? 0.0 : 100.0 * cycles / totalCycles);
+    }
+    fprintf(stderr, "%-24s %14llu %16llu %10.1f\n", "total", (unsigned long long)totalCount,
+            (unsigned long long)totalCycles,
+            totalCount == 0 ? 0.0 : (double)totalCycles / totalCount);
+}
+
+// samples a second; also the resolution of the CPU time they measure
+#define SAMPLE_INTERVAL 1000000
+// the innermost frames a sample keeps
+#define SAMPLE_DEPTH 48
+// a power of two
+#define RING_SIZE 256
+// how often the collector empties the ring, in nanoseconds
+#define COLLECT_INTERVAL 10000000
+
+typedef struct
+{
+    ObjFunction *function;
+    int offset;
+} SampledFrame;
+
+typedef struct
+{
+    int weight;     // the samples that were due when it was taken
+    int depth;
+    bool truncated; // the outermost frames didn't fit
+    SampledFrame frames[SAMPLE_DEPTH]; // the outermost first
+} Sample;
+
+// A single producer, single consumer queue: the VM's thread advances head
+// once a sample is written, the collector advances tail once it is copied.
+static struct
+{
+    Sample samples[RING_SIZE];
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+} ring;
+// samples lost because the ring was full
+static uint64_t dropped;
+
+// what the collector copied out of the ring: the frames of every sample one
+// after another
+typedef struct
+{
+    size_t start;
+    int weight;
+    int depth;
+    bool truncated;
+} Collected;
+
+static Collected *collected;
+static size_t collectedCount;
+static size_t collectedCapacity;
+static SampledFrame *frames;
+static size_t frameCount;
+static size_t frameCapacity;
+
+static timer_t timer;
+static pthread_t collector;
+static atomic_bool collecting;
+
+// the timer is checked on scheduler ticks, which may be further apart than
+// its interval; the expirations in between are overruns of one signal
+static void requestSample(int signal, siginfo_t *info, void *context)
+{
+    vm.samplesDue += 1 + info->si_overrun;
+}
+
+// add the frames of a stack, the innermost first; false if they didn't all
+// fit. The code running in the innermost frame of the running stack is at
+// its ip, the others are in the call or resume before theirs.
+static bool addFrames(SampledFrame *sampled, int *depth, CallFrame *stack, int count,
+                      bool running)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (*depth == SAMPLE_DEPTH)
+            return false;
+        ObjFunction *function = stack[i].function;
+        int offset = (int)(stack[i].ip - function->chunk.code);
+        if (!running || i < count - 1)
+            offset--;
+        sampled[*depth].function = function;
+        sampled[*depth].offset = offset < 0 ? 0 : offset;
+        (*depth)++;
+    }
+    return true;
+}
+
+void takeSample()
+{
+    int weight = vm.samplesDue;
+    vm.samplesDue = 0;
+
+    uint64_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring.tail, memory_order_acquire) == RING_SIZE)
+    {
+        dropped += weight;
+        return;
+    }
+
+    SampledFrame innermost[SAMPLE_DEPTH];
+    int depth = 0;
+    bool truncated = !addFrames(innermost, &depth, vm.frames, vm.frameCount, true);
+    for (ObjCoroutine *coroutine = vm.coroutine; coroutine != NULL && !truncated;
+         coroutine = coroutine->previous)
+    {
+        truncated = !addFrames(innermost, &depth, coroutine->resumer.frames,
+                               coroutine->resumer.frameCount, false);
+    }
+
+    Sample *sample = &ring.samples[head & (RING_SIZE - 1)];
+    sample->weight = weight;
+    sample->depth = depth;
+    sample->truncated = truncated;
+    for (int i = 0; i < depth; i++)
+        sample->frames[i] = innermost[depth - 1 - i];
+    atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+}
+
+static void collect()
+{
+    uint64_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+    for (; tail != head; tail++)
+    {
+        Sample *sample = &ring.samples[tail & (RING_SIZE - 1)];
+        if (collectedCount == collectedCapacity)
+        {
+            size_t capacity = GROW_CAPACITY(collectedCapacity);
+            collected = GROW_ARRAY(Collected, collected, collectedCapacity, capacity);
+            collectedCapacity = capacity;
+        }
+        while (frameCount + sample->depth > frameCapacity)
+        {
+            size_t capacity = GROW_CAPACITY(frameCapacity);
+            frames = GROW_ARRAY(SampledFrame, frames, frameCapacity, capacity);
+            frameCapacity = capacity;
+        }
+        collected[collectedCount++] = (Collected){frameCount, sample->weight, sample->depth,
+                                                  sample->truncated};
+        memcpy(frames + frameCount, sample->frames, sizeof(SampledFrame) * sample->depth);
+        frameCount += sample->depth;
+    }
+    atomic_store_explicit(&ring.tail, tail, memory_order_release);
+}
+
+static void *runCollector(void *unused)
+{
+    struct timespec pause = {0, COLLECT_INTERVAL};
+    while (atomic_load(&collecting))
+    {
+        nanosleep(&pause, NULL);
+        collect();
+    }
+    return NULL;
+}
+
+bool startSampling()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = requestSample;
+    // the signal only comes while the thread runs, but it may be in a
+    // system call then
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0)
+        return false;
+
+    atomic_store(&collecting, true);
+    if (pthread_create(&collector, NULL, runCollector, NULL) != 0)
+        return false;
+
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    struct itimerspec interval = {{0, SAMPLE_INTERVAL}, {0, SAMPLE_INTERVAL}};
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) != 0)
+    {
+        timer = NULL;
+        return false;
+    }
+    return timer_settime(timer, 0, &interval, NULL) == 0;
+}
+
+// a frame as the reports name it: its function and line
+static ObjString *frameName(SampledFrame *frame)
+{
+    ObjFunction *function = frame->function;
+    char name[128];
+    int length;
+    if (function->name == NULL)
+        length = snprintf(name, sizeof(name), "script:%d",
+                          getLine(&function->chunk, frame->offset));
+    else
+        length = snprintf(name, sizeof(name), "%.100s:%d", function->name->chars,
+                          getLine(&function->chunk, frame->offset));
+    return copyString(name, length);
+}
+
+static void addHits(Table *table, ObjString *key, int64_t hits)
+{
+    Value value;
+    int64_t previous = tableGet(table, key, &value) ? AS_INT(value) : 0;
+    tableSet(key, INT_VAL(previous + hits), table);
+}
+
+typedef struct
+{
+    ObjString *name;
+    int64_t self;
+    int64_t total;
+} LineHits;
+
+static int compareHits(const void *a, const void *b)
+{
+    const LineHits *x = (const LineHits *)a;
+    const LineHits *y = (const LineHits *)b;
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    if (x->total != y->total)
+        return x->total < y->total ? 1 : -1;
+    return 0;
+}
+
+static void writeStacks(Table *stacks)
+{
+    FILE *file = fopen(SAMPLE_STACKS_PATH, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not write the stacks to \"%s\".\n", SAMPLE_STACKS_PATH);
+        return;
+    }
+    for (int i = 0; i < stacks->capacity; i++)
+    {
+        Entry *entry = &stacks->entries[i];
+        if (IS_EMPTY_KEY(entry->key))
+            continue;
+        fprintf(file, "%s %lld\n", AS_CSTRING(entry->key), (long long)AS_INT(entry->value));
+    }
+    fclose(file);
+    fprintf(stderr, "stacks written to %s\n", SAMPLE_STACKS_PATH);
+}
+
+static void report()
+{
+    // the samples in which each line ran, and in which it was anywhere on
+    // the stack, counting a recursive one once
+    Table self, total, lastSample, stacks;
+    initTable(&self);
+    initTable(&total);
+    initTable(&lastSample);
+    initTable(&stacks);
+    int64_t samples = 0;
+    char line[SAMPLE_DEPTH * 128 + 8];
+
+    for (size_t i = 0; i < collectedCount; i++)
+    {
+        Collected *sample = &collected[i];
+        if (sample->depth == 0)
+            continue;
+        samples += sample->weight;
+        int length = 0;
+        if (sample->truncated)
+            length += snprintf(line, sizeof(line), "...;");
+        for (int j = 0; j < sample->depth; j++)
+        {
+            ObjString *name = frameName(&frames[sample->start + j]);
+            Value last;
+            if (!tableGet(&lastSample, name, &last) || AS_INT(last) != (int64_t)i)
+            {
+                addHits(&total, name, sample->weight);
+                tableSet(name, INT_VAL(i), &lastSample);
+            }
+            if (j == sample->depth - 1)
+                addHits(&self, name, sample->weight);
+            length += snprintf(line + length, sizeof(line) - length, j == 0 ? "%s" : ";%s",
+                               name->chars);
+        }
+        addHits(&stacks, copyString(line, length), sample->weight);
+    }
+
+    fprintf(stderr, "%lld samples, one a millisecond of CPU time", (long long)samples);
+    if (dropped > 0)
+        fprintf(stderr, ", %llu dropped", (unsigned long long)dropped);
+    fprintf(stderr, "\n");
+    if (samples > 0)
+    {
+        LineHits *lines = ALLOCATE(LineHits, total.count);
+        int count = 0;
+        for (int i = 0; i < total.capacity; i++)
+        {
+            Entry *entry = &total.entries[i];
+            if (IS_EMPTY_KEY(entry->key))
+                continue;
+            Value selfHits;
+            ObjString *name = AS_STRING(entry->key);
+            lines[count++] = (LineHits){name, tableGet(&self, name, &selfHits) ? AS_INT(selfHits) : 0,
+                                        AS_INT(entry->value)};
+        }
+        qsort(lines, count, sizeof(LineHits), compareHits);
+
+        fprintf(stderr, "%8s %8s  %s\n", "self", "total", "line");
+        for (int i = 0; i < count; i++)
+        {
+            fprintf(stderr, "%7.2f%% %7.2f%%  %s\n", 100.0 * lines[i].self / samples,
+                    100.0 * lines[i].total / samples, lines[i].name->chars);
+        }
+        FREE_ARRAY(LineHits, lines, total.count);
+        writeStacks(&stacks);
+    }
+
+    freeTable(&self);
+    freeTable(&total);
+    freeTable(&lastSample);
+    freeTable(&stacks);
+}
+
+void stopSampling()
+{
+    if (timer != NULL)
+        timer_delete(timer);
+    signal(SIGPROF, SIG_IGN);
+    atomic_store(&collecting, false);
+    pthread_join(collector, NULL);
+    collect();
+
+    report();
+    FREE_ARRAY(Collected, collected, collectedCapacity);
+    FREE_ARRAY(SampledFrame, frames, frameCapacity);
+    collected = NULL;
+    frames = NULL;
+    collectedCount = collectedCapacity = 0;
+    frameCount = frameCapacity = 0;
+}
@@ -11,7 +11,7 @@ typedef struct
     int line;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 #define PEEK (*scanner.current)
 #define ISDIGIT(c) ((c) >= '0' && (c) <= '9')
@@ -151,7 +151,17 @@ TokenType identifier_type()
     case 'a':
         return checkKeyword(1, 2, "nd", TOKEN_AND);
     case 'c':
-        return checkKeyword(1, 4, "class", TOKEN_CLASS);
+        if (scanner.current - scanner.start > 1)
+        {
+            switch (scanner.start[1])
+            {
+            case 'l':
+                return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+            case 'o':
+                return checkKeyword(2, 7, "routine", TOKEN_COROUTINE);
+            }
+        }
+        break;
     case 'e':
         return checkKeyword(1, 3, "lse", TOKEN_ELSE);
     case 'i':
@@ -163,13 +173,25 @@ TokenType identifier_type()
     case 'p':
         return checkKeyword(1, 4, "rint", TOKEN_PRINT);
     case 'r':
-        return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+        if (scanner.current - scanner.start > 2 && scanner.start[1] == 'e')
+        {
+            switch (scanner.start[2])
+            {
+            case 's':
+                return checkKeyword(3, 3, "ume", TOKEN_RESUME);
+            case 't':
+                return checkKeyword(3, 3, "urn", TOKEN_RETURN);
+            }
+        }
+        break;
     case 's':
         return checkKeyword(1, 4, "uper", TOKEN_SUPER);
     case 'v':
         return checkKeyword(1, 2, "ar", TOKEN_VAR);
     case 'w':
         return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    case 'y':
+        return checkKeyword(1, 4, "ield", TOKEN_YIELD);
     case 'f':
         if (scanner.current - scanner.start > 1)
         {
@@ -243,6 +265,8 @@ Token scanToken()
         return makeToken(TOKEN_RIGHT_BRACE);
     case ',':
         return makeToken(TOKEN_COMMA);
+    case ':':
+        return makeToken(TOKEN_COLON);
     case '.':
         return makeToken(TOKEN_DOT);
     case '-':
@@ -255,13 +279,27 @@ Token scanToken()
         return makeToken(TOKEN_SLASH);
     case '*':
         return makeToken(TOKEN_STAR);
+    case '%':
+        return makeToken(TOKEN_PERCENT);
+    case '&':
+        return makeToken(TOKEN_AMPERSAND);
+    case '|':
+        return makeToken(TOKEN_PIPE);
+    case '^':
+        return makeToken(TOKEN_CARET);
+    case '~':
+        return makeToken(TOKEN_TILDE);
     case '!':
         return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
         return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '>':
+        if (match('>'))
+            return makeToken(TOKEN_GREATER_GREATER);
         return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '<':
+        if (match('<'))
+            return makeToken(TOKEN_LESS_LESS);
         return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '"':
         return string();
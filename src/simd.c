@@ -0,0 +1,310 @@
+#include <pthread.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86
+#endif
+
+typedef struct
+{
+    void (*add)(double *out, const double *a, const double *b, int count);
+    void (*mul)(double *out, const double *a, const double *b, int count);
+    double (*sum)(const double *values, int count);
+    double (*dot)(const double *a, const double *b, int count);
+    double (*min)(const double *values, int count);
+    double (*max)(const double *values, int count);
+    void (*fill)(double *out, double value, int count);
+} Kernels;
+
+static Kernels kernels;
+
+// Scalar kernels, also used for the tails the vector loops leave over.
+
+static void addScalar(double *out, const double *a, const double *b, int count)
+{
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] + b[i];
+}
+
+static void mulScalar(double *out, const double *a, const double *b, int count)
+{
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] * b[i];
+}
+
+static double sumScalar(const double *values, int count)
+{
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += values[i];
+    return sum;
+}
+
+static double dotScalar(const double *a, const double *b, int count)
+{
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// min and max keep the running value when a comparison involves NaN, the
+// same as the vector instructions do
+
+static double minScalar(const double *values, int count)
+{
+    double min = values[0];
+    for (int i = 1; i < count; i++)
+        min = values[i] < min ? values[i] : min;
+    return min;
+}
+
+static double maxScalar(const double *values, int count)
+{
+    double max = values[0];
+    for (int i = 1; i < count; i++)
+        max = values[i] > max ? values[i] : max;
+    return max;
+}
+
+static void fillScalar(double *out, double value, int count)
+{
+    for (int i = 0; i < count; i++)
+        out[i] = value;
+}
+
+#ifdef HAVE_X86
+
+// SSE2 kernels, two doubles at a time. Every x86-64 CPU has SSE2.
+
+static void addSse2(double *out, const double *a, const double *b, int count)
+{
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    addScalar(out + i, a + i, b + i, count - i);
+}
+
+static void mulSse2(double *out, const double *a, const double *b, int count)
+{
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    mulScalar(out + i, a + i, b + i, count - i);
+}
+
+static double sumSse2(const double *values, int count)
+{
+    __m128d sum = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        sum = _mm_add_pd(sum, _mm_loadu_pd(values + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum);
+    return lanes[0] + lanes[1] + sumScalar(values + i, count - i);
+}
+
+static double dotSse2(const double *a, const double *b, int count)
+{
+    __m128d sum = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        sum = _mm_add_pd(sum, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum);
+    return lanes[0] + lanes[1] + dotScalar(a + i, b + i, count - i);
+}
+
+static double minSse2(const double *values, int count)
+{
+    __m128d min = _mm_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        min = _mm_min_pd(_mm_loadu_pd(values + i), min);
+    double lanes[3];
+    _mm_storeu_pd(lanes, min);
+    lanes[2] = i < count ? minScalar(values + i, count - i) : lanes[0];
+    return minScalar(lanes, 3);
+}
+
+static double maxSse2(const double *values, int count)
+{
+    __m128d max = _mm_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        max = _mm_max_pd(_mm_loadu_pd(values + i), max);
+    double lanes[3];
+    _mm_storeu_pd(lanes, max);
+    lanes[2] = i < count ? maxScalar(values + i, count - i) : lanes[0];
+    return maxScalar(lanes, 3);
+}
+
+static void fillSse2(double *out, double value, int count)
+{
+    __m128d fill = _mm_set1_pd(value);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, fill);
+    fillScalar(out + i, value, count - i);
+}
+
+// AVX2 kernels, four doubles at a time. They are compiled for AVX2 whatever
+// the flags of the rest of the build, and only picked when the CPU has it.
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void addAvx2(double *out, const double *a, const double *b, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i,
+                         _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    addScalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static void mulAvx2(double *out, const double *a, const double *b, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i,
+                         _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    mulScalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static double sumAvx2(const double *values, int count)
+{
+    // two accumulators hide the latency of the adds
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+    }
+    for (; i + 4 <= count; i += 4)
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumScalar(values + i, count - i);
+}
+
+AVX2 static double dotAvx2(const double *a, const double *b, int count)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                 _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                                 _mm256_loadu_pd(b + i + 4)));
+    }
+    for (; i + 4 <= count; i += 4)
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                 _mm256_loadu_pd(b + i)));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dotScalar(a + i, b + i, count - i);
+}
+
+AVX2 static double minAvx2(const double *values, int count)
+{
+    __m256d min = _mm256_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        min = _mm256_min_pd(_mm256_loadu_pd(values + i), min);
+    double lanes[5];
+    _mm256_storeu_pd(lanes, min);
+    lanes[4] = i < count ? minScalar(values + i, count - i) : lanes[0];
+    return minScalar(lanes, 5);
+}
+
+AVX2 static double maxAvx2(const double *values, int count)
+{
+    __m256d max = _mm256_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        max = _mm256_max_pd(_mm256_loadu_pd(values + i), max);
+    double lanes[5];
+    _mm256_storeu_pd(lanes, max);
+    lanes[4] = i < count ? maxScalar(values + i, count - i) : lanes[0];
+    return maxScalar(lanes, 5);
+}
+
+AVX2 static void fillAvx2(double *out, double value, int count)
+{
+    __m256d fill = _mm256_set1_pd(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, fill);
+    fillScalar(out + i, value, count - i);
+}
+
+#undef AVX2
+
+#endif
+
+static void selectKernels()
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels = (Kernels){addAvx2, mulAvx2, sumAvx2, dotAvx2, minAvx2, maxAvx2, fillAvx2};
+        return;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        kernels = (Kernels){addSse2, mulSse2, sumSse2, dotSse2, minSse2, maxSse2, fillSse2};
+        return;
+    }
+#endif
+    kernels = (Kernels){addScalar, mulScalar, sumScalar, dotScalar, minScalar, maxScalar,
+                        fillScalar};
+}
+
+// every isolate's VM asks, but the CPU only needs checking once
+void initKernels()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, selectKernels);
+}
+
+void addDoubles(double *out, const double *a, const double *b, int count)
+{
+    kernels.add(out, a, b, count);
+}
+
+void mulDoubles(double *out, const double *a, const double *b, int count)
+{
+    kernels.mul(out, a, b, count);
+}
+
+double sumDoubles(const double *values, int count)
+{
+    return kernels.sum(values, count);
+}
+
+double dotDoubles(const double *a, const double *b, int count)
+{
+    return kernels.dot(a, b, count);
+}
+
+double minDoubles(const double *values, int count)
+{
+    return kernels.min(values, count);
+}
+
+double maxDoubles(const double *values, int count)
+{
+    return kernels.max(values, count);
+}
+
+void fillDoubles(double *out, double value, int count)
+{
+    kernels.fill(out, value, count);
+}
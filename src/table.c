@@ -19,15 +19,57 @@ void freeTable(Table *table)
     initTable(table);
 }
 
-Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+static uint32_t hashValue(Value key)
 {
-    int index = key->hash % capacity;
+    switch (key.type)
+    {
+    case VAL_BOOL:
+        return AS_BOOL(key) ? 3 : 5;
+    case VAL_NIL:
+        return 7;
+    case VAL_INT:
+    case VAL_DOUBLE:
+    {
+        // an int hashes as the double it equals, and adding zero turns -0
+        // into 0, so equal numbers hash the same
+        double number = AS_NUMBER(key) + 0.0;
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        bits ^= bits >> 33;
+        bits *= 0xff51afd7ed558ccdULL;
+        bits ^= bits >> 33;
+        return (uint32_t)bits;
+    }
+    case VAL_OBJ:
+        if (IS_STRING(key))
+            return AS_STRING(key)->hash;
+        // every other object is its own key
+        return (uint32_t)((uintptr_t)AS_OBJ(key) >> 3);
+    }
+    PANIC("Unreachable code.");
+    return 0;
+}
+
+static inline bool keysEqual(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return valuesEqual(a, b);
+    if (a.type != b.type)
+        return false;
+    if (IS_BOOL(a))
+        return AS_BOOL(a) == AS_BOOL(b);
+    return IS_NIL(a) || AS_OBJ(a) == AS_OBJ(b);
+}
+
+Entry *findEntry(Entry *entries, int capacity, Value key)
+{
+    int index = hashValue(key) % capacity;
     Entry *tombstone = NULL;
 
     for (;;)
     {
         Entry *entry = &entries[index];
-        if (entry->key == NULL)
+        if (IS_EMPTY_KEY(entry->key))
         {
             if (IS_NIL(entry->value))
             {
@@ -39,7 +81,7 @@ Entry *findEntry(Entry *entries, int capacity, ObjString *key)
                     tombstone = entry;
             }
         }
-        else if (entry->key == key)
+        else if (keysEqual(entry->key, key))
         {
             return entry;
         }
@@ -52,7 +94,7 @@ static void adjustCapacity(Table *table, int capacity)
     Entry *entries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++)
     {
-        entries[i].key = NULL;
+        entries[i].key = EMPTY_KEY;
         entries[i].value = NIL_VAL;
     }
 
@@ -60,7 +102,7 @@ static void adjustCapacity(Table *table, int capacity)
     for (int i = 0; i < table->capacity; i++)
     {
         Entry *entry = &table->entries[i];
-        if (entry->key == NULL)
+        if (IS_EMPTY_KEY(entry->key))
             continue;
 
         Entry *dest = findEntry(entries, capacity, entry->key);
@@ -74,7 +116,16 @@ static void adjustCapacity(Table *table, int capacity)
     table->capacity = capacity;
 }
 
-bool tableSet(ObjString *key, Value value, Table *table)
+void tableReserve(Table *table, int count)
+{
+    int capacity = table->capacity;
+    while (count > capacity * TABLE_MAX_LOAD)
+        capacity = GROW_CAPACITY(capacity);
+    if (capacity != table->capacity)
+        adjustCapacity(table, capacity);
+}
+
+bool tableSetValue(Value key, Value value, Table *table)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
@@ -82,7 +133,7 @@ bool tableSet(ObjString *key, Value value, Table *table)
         adjustCapacity(table, capacity);
     }
     Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
+    bool isNewKey = IS_EMPTY_KEY(entry->key);
     if (isNewKey && IS_NIL(entry->value))
         table->count++;
 
@@ -91,47 +142,72 @@ bool tableSet(ObjString *key, Value value, Table *table)
     return isNewKey;
 }
 
+bool tableSet(ObjString *key, Value value, Table *table)
+{
+    return tableSetValue(OBJ_VAL(key), value, table);
+}
+
 void tableAddAll(Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
         Entry *entry = &from->entries[i];
-        if (entry->key != NULL)
+        if (!IS_EMPTY_KEY(entry->key))
         {
-            tableSet(entry->key, entry->value, to);
+            tableSetValue(entry->key, entry->value, to);
         }
     }
 }
 
-bool tableGet(Table *table, ObjString *key, Value *value)
+static Entry *lookupEntry(Table *table, Value key)
 {
     if (table->count == 0)
-        return false;
+        return NULL;
 
     Entry *entry = findEntry(table->entries, table->capacity, key);
 
-    if (entry->key == NULL)
+    if (IS_EMPTY_KEY(entry->key))
+        return NULL;
+
+    return entry;
+}
+
+bool tableGetValue(Table *table, Value key, Value *value)
+{
+    Entry *entry = lookupEntry(table, key);
+    if (entry == NULL)
         return false;
 
     *value = entry->value;
     return true;
 }
 
-bool tableDelete(Table *table, ObjString *key)
+bool tableGet(Table *table, ObjString *key, Value *value)
 {
-    if (table->count == 0)
-        return false;
+    return tableGetValue(table, OBJ_VAL(key), value);
+}
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
+Entry *tableGetEntry(Table *table, ObjString *key)
+{
+    return lookupEntry(table, OBJ_VAL(key));
+}
 
-    if (entry->key == NULL)
+bool tableDeleteValue(Table *table, Value key)
+{
+    Entry *entry = lookupEntry(table, key);
+    if (entry == NULL)
         return false;
 
     entry->value = BOOL_VAL(true);
-    entry->key = NULL;
+    entry->key = EMPTY_KEY;
     return true;
 }
 
+bool tableDelete(Table *table, ObjString *key)
+{
+    return tableDeleteValue(table, OBJ_VAL(key));
+}
+
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
 {
     if (table->count == 0)
@@ -141,16 +217,16 @@ ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t
     for (;;)
     {
         Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
+        if (IS_EMPTY_KEY(entry->key))
         {
             if (IS_NIL(entry->value))
                 return NULL;
         }
-        else if (entry->key->length == length &&
-                 entry->key->hash == hash &&
-                 memcmp(chars, entry->key->chars, length) == 0)
+        else if (AS_STRING(entry->key)->length == length &&
+                 AS_STRING(entry->key)->hash == hash &&
+                 memcmp(chars, AS_STRING(entry->key)->chars, length) == 0)
         {
-            return entry->key;
+            return AS_STRING(entry->key);
         }
 
         index = (index + 1) % table->capacity;
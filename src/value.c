@@ -2,7 +2,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "dtoa.h"
 #include "memory.h"
+#include "output.h"
 #include "value.h"
 #include "object.h"
 
@@ -19,6 +21,19 @@ void freeValueArray(ValueArray *array)
     initValueArray(array);
 }
 
+void reserveValueArray(ValueArray *array, int capacity)
+{
+    if (array->capacity >= capacity)
+        return;
+
+    int oldCapacity = array->capacity;
+    int newCapacity = oldCapacity;
+    while (newCapacity < capacity)
+        newCapacity = GROW_CAPACITY(newCapacity);
+    array->value = GROW_ARRAY(Value, array->value, oldCapacity, newCapacity);
+    array->capacity = newCapacity;
+}
+
 void writeValueArray(ValueArray *array, Value value)
 {
     if (array->capacity < array->count + 1)
@@ -32,19 +47,33 @@ void writeValueArray(ValueArray *array, Value value)
     array->count++;
 }
 
+int formatNumber(Value value, char *buffer)
+{
+    if (IS_INT(value))
+        return formatInt(AS_INT(value), buffer);
+    return formatDouble(AS_DOUBLE(value), buffer);
+}
+
 void printValue(Value value)
 {
     switch (value.type)
     {
     case VAL_BOOL:
-        printf("%s", AS_BOOL(value) ? "true" : "false");
+        if (AS_BOOL(value))
+            writeOutput("true", 4);
+        else
+            writeOutput("false", 5);
         return;
     case VAL_NIL:
-        printf("%s", "nil");
+        writeOutput("nil", 3);
         return;
-    case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
+    case VAL_INT:
+    case VAL_DOUBLE:
+    {
+        char buffer[NUMBER_BUFFER_SIZE];
+        writeOutput(buffer, formatNumber(value, buffer));
         return;
+    }
     case VAL_OBJ:
         printObject(value);
         return;
@@ -53,6 +82,12 @@ void printValue(Value value)
 
 bool valuesEqual(Value a, Value b)
 {
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        if (IS_INT(a) && IS_INT(b))
+            return AS_INT(a) == AS_INT(b);
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
     if (a.type != b.type)
         return false;
     switch (a.type)
@@ -60,9 +95,7 @@ bool valuesEqual(Value a, Value b)
     case VAL_BOOL:
         return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:
-        return false;
-    case VAL_NUMBER:
-        return AS_NUMBER(a) == AS_NUMBER(b);
+        return true;
     case VAL_OBJ:
         return AS_OBJ(a) == AS_OBJ(b);
     default:
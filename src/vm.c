@@ -5,22 +5,149 @@
 #include "common.h"
 #include "vm.h"
 #include "debug.h"
+#include "io.h"
 #include "compiler.h"
+#include "native.h"
 #include "object.h"
 #include "memory.h"
 
-VM vm;
+_Thread_local VM vm;
 
 void resetStack()
 {
+    vm.frames = vm.scriptFrames;
+    vm.frameCount = 0;
+    vm.frameCapacity = FRAMES_MAX;
+    vm.stack = vm.scriptStack;
     vm.stackTop = vm.stack;
+    vm.stackCapacity = STACK_MAX;
+    vm.openUpvalues = NULL;
+    vm.coroutine = NULL;
+}
+
+static inline void saveFiber(Fiber *fiber)
+{
+    fiber->frames = vm.frames;
+    fiber->frameCount = vm.frameCount;
+    fiber->frameCapacity = vm.frameCapacity;
+    fiber->stack = vm.stack;
+    fiber->stackTop = vm.stackTop;
+    fiber->stackCapacity = vm.stackCapacity;
+    fiber->openUpvalues = vm.openUpvalues;
+}
+
+static inline void loadFiber(Fiber *fiber)
+{
+    vm.frames = fiber->frames;
+    vm.frameCount = fiber->frameCount;
+    vm.frameCapacity = fiber->frameCapacity;
+    vm.stack = fiber->stack;
+    vm.stackTop = fiber->stackTop;
+    vm.stackCapacity = fiber->stackCapacity;
+    vm.openUpvalues = fiber->openUpvalues;
+}
+
+// run a suspended coroutine on top of the code resuming it
+static void enterCoroutine(ObjCoroutine *coroutine)
+{
+    saveFiber(&coroutine->resumer);
+    loadFiber(&coroutine->fiber);
+    coroutine->state = COROUTINE_RUNNING;
+    coroutine->previous = vm.coroutine;
+    vm.coroutine = coroutine;
+}
+
+// switch from the running coroutine back to the code that resumed it
+static void leaveCoroutine(CoroutineState state)
+{
+    ObjCoroutine *coroutine = vm.coroutine;
+    saveFiber(&coroutine->fiber);
+    loadFiber(&coroutine->resumer);
+    coroutine->state = state;
+    vm.coroutine = coroutine->previous;
+}
+
+// the upvalue of a stack slot, shared by every closure capturing it
+static ObjUpvalue *captureUpvalue(Value *local)
+{
+    ObjUpvalue *previous = NULL;
+    ObjUpvalue *upvalue = vm.openUpvalues;
+    while (upvalue != NULL && upvalue->location > local)
+    {
+        previous = upvalue;
+        upvalue = upvalue->next;
+    }
+    if (upvalue != NULL && upvalue->location == local)
+        return upvalue;
+
+    ObjUpvalue *created = newUpvalue(local);
+    created->next = upvalue;
+    if (previous == NULL)
+        vm.openUpvalues = created;
+    else
+        previous->next = created;
+    return created;
+}
+
+// move the variables at and above `last` off the stack into their upvalues
+static void closeUpvalues(Value *last)
+{
+    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
+    {
+        ObjUpvalue *upvalue = vm.openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm.openUpvalues = upvalue->next;
+    }
+}
+
+// globals that the failing loop keeps in locals must not look stale to the
+// code run after the error. Loops that call are never promoted, so only the
+// innermost frame can be in one.
+static void writeBackPromoted(CallFrame *frame, int instruction)
+{
+    Chunk *chunk = &frame->function->chunk;
+    for (int i = 0; i < chunk->promotedCount; i++)
+    {
+        PromotedGlobal *promoted = &chunk->promoted[i];
+        if (instruction < promoted->start || instruction >= promoted->end)
+            continue;
+        ObjString *name = AS_STRING(chunk->constants.value[promoted->name]);
+        tableSet(name, frame->slots[promoted->slot], &vm.globals);
+    }
+}
+
+static int frameLine(CallFrame *frame)
+{
+    Chunk *chunk = &frame->function->chunk;
+    return getLine(chunk, (int)(frame->ip - chunk->code - 1));
+}
+
+static void printCallers(CallFrame *frames, int count)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        CallFrame *caller = &frames[i];
+        fprintf(stderr, "[\x1b[32mline %d\x1b[0m] in ", frameLine(caller));
+        if (caller->function->name == NULL)
+            fprintf(stderr, "script\n");
+        else
+            fprintf(stderr, "%s()\n", caller->function->name->chars);
+    }
 }
 
 static void runtimeError(const char *format, ...)
 {
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = getLine(vm.chunk, (int)instruction);
-    fprintf(stderr, "[\x1b[32mline %d\x1b[0m] in scipt \"\x1b[31m", line);
+    // so what was printed before the error comes before it
+    flushOutput();
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    writeBackPromoted(frame, (int)(frame->ip - frame->function->chunk.code - 1));
+    fprintf(stderr, "[\x1b[32mline %d\x1b[0m] in ", frameLine(frame));
+    if (frame->function->name == NULL)
+        fprintf(stderr, "scipt");
+    else
+        fprintf(stderr, "%s()", frame->function->name->chars);
+    fputs(" \"\x1b[31m", stderr);
 
     va_list args;
     va_start(args, format);
@@ -28,349 +155,749 @@ static void runtimeError(const char *format, ...)
     va_end(args);
     fputs("\x1b[0m\"\n", stderr);
 
+    // then where each caller was, through the code resuming the coroutines
+    printCallers(vm.frames, vm.frameCount - 1);
+    for (ObjCoroutine *coroutine = vm.coroutine; coroutine != NULL;
+         coroutine = coroutine->previous)
+    {
+        printCallers(coroutine->resumer.frames, coroutine->resumer.frameCount);
+    }
+
+    // closures kept in globals outlive the stacks, and the coroutines that
+    // were running are abandoned
+    closeUpvalues(vm.stack);
+    while (vm.coroutine != NULL)
+    {
+        leaveCoroutine(COROUTINE_DONE);
+        closeUpvalues(vm.stack);
+    }
     resetStack();
 }
 
-static void concatenate()
+static ObjString *concatenate(ObjString *a, ObjString *b)
 {
-    ObjString *b = AS_STRING(pop());
-    ObjString *a = AS_STRING(pop());
-
     int length = a->length + b->length;
     char *chars = ALLOCATE(char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    ObjString *result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    return takeString(chars, length);
 }
 
 static bool isFalsey(Value value)
 {
-    if (IS_NIL(value))
-        return true;
-    if (IS_BOOL(value))
-        return !AS_BOOL(value);
-    runtimeError("Condition can only be bool or nil.");
-    return false;
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 void initVM()
 {
     resetStack();
     vm.objects = NULL;
+    vm.quickened = 0;
+    vm.deoptimized = 0;
+    vm.registerMachine = false;
+    vm.printCompileTime = false;
+    vm.profileOps = false;
+    memset(&vm.opProfile, 0, sizeof(vm.opProfile));
+    vm.profileSamples = false;
+    vm.samplesDue = 0;
+    vm.nativeError = NULL;
+    vm.suspending = false;
+    initOutput();
     initTable(&vm.strings);
     initTable(&vm.globals);
+    vm.initString = copyString("init", 4);
+    defineNatives();
 }
 
 void freeVM()
 {
+#ifdef DEBUG_PRINT_QUICKEN
+    fprintf(stderr, "quickened %lu instructions, %lu deoptimized (%.1f%%)\n",
+            (unsigned long)vm.quickened, (unsigned long)vm.deoptimized,
+            vm.quickened == 0 ? 0.0 : 100.0 * vm.deoptimized / vm.quickened);
+#endif
+    freeOutput();
+    if (vm.profileOps)
+        printOpProfile(&vm.opProfile);
+    if (vm.profileSamples)
+        stopSampling();
+    freeIo();
     freeTable(&vm.strings);
     freeTable(&vm.globals);
     freeObjects();
 }
 
-#define READ_BYTE() (*vm.ip++)
+// rewrite the instruction at `code` into its quickened form, unless it has
+// already fallen back to the generic one too many times
+static void quicken(Chunk *chunk, uint8_t *code, uint8_t instruction)
+{
+    if (chunk->deopts != NULL && chunk->deopts[code - chunk->code] >= MAX_DEOPTS)
+        return;
+
+    *code = instruction;
+    vm.quickened++;
+}
 
-static int readBytes(int len)
+// undo the quickening of the instruction at `code` after its guard failed
+static void deoptimize(Chunk *chunk, uint8_t *code, uint8_t instruction)
 {
-    int bytes = 0;
-    for (int i = 0; i < len; i++)
+    *code = instruction;
+    vm.deoptimized++;
+
+    if (chunk->deopts == NULL)
     {
-        bytes = (bytes << 8) + READ_BYTE();
+        chunk->deopts = ALLOCATE(uint8_t, chunk->count);
+        memset(chunk->deopts, 0, chunk->count);
     }
-    return bytes;
+    uint8_t *deopts = &chunk->deopts[code - chunk->code];
+    if (*deopts < MAX_DEOPTS)
+        (*deopts)++;
+}
+
+static void cacheGlobal(Chunk *chunk, uint8_t *code, int constant, Entry *entry,
+                        uint8_t quickInstruction)
+{
+    if (chunk->globalSlots == NULL)
+        chunk->globalSlots = ALLOCATE(int, chunk->constants.count);
+
+    chunk->globalSlots[constant] = (int)(entry - vm.globals.entries);
+    quicken(chunk, code, quickInstruction);
 }
 
-Value readConstant(int len)
+// the cached globals table entry of a quickened global instruction, or NULL
+// if the table has changed since it was cached
+static Entry *cachedGlobal(Chunk *chunk, int constant)
 {
-    int constant = 0;
-    for (int i = 0; i < len; i++)
+    int slot = chunk->globalSlots[constant];
+    if (slot >= vm.globals.capacity)
+        return NULL;
+
+    Entry *entry = &vm.globals.entries[slot];
+    if (!IS_OBJ(entry->key) || AS_OBJ(entry->key) != AS_OBJ(chunk->constants.value[constant]))
+        return NULL;
+    return entry;
+}
+
+// make room in the running coroutine's stacks for one more frame and for
+// `slots` values, moving what points into the value stack along with it
+static void growFiber(int slots)
+{
+    if (vm.frameCount == vm.frameCapacity)
+    {
+        int oldCapacity = vm.frameCapacity;
+        vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+        vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, vm.frameCapacity);
+    }
+
+    int oldCapacity = vm.stackCapacity;
+    int newCapacity = oldCapacity;
+    while (slots > newCapacity)
+        newCapacity = GROW_CAPACITY(newCapacity);
+    if (newCapacity == oldCapacity)
+        return;
+
+    Value *oldStack = vm.stack;
+    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, newCapacity);
+    vm.stackCapacity = newCapacity;
+    vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+    for (int i = 0; i < vm.frameCount; i++)
     {
-        constant = (constant << 8) + READ_BYTE();
+        vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+    }
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        upvalue->location = vm.stack + (upvalue->location - oldStack);
     }
-    return vm.chunk->constants.value[constant];
 }
 
-Value readLocal(int len)
+static bool call(ObjFunction *function, ObjClosure *closure, int argCount)
 {
-    int local = 0;
-    for (int i = 0; i < len; i++)
+    if (argCount != function->arity)
     {
-        local = (local << 8) + READ_BYTE();
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
     }
-    return vm.stack[local];
-}
-
-InterpretResult run()
-{
-#define READ_CONSTANT() (vm.chunk->constants.value[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_STRING_LONG(len) AS_STRING(readConstant(len))
-#define BINARY_OP(valueType, op)                        \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtimeError("Operants must be number");    \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
-        double b = AS_NUMBER(pop());                    \
-        *top() = valueType(AS_NUMBER(*top()) op b);     \
-    } while (0)
-
-    for (;;)
+    // only a coroutine's stacks grow to fit the frame, up to
+    // FIBER_FRAMES_MAX frames
+    Value *slots = vm.stackTop - argCount - 1;
+    if (vm.frameCount == vm.frameCapacity ||
+        slots + function->maxSlots > vm.stack + vm.stackCapacity)
     {
-#ifdef DEBUG_TRACE_EXCUTION
-        printf("          ");
-        for (Value *i = vm.stack; i < vm.stackTop; i++)
+        if (vm.coroutine == NULL || vm.frameCount == FIBER_FRAMES_MAX)
         {
-            printf("[");
-            printValue(*i);
-            printf("]");
+            runtimeError("Stack overflow.");
+            return false;
         }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-#endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-        case OP_CONSTANT:
+        growFiber((int)(slots - vm.stack) + function->maxSlots);
+    }
+
+    // the arguments already on the stack become the callee's locals
+    CallFrame *frame = &vm.frames[vm.frameCount++];
+    frame->function = function;
+    frame->closure = closure;
+    frame->ip = function->chunk.code;
+    frame->slots = vm.stackTop - argCount - 1;
+    return true;
+}
+
+static bool callNative(ObjNative *native, int argCount)
+{
+    if (argCount != native->arity)
+    {
+        runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+        return false;
+    }
+
+    Value result = native->function(argCount, vm.stackTop - argCount);
+    if (vm.nativeError != NULL)
+    {
+        runtimeError("%s", vm.nativeError);
+        vm.nativeError = NULL;
+        return false;
+    }
+    vm.stackTop -= argCount + 1;
+    push(result);
+    // one that left its coroutine waiting for I/O switches to the resumer,
+    // which gets nil
+    if (vm.suspending)
+    {
+        vm.suspending = false;
+        leaveCoroutine(COROUTINE_WAITING);
+        push(NIL_VAL);
+    }
+    return true;
+}
+
+// call a method whose receiver is already in the callee slot
+static bool callMethod(Value method, int argCount)
+{
+    if (IS_CLOSURE(method))
+        return call(AS_CLOSURE(method)->function, AS_CLOSURE(method), argCount);
+    return call(AS_FUNCTION(method), NULL, argCount);
+}
+
+// replace the callee and the arguments on top of the stack with a suspended
+// coroutine that makes the call once it is first resumed
+static bool startCoroutine(int argCount)
+{
+    Value callee = vm.stackTop[-argCount - 1];
+    Value receiver = callee;
+    if (IS_BOUND_METHOD(callee))
+    {
+        receiver = AS_BOUND_METHOD(callee)->receiver;
+        callee = AS_BOUND_METHOD(callee)->method;
+    }
+    ObjClosure *closure = NULL;
+    ObjFunction *function;
+    if (IS_CLOSURE(callee))
+    {
+        closure = AS_CLOSURE(callee);
+        function = closure->function;
+    }
+    else if (IS_FUNCTION(callee))
+    {
+        function = AS_FUNCTION(callee);
+    }
+    else
+    {
+        runtimeError("Can only run functions and methods in a coroutine.");
+        return false;
+    }
+    if (argCount != function->arity)
+    {
+        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+
+    ObjCoroutine *coroutine = newCoroutine(function->maxSlots);
+    Fiber *fiber = &coroutine->fiber;
+    memcpy(fiber->stack, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    fiber->stack[0] = receiver;
+    fiber->stackTop = fiber->stack + argCount + 1;
+    CallFrame *frame = &fiber->frames[fiber->frameCount++];
+    frame->function = function;
+    frame->closure = closure;
+    frame->ip = function->chunk.code;
+    frame->slots = fiber->stack;
+
+    vm.stackTop -= argCount + 1;
+    push(OBJ_VAL(coroutine));
+    return true;
+}
+
+static bool callValue(Value callee, int argCount)
+{
+    if (IS_FUNCTION(callee))
+        return call(AS_FUNCTION(callee), NULL, argCount);
+    if (IS_CLOSURE(callee))
+        return call(AS_CLOSURE(callee)->function, AS_CLOSURE(callee), argCount);
+    if (IS_NATIVE(callee))
+        return callNative(AS_NATIVE(callee), argCount);
+    if (IS_BOUND_METHOD(callee))
+    {
+        ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm.stackTop[-argCount - 1] = bound->receiver;
+        return callMethod(bound->method, argCount);
+    }
+    if (IS_CLASS(callee))
+    {
+        ObjClass *klass = AS_CLASS(callee);
+        vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+        if (!IS_NIL(klass->initializer))
+            return callMethod(klass->initializer, argCount);
+        if (argCount != 0)
         {
-            Value constant = READ_CONSTANT();
-            push(constant);
-            break;
+            runtimeError("Expected 0 arguments but got %d.", argCount);
+            return false;
         }
-        case OP_CONSTANT_LONG:
+        return true;
+    }
+
+    runtimeError("Can only call functions and classes.");
+    return false;
+}
+
+// A call in tail position that pushed a frame hands the callee the window
+// and the frame of the function making the call, so recursion through tail
+// calls runs in constant stack. The caller's locals are dead by now, except
+// for those captured by closures, which are closed first.
+static void reuseFrame()
+{
+    CallFrame *caller = &vm.frames[vm.frameCount - 2];
+    CallFrame *callee = &vm.frames[vm.frameCount - 1];
+    if (vm.openUpvalues != NULL)
+        closeUpvalues(caller->slots);
+    int count = (int)(vm.stackTop - callee->slots);
+    memmove(caller->slots, callee->slots, sizeof(Value) * count);
+    vm.stackTop = caller->slots + count;
+    callee->slots = caller->slots;
+    *caller = *callee;
+    vm.frameCount--;
+}
+
+static ObjString *propertyName(Chunk *chunk, PropertyCache *cache)
+{
+    return AS_STRING(chunk->constants.value[cache->name]);
+}
+
+static inline CacheEntry *cachedEntry(PropertyCache *cache, ObjShape *shape)
+{
+    for (int i = 0; i < cache->count; i++)
+    {
+        if (cache->entries[i].shape == shape)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static void addCacheEntry(PropertyCache *cache, CacheEntry *entry)
+{
+    if (cache->count < CACHE_ENTRIES)
+        cache->entries[cache->count++] = *entry;
+}
+
+// find the field or method a read of the property gets from instances of
+// `shape`, returning false if there is neither
+static bool lookupProperty(Chunk *chunk, PropertyCache *cache, ObjShape *shape,
+                           CacheEntry *entry)
+{
+    ObjString *name = propertyName(chunk, cache);
+    entry->shape = shape;
+    entry->next = shape;
+    entry->method = NIL_VAL;
+    entry->index = shapeField(shape, name);
+    if (entry->index == -1 && !tableGet(&shape->klass->methods, name, &entry->method))
+        return false;
+
+    addCacheEntry(cache, entry);
+    return true;
+}
+
+// find the field a store to the property writes in instances of `shape`,
+// and the shape they get if it is a new one
+static void lookupStore(Chunk *chunk, PropertyCache *cache, ObjShape *shape, CacheEntry *entry)
+{
+    ObjString *name = propertyName(chunk, cache);
+    entry->shape = shape;
+    entry->next = shape;
+    entry->method = NIL_VAL;
+    entry->index = shapeField(shape, name);
+    if (entry->index == -1)
+    {
+        entry->next = shapeTransition(shape, name);
+        entry->index = shape->fieldCount;
+    }
+    addCacheEntry(cache, entry);
+}
+
+static void setShape(ObjInstance *instance, ObjShape *shape)
+{
+    if (shape->fieldCount > instance->capacity)
+    {
+        int oldCapacity = instance->capacity;
+        instance->capacity = GROW_CAPACITY(oldCapacity);
+        instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, instance->capacity);
+    }
+    instance->shape = shape;
+}
+
+// the element an index refers to in a list or an array of `count`, or the
+// error it makes
+static const char *elementIndex(int count, Value index, int *element)
+{
+    if (IS_INT(index))
+    {
+        if (AS_INT(index) < 0 || AS_INT(index) >= count)
+            return "Index out of range.";
+        *element = (int)AS_INT(index);
+        return NULL;
+    }
+    if (!IS_NUMBER(index))
+        return "Index must be a number.";
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < count))
+        return "Index out of range.";
+    *element = (int)number;
+    if (*element != number)
+        return "Index must be an integer.";
+    return NULL;
+}
+
+// call a method of the receiver below the arguments without binding it
+static bool invoke(Chunk *chunk, PropertyCache *cache, int argCount)
+{
+    Value receiver = vm.stackTop[-argCount - 1];
+    if (!IS_INSTANCE(receiver))
+    {
+        runtimeError("Only instances have methods.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    CacheEntry *entry = cachedEntry(cache, instance->shape);
+    CacheEntry missed;
+    if (entry == NULL)
+    {
+        entry = &missed;
+        if (!lookupProperty(chunk, cache, instance->shape, entry))
         {
-            Value constant = readConstant(3);
-            push(constant);
-            break;
+            runtimeError("Undefined property '%s'.", propertyName(chunk, cache)->chars);
+            return false;
         }
-        case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-            {
-                concatenate();
-            }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-            {
-                double b = AS_NUMBER(pop());
-                *top() = NUMBER_VAL(AS_NUMBER(*top()) + b);
-            }
-            else
-            {
-                runtimeError("Operands of '+' must be two numbers or two strings");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        case OP_SUBSTRACT:
-            BINARY_OP(NUMBER_VAL, -);
+    }
+
+    if (entry->index == -1)
+        return callMethod(entry->method, argCount);
+    // a field holding something callable
+    vm.stackTop[-argCount - 1] = instance->fields[entry->index];
+    return callValue(vm.stackTop[-argCount - 1], argCount);
+}
+
+void defineNative(const char *name, NativeFn function, int arity)
+{
+    ObjString *string = copyString(name, (int)strlen(name));
+    tableSet(string, OBJ_VAL(newNative(function, arity, string)), &vm.globals);
+}
+
+Value nativeError(const char *message)
+{
+    vm.nativeError = message;
+    return NIL_VAL;
+}
+
+// run() picks the dispatch loop once per call rather than once per instruction
+#define RUN_FUNCTION runPlain
+#include "dispatch.h"
+#undef RUN_FUNCTION
+
+#define PROFILE_OPS
+#define RUN_FUNCTION runProfiled
+#include "dispatch.h"
+#undef RUN_FUNCTION
+#undef PROFILE_OPS
+
+#define SAMPLE_LINES
+#define RUN_FUNCTION runSampled
+#include "dispatch.h"
+#undef RUN_FUNCTION
+#undef SAMPLE_LINES
+
+static InterpretResult run()
+{
+    if (vm.profileOps)
+        return runProfiled();
+    if (vm.profileSamples)
+        return runSampled();
+    return runPlain();
+}
+
+// Interpreter loop of the register machine. Registers are stack slots,
+// so register 0 is the script's slot like local 0 is on the stack machine.
+static InterpretResult runRegisters()
+{
+    CallFrame *frame = &vm.frames[0];
+    uint8_t *ip = frame->ip;
+    Value *registers = frame->slots;
+    Value *constants = frame->function->chunk.constants.value;
+
+#define RK(operand) ((operand) & RK_CONSTANT ? constants[(operand) & ~RK_CONSTANT] \
+                                             : registers[operand])
+#define BX() ((b << 8) | c)
+#define RUNTIME_ERROR(...)                  \
+    do                                      \
+    {                                       \
+        frame->ip = ip;                     \
+        runtimeError(__VA_ARGS__);          \
+        return INTERPRET_RUNTIME_ERROR;     \
+    } while (0)
+#define BINARY_OP(result)                             \
+    do                                                \
+    {                                                 \
+        Value left = RK(b);                           \
+        Value right = RK(c);                          \
+        if (!IS_NUMBER(left) || !IS_NUMBER(right))    \
+        {                                             \
+            RUNTIME_ERROR("Operants must be number"); \
+        }                                             \
+        registers[a] = (result);                      \
+    } while (0)
+#define BITWISE_OP(op)                                                       \
+    do                                                                       \
+    {                                                                        \
+        Value left = RK(b);                                                  \
+        Value right = RK(c);                                                 \
+        if (!IS_INT(left) || !IS_INT(right))                                 \
+            RUNTIME_ERROR("Operands of bitwise operators must be integers."); \
+        registers[a] = INT_VAL(AS_INT(left) op AS_INT(right));               \
+    } while (0)
+#define SHIFT_OP(shiftLeft)                                                  \
+    do                                                                       \
+    {                                                                        \
+        Value left = RK(b);                                                  \
+        Value right = RK(c);                                                 \
+        if (!IS_INT(left) || !IS_INT(right))                                 \
+            RUNTIME_ERROR("Operands of bitwise operators must be integers."); \
+        int64_t result;                                                      \
+        if (!shiftInt(AS_INT(left), AS_INT(right), shiftLeft, &result))      \
+            RUNTIME_ERROR("Shift count must be between 0 and 63.");          \
+        registers[a] = INT_VAL(result);                                      \
+    } while (0)
+
+    for (;;)
+    {
+#ifdef DEBUG_TRACE_EXCUTION
+        flushOutput();
+        disassembleRegisterInstruction(&frame->function->chunk,
+                                       (int)(ip - frame->function->chunk.code));
+#endif
+        uint8_t instruction = ip[0];
+        uint8_t a = ip[1];
+        uint8_t b = ip[2];
+        uint8_t c = ip[3];
+        ip += 4;
+
+        switch (instruction)
+        {
+        case OP_R_LOADK:
+            registers[a] = constants[BX()];
             break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
+        case OP_R_MOVE:
+            registers[a] = registers[b];
             break;
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
+        case OP_R_DEFINE_GLOBAL:
+            tableSet(AS_STRING(constants[BX()]), registers[a], &vm.globals);
             break;
-        case OP_NEGATE:
+        case OP_R_GET_GLOBAL:
         {
-            if (!IS_NUMBER(peek(0)))
+            ObjString *name = AS_STRING(constants[BX()]);
+            if (!tableGet(&vm.globals, name, &registers[a]))
             {
-                runtimeError("Operant of '-' must be a number");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
             }
-            *top() = NUMBER_VAL(-(AS_NUMBER(*top())));
             break;
         }
-        case OP_RETURN:
+        case OP_R_SET_GLOBAL:
         {
-            return INTERPRET_OK;
-        }
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_NIL:
-            push(NIL_VAL);
+            ObjString *name = AS_STRING(constants[BX()]);
+            Entry *entry = tableGetEntry(&vm.globals, name);
+            if (entry == NULL)
+            {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            entry->value = registers[a];
             break;
-        case OP_NOT:
+        }
+        case OP_R_ADD:
         {
-            if (IS_BOOL(peek(0)))
+            Value left = RK(b);
+            Value right = RK(c);
+            if (IS_NUMBER(left) && IS_NUMBER(right))
             {
-                *top() = BOOL_VAL(!(AS_BOOL(*top())));
+                registers[a] = addNumbers(left, right);
             }
-            else if (IS_NIL(peek(0)))
+            else if (IS_STRING(left) && IS_STRING(right))
             {
-                *top() = BOOL_VAL(true);
+                registers[a] = OBJ_VAL(concatenate(AS_STRING(left), AS_STRING(right)));
             }
             else
             {
-                runtimeError("Operant of '!' must be a bool or nil");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operands of '+' must be two numbers or two strings");
             }
             break;
         }
-        case OP_EQUAL:
-        {
-            Value b = pop();
-            *top() = BOOL_VAL(valuesEqual(*top(), b));
+        case OP_R_SUBSTRACT:
+            BINARY_OP(subtractNumbers(left, right));
             break;
-        }
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
+        case OP_R_MULTIPLY:
+            BINARY_OP(multiplyNumbers(left, right));
             break;
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
+        case OP_R_DIVIDE:
+            BINARY_OP(divideNumbers(left, right));
             break;
-        case OP_PRINT:
-        {
-            printValue(pop());
-            printf("\n");
+        case OP_R_MODULO:
+            BINARY_OP(moduloNumbers(left, right));
             break;
-        }
-        case OP_POP:
-            pop();
+        case OP_R_EQUAL:
+            registers[a] = BOOL_VAL(valuesEqual(RK(b), RK(c)));
             break;
-        case OP_DEFINE_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            tableSet(name, peek(0), &vm.globals);
-            pop();
+        case OP_R_LESS:
+            BINARY_OP(BOOL_VAL(lessNumbers(left, right)));
             break;
-        }
-        case OP_DEFINE_GLOBAL_LONG:
-        {
-            ObjString *name = READ_STRING_LONG(3);
-            tableSet(name, peek(0), &vm.globals);
-            pop();
+        case OP_R_GREATER:
+            BINARY_OP(BOOL_VAL(greaterNumbers(left, right)));
             break;
-        }
-        case OP_GET_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!tableGet(&vm.globals, name, &value))
-            {
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(value);
+        case OP_R_BIT_AND:
+            BITWISE_OP(&);
             break;
-        }
-        case OP_GET_GLOBAL_LONG:
+        case OP_R_BIT_OR:
+            BITWISE_OP(|);
+            break;
+        case OP_R_BIT_XOR:
+            BITWISE_OP(^);
+            break;
+        case OP_R_SHIFT_LEFT:
+            SHIFT_OP(true);
+            break;
+        case OP_R_SHIFT_RIGHT:
+            SHIFT_OP(false);
+            break;
+        case OP_R_NEGATE:
         {
-            ObjString *name = READ_STRING_LONG(3);
-            Value value;
-            if (!tableGet(&vm.globals, name, &value))
+            Value operand = RK(b);
+            if (!IS_NUMBER(operand))
             {
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operant of '-' must be a number");
             }
-            push(value);
+            registers[a] = negateNumber(operand);
             break;
         }
-        case OP_SET_GLOBAL:
+        case OP_R_BIT_NOT:
         {
-            ObjString *name = READ_STRING();
-            Value value = peek(0);
-            if (tableSet(name, value, &vm.globals))
+            Value operand = RK(b);
+            if (!IS_INT(operand))
             {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operand of '~' must be an integer.");
             }
+            registers[a] = INT_VAL(~AS_INT(operand));
             break;
         }
-        case OP_SET_GLOBAL_LONG:
+        case OP_R_NOT:
         {
-            ObjString *name = READ_STRING_LONG(3);
-            Value value = peek(0);
-            if (tableSet(name, value, &vm.globals))
+            Value operand = RK(b);
+            if (!IS_BOOL(operand) && !IS_NIL(operand))
             {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operant of '!' must be a bool or nil");
             }
+            registers[a] = BOOL_VAL(isFalsey(operand));
             break;
         }
-        case OP_GET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            push(vm.stack[slot]);
-            break;
-        }
-        case OP_GET_LOCAL_LONG:
-        {
-            int slot = readBytes(3);
-            push(vm.stack[slot]);
+        case OP_R_PRINT:
+            printValue(registers[a]);
+            endLine();
             break;
-        }
-        case OP_SET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            vm.stack[slot] = peek(0);
+        case OP_R_JUMP:
+            ip += BX();
             break;
-        }
-        case OP_SET_LOCAL_LONG:
-        {
-            int slot = readBytes(3);
-            vm.stack[slot] = peek(0);
+        case OP_R_JUMP_BACK:
+            ip -= BX();
             break;
-        }
-        case OP_JUMP:
+        case OP_R_JUMP_IF_FALSE:
         {
-            uint16_t offset = readBytes(2);
-            vm.ip += offset;
-            break;
-        }
-        case OP_JUMP_BACK:
-        {
-            uint16_t offset = readBytes(2);
-            vm.ip -= offset;
-            break;
-        }
-        case OP_JUMP_IF_FALSE:
-        {
-            uint16_t offset = readBytes(2);
-            if (isFalsey(peek(0)))
-                vm.ip += offset;
+            Value condition = registers[a];
+            if (!IS_BOOL(condition) && !IS_NIL(condition))
+            {
+                RUNTIME_ERROR("Condition can only be bool or nil.");
+            }
+            if (isFalsey(condition))
+                ip += BX();
             break;
         }
+        case OP_R_RETURN:
+            resetStack();
+            return INTERPRET_OK;
         }
     }
+#undef RK
+#undef BX
+#undef RUNTIME_ERROR
 #undef BINARY_OP
-#undef READ_CONSTANT
-#undef READ_BYTE
-#undef READ_STRING
-#undef READ_STRING_LONG
+#undef BITWISE_OP
+#undef SHIFT_OP
 }
 
 InterpretResult interpret(const char *source)
 {
-    Chunk chunk;
-    initChunk(&chunk);
-
-    if (!compile(source, &chunk))
+    ObjFunction *script = vm.registerMachine ? compileRegisters(source) : compile(source);
+    if (vm.printCompileTime)
     {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+        fprintf(stderr, "compile: parse %.3fms, optimize %.3fms, generate %.3fms\n",
+                compileTimes.parse * 1e3, compileTimes.optimize * 1e3,
+                compileTimes.generate * 1e3);
     }
+    if (script == NULL)
+        return INTERPRET_COMPILE_ERROR;
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
-
-    InterpretResult result = run();
+    // slot 0 belongs to the running script
+    resetStack();
+    push(OBJ_VAL(script));
+    CallFrame *frame = &vm.frames[vm.frameCount++];
+    frame->function = script;
+    frame->closure = NULL;
+    frame->ip = script->chunk.code;
+    frame->slots = vm.stack;
 
-    freeChunk(&chunk);
+    // the time spent compiling belongs to no line
+    vm.samplesDue = 0;
+    InterpretResult result = vm.registerMachine ? runRegisters() : run();
+    flushOutput();
     return result;
 }
 
+InterpretResult callFunction(Value callee, Value *args, int argCount, Value *result)
+{
+    resetStack();
+    push(callee);
+    for (int i = 0; i < argCount; i++)
+        push(args[i]);
+    if (!callValue(callee, argCount))
+        return INTERPRET_RUNTIME_ERROR;
+
+    // natives, and classes without an initializer, are done already
+    if (vm.frameCount > 0)
+    {
+        InterpretResult status = run();
+        if (status != INTERPRET_OK)
+            return status;
+    }
+    *result = pop();
+    return INTERPRET_OK;
+}
+
 void push(Value value)
 {
-    ASSERT(vm.stackTop <= vm.stack + STACK_MAX, "stack overflow");
+    ASSERT(vm.stackTop < vm.stack + vm.stackCapacity, "stack overflow");
     *vm.stackTop = value;
     vm.stackTop++;
 }
@@ -394,4 +921,4 @@ Value peek(int distance)
 {
     ASSERT(vm.stackTop >= vm.stack + distance + 1, "there's no enough item in stack");
     return vm.stackTop[-1 - distance];
-}
\ No newline at end of file
+}